@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "riscv_sim.h"
+
+/* throughput benchmark: `make bench`, or bench [-r <reps>] [-e <engine>]... <workload>... */
+
+#define MAX_ENGINES 8
+
+static const char *ALL_ENGINES[] = { "interp", "threaded", "block", "jit" };
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/***************************************************************/
+/* Run one workload reps times on a fresh machine and print the best run. Called in a   */
+/* child process so the peak RSS it reports belongs to this workload and engine only.  */
+/***************************************************************/
+static int bench_one(const char *path, const char *engine, int reps)
+{
+	riscv_sim_t *sim;
+	struct rusage usage;
+	double start, elapsed, best = 0;
+	uint32_t instructions = 0;
+	int32_t code;
+	int i;
+
+	if ((sim = riscv_sim_create()) == NULL) {
+		printf("Error: Out of memory\n");
+		return 1;
+	}
+	if (!riscv_sim_set_engine(sim, engine)) {
+		printf("%-20s %-9s unavailable\n", path, engine);
+		riscv_sim_destroy(sim);
+		return 0;
+	}
+	if (riscv_sim_load(sim, path) < 0) {
+		riscv_sim_destroy(sim);
+		return 1;
+	}
+	for (i = 0; i < reps; i++) {
+		if (i > 0) {
+			riscv_sim_reset(sim);
+		}
+		start = now();
+		code = riscv_sim_run(sim);
+		elapsed = now() - start;
+		/* every workload checks its own result and exits 0 */
+		if (code != 0) {
+			printf("%-20s %-9s exited with %d\n", path, engine, code);
+			riscv_sim_destroy(sim);
+			return 1;
+		}
+		if (i == 0 || elapsed < best) {
+			best = elapsed;
+		}
+		instructions = riscv_sim_instructions(sim);
+	}
+	getrusage(RUSAGE_SELF, &usage);
+	printf("%-20s %-9s %12u %9.3f %9.1f %8.2f %9ld\n", path, engine, instructions, best,
+		instructions / best / 1e6, best * 1e9 / instructions, usage.ru_maxrss);
+	riscv_sim_destroy(sim);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-r <reps>] [-e <engine>]... <workload>...\n", prog);
+	printf("  -r <reps>\truns of each workload; the fastest is reported (default 5)\n");
+	printf("  -e <engine>\tinterp, threaded, block or jit (repeatable; default all of them)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *engines[MAX_ENGINES];
+	int num_engines = 0, reps = 5, failed = 0, status, opt, i, j;
+	pid_t child;
+
+	while ((opt = getopt(argc, argv, "r:e:")) != -1) {
+		switch (opt) {
+			case 'r':
+				reps = atoi(optarg);
+				if (reps < 1) {
+					printf("Error: Bad repetition count %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'e':
+				if (num_engines == MAX_ENGINES) {
+					printf("Error: At most %d engines\n", MAX_ENGINES);
+					exit(1);
+				}
+				engines[num_engines++] = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				exit(1);
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
+		exit(1);
+	}
+	if (num_engines == 0) {
+		for (i = 0; i < 4; i++) {
+			engines[num_engines++] = ALL_ENGINES[i];
+		}
+	}
+
+	printf("%-20s %-9s %12s %9s %9s %8s %9s\n", "workload", "engine", "instructions", "best s", "MIPS",
+		"ns/inst", "RSS KiB");
+	for (i = optind; i < argc; i++) {
+		for (j = 0; j < num_engines; j++) {
+			fflush(stdout);
+			if ((child = fork()) == 0) {
+				exit(bench_one(argv[i], engines[j], reps));
+			}
+			if (child < 0 || waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+				failed = 1;
+			}
+		}
+	}
+	return failed;
+}
@@ -0,0 +1,34 @@
+# Data-dependent branches: 2M xorshift32 values, each steering three branches.
+  lui s0, 0x12345
+  addi s0, s0, 0x678
+  li t0, 0
+  lui t1, 0x200
+  li a0, 0
+  li a1, 0
+  li a2, 0
+  li t4, 4
+loop:
+  slli t2, s0, 13
+  xor s0, s0, t2
+  srli t2, s0, 17
+  xor s0, s0, t2
+  slli t2, s0, 5
+  xor s0, s0, t2
+  andi t3, s0, 1
+  beq t3, zero, even
+  addi a0, a0, 1
+  j next
+even:
+  addi a1, a1, 1
+next:
+  andi t3, s0, 6
+  bltu t3, t4, low
+  addi a2, a2, 3
+low:
+  blt s0, zero, neg
+  addi a0, a0, 2
+neg:
+  addi t0, t0, 1
+  bne t0, t1, loop
+  li a7, 10
+  ecall
@@ -0,0 +1,19 @@
+# Integer ALU loop: 3M iterations of dependent register-register and immediate ops.
+  li t0, 0
+  lui t1, 0x300
+  li a0, 0
+  li a1, 1
+loop:
+  addi t0, t0, 1
+  add a0, a0, t0
+  xor a1, a1, a0
+  slli a2, a1, 3
+  srli a3, a2, 5
+  or a4, a3, a0
+  and a5, a4, a1
+  sub a0, a0, a5
+  sltu a6, a0, a1
+  add a1, a1, a6
+  bne t0, t1, loop
+  li a7, 10
+  ecall
@@ -0,0 +1,69 @@
+# 32x32 integer matrix multiply, 16 times, with a shift-and-add multiply routine
+# called through jal/jalr as RV32I code without the M extension would.
+  lui s0, 0x10010
+  lui s1, 0x10011
+  lui s2, 0x10012
+  li t0, 0
+  li t1, 1024
+fill:
+  slli t2, t0, 2
+  add t3, s0, t2
+  andi t4, t0, 15
+  sw t4, 0(t3)
+  add t3, s1, t2
+  xori t4, t0, 5
+  andi t4, t4, 15
+  sw t4, 0(t3)
+  addi t0, t0, 1
+  bne t0, t1, fill
+  li s10, 0
+  li s11, 16
+rep:
+  li s3, 0
+iloop:
+  li s4, 0
+jloop:
+  li s6, 0
+  li s5, 0
+kloop:
+  slli t0, s3, 5
+  add t0, t0, s5
+  slli t0, t0, 2
+  add t0, s0, t0
+  lw a0, 0(t0)
+  slli t0, s5, 5
+  add t0, t0, s4
+  slli t0, t0, 2
+  add t0, s1, t0
+  lw a1, 0(t0)
+  jal ra, mul
+  add s6, s6, a0
+  addi s5, s5, 1
+  li t0, 32
+  bne s5, t0, kloop
+  slli t0, s3, 5
+  add t0, t0, s4
+  slli t0, t0, 2
+  add t0, s2, t0
+  sw s6, 0(t0)
+  addi s4, s4, 1
+  li t0, 32
+  bne s4, t0, jloop
+  addi s3, s3, 1
+  bne s3, t0, iloop
+  addi s10, s10, 1
+  bne s10, s11, rep
+  li a7, 10
+  ecall
+mul:
+  li t1, 0
+mloop:
+  andi t2, a1, 1
+  beq t2, zero, mskip
+  add t1, t1, a0
+mskip:
+  slli a0, a0, 1
+  srli a1, a1, 1
+  bne a1, zero, mloop
+  mv a0, t1
+  jalr zero, 0(ra)
@@ -0,0 +1,49 @@
+# Load/store streams: copy 64 KiB word by word (4 words per iteration) 512 times,
+# then 16 KiB byte by byte 32 times.
+  lui s0, 0x10010
+  lui s1, 0x10020
+  lui s2, 0x10
+  add s3, s0, s2
+  mv t0, s0
+  li t1, 0
+fill:
+  sw t1, 0(t0)
+  addi t1, t1, 7
+  addi t0, t0, 4
+  bne t0, s3, fill
+  li s4, 0
+  li s5, 512
+pass:
+  mv t0, s0
+  mv t1, s1
+copy:
+  lw t2, 0(t0)
+  lw t3, 4(t0)
+  lw t4, 8(t0)
+  lw t5, 12(t0)
+  sw t2, 0(t1)
+  sw t3, 4(t1)
+  sw t4, 8(t1)
+  sw t5, 12(t1)
+  addi t0, t0, 16
+  addi t1, t1, 16
+  bne t0, s3, copy
+  addi s4, s4, 1
+  bne s4, s5, pass
+  lui s2, 0x4
+  add s3, s0, s2
+  li s4, 0
+  li s5, 32
+bpass:
+  mv t0, s0
+  mv t1, s1
+bcopy:
+  lbu t2, 0(t0)
+  sb t2, 0(t1)
+  addi t0, t0, 1
+  addi t1, t1, 1
+  bne t0, s3, bcopy
+  addi s4, s4, 1
+  bne s4, s5, bpass
+  li a7, 10
+  ecall
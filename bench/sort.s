@@ -0,0 +1,52 @@
+# Insertion sort of 4096 xorshift32 words, then a check that exits with the number
+# of out-of-order neighbours (0).
+  lui s0, 0x10010
+  li s1, 1
+  slli s1, s1, 12
+  slli s2, s1, 2
+  add s2, s0, s2
+  lui s3, 0x12345
+  addi s3, s3, 0x678
+  mv t0, s0
+fill:
+  slli t2, s3, 13
+  xor s3, s3, t2
+  srli t2, s3, 17
+  xor s3, s3, t2
+  slli t2, s3, 5
+  xor s3, s3, t2
+  sw s3, 0(t0)
+  addi t0, t0, 4
+  bne t0, s2, fill
+  addi t0, s0, 4
+outer:
+  beq t0, s2, done
+  lw t1, 0(t0)
+  addi t2, t0, -4
+inner:
+  bltu t2, s0, place
+  lw t3, 0(t2)
+  bge t1, t3, place
+  sw t3, 4(t2)
+  addi t2, t2, -4
+  j inner
+place:
+  sw t1, 4(t2)
+  addi t0, t0, 4
+  j outer
+done:
+  li a0, 0
+  mv t0, s0
+  addi t5, s2, -4
+check:
+  beq t0, t5, exit
+  lw t1, 0(t0)
+  lw t2, 4(t0)
+  bge t2, t1, ok
+  addi a0, a0, 1
+ok:
+  addi t0, t0, 4
+  j check
+exit:
+  li a7, 93
+  ecall
@@ -0,0 +1,639 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "mu-riscv.h"
+
+/***************************************************************/
+/* GDB remote serial protocol stub for the first hart.                                           */
+/* A software breakpoint is an ebreak written over the instruction, so continue runs on  */
+/* the selected engine at full speed and only the trap drops into the interpreter.      */
+/* Watchpoints (Z2-Z4) map onto watch_add() and run in the interpreter like the REPL's. */
+/***************************************************************/
+#define GDB_PACKET_SIZE 4096	/* largest packet either side sends */
+#define GDB_CHUNK 1000000		/* instructions continue runs between looks for a ^C */
+#define GDB_MAX_BREAKPOINTS 64
+#define GDB_NUM_REGS 33		/* x0-x31 and pc */
+
+typedef struct {
+	int fd;
+	int no_ack;		/* QStartNoAckMode: neither side sends + or - */
+	uint8_t in[GDB_PACKET_SIZE];
+	uint32_t in_len, in_pos;
+	char packet[GDB_PACKET_SIZE + 1];	/* the request being served */
+	char reply[2 * GDB_PACKET_SIZE + 8];
+	uint32_t breakpoints[GDB_MAX_BREAKPOINTS];
+	uint32_t saved[GDB_MAX_BREAKPOINTS];	/* the instructions the ebreaks replaced */
+	uint32_t num_breakpoints;
+	watch_t watches[MAX_WATCHES];
+	char watch_types[MAX_WATCHES];	/* '2' write, '3' read, '4' access, as in the Z packet */
+	uint32_t num_watches;
+} gdb_t;
+
+static const char *const GDB_REG_NAMES[GDB_NUM_REGS] = {
+	"zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2", "fp", "s1", "a0", "a1", "a2", "a3", "a4", "a5",
+	"a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6", "pc"
+};
+
+static int gdb_hex(int c)
+{
+	return c >= 'a' ? c - 'a' + 10 : c >= 'A' ? c - 'A' + 10 : c - '0';
+}
+
+/* TRUE for a TCP port rather than a unix socket path */
+static bool gdb_is_port(const char *where)
+{
+	return *where != '\0' && strspn(where, "0123456789") == strlen(where);
+}
+
+/* next byte from the debugger; -1 once it has gone */
+static int gdb_getc(gdb_t *g)
+{
+	ssize_t n;
+
+	if (g->in_pos == g->in_len) {
+		do {
+			n = recv(g->fd, g->in, sizeof(g->in), 0);
+		} while (n < 0 && errno == EINTR);
+		if (n <= 0) {
+			return -1;
+		}
+		g->in_len = n;
+		g->in_pos = 0;
+	}
+	return g->in[g->in_pos++];
+}
+
+/* TRUE if the debugger sent a ^C while the guest ran */
+static bool gdb_interrupted(gdb_t *g)
+{
+	uint8_t c;
+
+	while (g->in_pos < g->in_len) {
+		if (g->in[g->in_pos++] == 0x03) {
+			return true;
+		}
+	}
+	return recv(g->fd, &c, 1, MSG_DONTWAIT) == 1 && c == 0x03;
+}
+
+static bool gdb_write(gdb_t *g, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(g->fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+/* frame data as $data#checksum and send it until the debugger acknowledges it */
+static bool gdb_send(gdb_t *g, const char *data)
+{
+	static const char hex[] = "0123456789abcdef";
+	char frame[sizeof(g->reply) + 4];
+	size_t len = strlen(data);
+	uint8_t sum = 0;
+	size_t i;
+	int c;
+
+	frame[0] = '$';
+	for (i = 0; i < len; i++) {
+		sum += (uint8_t)data[i];
+	}
+	memcpy(frame + 1, data, len);
+	frame[len + 1] = '#';
+	frame[len + 2] = hex[sum >> 4];
+	frame[len + 3] = hex[sum & 15];
+	do {
+		if (!gdb_write(g, frame, len + 4)) {
+			return false;
+		}
+		if (g->no_ack) {
+			return true;
+		}
+		do {
+			c = gdb_getc(g);
+		} while (c >= 0 && c != '+' && c != '-');
+	} while (c == '-');
+	return c == '+';
+}
+
+/* read the next packet into g->packet; its length, or -1 once the debugger has gone */
+static int gdb_receive(gdb_t *g)
+{
+	uint32_t len;
+	uint8_t sum;
+	int c, hi, lo;
+
+	for (;;) {
+		do {
+			c = gdb_getc(g);
+		} while (c >= 0 && c != '$');
+		if (c < 0) {
+			return -1;
+		}
+		len = 0;
+		sum = 0;
+		while ((c = gdb_getc(g)) >= 0 && c != '#') {
+			if (len < GDB_PACKET_SIZE) {
+				g->packet[len++] = c;
+			}
+			sum += c;
+		}
+		if (c < 0 || (hi = gdb_getc(g)) < 0 || (lo = gdb_getc(g)) < 0) {
+			return -1;
+		}
+		g->packet[len] = '\0';
+		if (g->no_ack) {
+			return len;
+		}
+		if (((gdb_hex(hi) << 4) | gdb_hex(lo)) == sum) {
+			return gdb_write(g, "+", 1) ? (int)len : -1;
+		}
+		if (!gdb_write(g, "-", 1)) {
+			return -1;
+		}
+	}
+}
+
+/* a register as the target's little-endian bytes in hex */
+static char *gdb_put_word(char *out, uint32_t value)
+{
+	sprintf(out, "%02x%02x%02x%02x", value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, value >> 24);
+	return out + 8;
+}
+
+static uint32_t gdb_get_word(const char *in)
+{
+	uint32_t value = 0;
+	int i;
+
+	for (i = 0; i < 4 && in[2 * i] && in[2 * i + 1]; i++) {
+		value |= (uint32_t)((gdb_hex(in[2 * i]) << 4) | gdb_hex(in[2 * i + 1])) << (8 * i);
+	}
+	return value;
+}
+
+static uint32_t gdb_read_reg(uint32_t reg)
+{
+	return reg == 32 ? CURRENT_STATE.PC : CURRENT_STATE.REGS[reg];
+}
+
+static void gdb_write_reg(uint32_t reg, uint32_t value)
+{
+	if (reg == 32) {
+		CURRENT_STATE.PC = value;
+	} else if (reg != 0) {
+		CURRENT_STATE.REGS[reg] = value;
+	}
+}
+
+/* guest memory as the debugger should see it, without the ebreaks it asked for */
+static uint8_t gdb_read_byte(gdb_t *g, uint32_t address)
+{
+	uint32_t i;
+
+	for (i = 0; i < g->num_breakpoints; i++) {
+		if (address - g->breakpoints[i] < 4) {
+			return g->saved[i] >> (8 * (address - g->breakpoints[i]));
+		}
+	}
+	return mem_read_8(address);
+}
+
+/* a debugger write; bytes under an inserted breakpoint go to the saved word, and the ebreak stays */
+static void gdb_write_byte(gdb_t *g, uint32_t address, uint8_t value)
+{
+	uint32_t i, shift;
+
+	for (i = 0; i < g->num_breakpoints; i++) {
+		if (address - g->breakpoints[i] < 4) {
+			shift = 8 * (address - g->breakpoints[i]);
+			g->saved[i] = (g->saved[i] & ~(0xFFu << shift)) | ((uint32_t)value << shift);
+			return;
+		}
+	}
+	mem_write_8(address, value);
+}
+
+static int gdb_find_breakpoint(gdb_t *g, uint32_t address)
+{
+	uint32_t i;
+
+	for (i = 0; i < g->num_breakpoints; i++) {
+		if (g->breakpoints[i] == address) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static const char *gdb_insert_breakpoint(gdb_t *g, uint32_t address)
+{
+	if (gdb_find_breakpoint(g, address) >= 0) {
+		return "OK";
+	}
+	if ((address & 3) != 0 || g->num_breakpoints == GDB_MAX_BREAKPOINTS) {
+		return "E01";
+	}
+	g->breakpoints[g->num_breakpoints] = address;
+	g->saved[g->num_breakpoints] = mem_read_32(address);
+	g->num_breakpoints++;
+	mem_write_32(address, EBREAK_INSTRUCTION);
+	return "OK";
+}
+
+static const char *gdb_remove_breakpoint(gdb_t *g, uint32_t address)
+{
+	int i = gdb_find_breakpoint(g, address);
+
+	if (i < 0) {
+		return "E01";
+	}
+	mem_write_32(address, g->saved[i]);
+	g->num_breakpoints--;
+	g->breakpoints[i] = g->breakpoints[g->num_breakpoints];
+	g->saved[i] = g->saved[g->num_breakpoints];
+	return "OK";
+}
+
+/* the machine's watchpoints are exactly the debugger's */
+static void gdb_sync_watches(gdb_t *g)
+{
+	uint32_t i;
+
+	watch_clear();
+	for (i = 0; i < g->num_watches; i++) {
+		watch_add(g->watches[i].address, g->watches[i].kind);
+	}
+}
+
+static const char *gdb_watch(gdb_t *g, char type, uint32_t address, bool insert)
+{
+	int kind = type == '2' ? WATCH_WRITE : type == '3' ? WATCH_READ : WATCH_READ | WATCH_WRITE;
+	uint32_t i;
+
+	for (i = 0; i < g->num_watches; i++) {
+		if (g->watches[i].address == address && g->watch_types[i] == type) {
+			break;
+		}
+	}
+	if (insert && i == g->num_watches) {
+		if (g->num_watches == MAX_WATCHES) {
+			return "E01";
+		}
+		g->watches[i].address = address;
+		g->watches[i].kind = kind;
+		g->watch_types[i] = type;
+		g->num_watches++;
+	} else if (!insert) {
+		if (i == g->num_watches) {
+			return "E01";
+		}
+		g->num_watches--;
+		g->watches[i] = g->watches[g->num_watches];
+		g->watch_types[i] = g->watch_types[g->num_watches];
+	}
+	gdb_sync_watches(g);
+	return "OK";
+}
+
+/* why the guest is not running, as a stop reply */
+static void gdb_stop_reply(gdb_t *g, bool interrupted)
+{
+	const char *kind = "watch";
+	uint32_t i;
+
+	switch (DEBUG_STOP.kind) {
+	case STOP_READ:
+	case STOP_WRITE:
+		for (i = 0; i < g->num_watches; i++) {
+			if (DEBUG_STOP.address < (uint64_t)g->watches[i].address + WATCH_SIZE &&
+					g->watches[i].address <= DEBUG_STOP.address) {
+				kind = g->watch_types[i] == '3' ? "rwatch" : g->watch_types[i] == '4' ? "awatch" : "watch";
+				break;
+			}
+		}
+		sprintf(g->reply, "T05%s:%x;", kind, DEBUG_STOP.address);
+		break;
+	default:
+		if (!RUN_FLAG) {
+			sprintf(g->reply, "W%02x", EXIT_CODE & 0xFF);
+		} else {
+			strcpy(g->reply, interrupted ? "S02" : "S05");
+		}
+		break;
+	}
+}
+
+/* c and s: run on the selected engine in chunks, looking for a ^C in between */
+static void gdb_resume(gdb_t *g, bool step)
+{
+	bool interrupted = false;
+	int i = gdb_find_breakpoint(g, CURRENT_STATE.PC);
+
+	DEBUG_STOP.kind = STOP_NONE;
+	/* a breakpoint the guest stopped on runs its own instruction to get past */
+	if (RUN_FLAG && (step || i >= 0)) {
+		if (i >= 0) {
+			mem_write_32(g->breakpoints[i], g->saved[i]);
+		}
+		execute(1);
+		if (i >= 0) {
+			mem_write_32(g->breakpoints[i], EBREAK_INSTRUCTION);
+		}
+	}
+	while (RUN_FLAG && !step && DEBUG_STOP.kind == STOP_NONE && !interrupted) {
+		execute(GDB_CHUNK);
+		interrupted = DEBUG_STOP.kind == STOP_NONE && gdb_interrupted(g);
+	}
+	/* an ebreak stops the run the way an exit does; the guest carries on from it */
+	if (DEBUG_STOP.kind == STOP_BREAK) {
+		RUN_FLAG = TRUE;
+	}
+	console_flush();
+	gdb_stop_reply(g, interrupted);
+}
+
+/* qXfer:features:read:target.xml: registers x0-x31 and pc, so no FPU or CSRs are asked for */
+static void gdb_target_xml(gdb_t *g, const char *args)
+{
+	static char xml[4096];
+	uint32_t offset, length, len, i;
+	size_t n;
+
+	if (sscanf(args, "%x,%x", &offset, &length) != 2) {
+		strcpy(g->reply, "E01");
+		return;
+	}
+	n = sprintf(xml, "<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+		"<target version=\"1.0\"><architecture>riscv:rv32</architecture>"
+		"<feature name=\"org.gnu.gdb.riscv.cpu\">");
+	for (i = 0; i < GDB_NUM_REGS; i++) {
+		n += sprintf(xml + n, "<reg name=\"%s\" bitsize=\"32\" type=\"%s\"/>", GDB_REG_NAMES[i],
+			i == 32 || i == 1 ? "code_ptr" : i == 2 || i == 8 ? "data_ptr" : "int");
+	}
+	n += sprintf(xml + n, "</feature></target>");
+	len = offset >= n ? 0 : n - offset;
+	if (length > GDB_PACKET_SIZE - 1) {
+		length = GDB_PACKET_SIZE - 1;
+	}
+	g->reply[0] = len > length ? 'm' : 'l';
+	len = len > length ? length : len;
+	memcpy(g->reply + 1, xml + offset, len);
+	g->reply[len + 1] = '\0';
+}
+
+static void gdb_query(gdb_t *g)
+{
+	const char *p = g->packet;
+
+	if (strncmp(p, "qSupported", 10) == 0) {
+		sprintf(g->reply, "PacketSize=%x;qXfer:features:read+;QStartNoAckMode+", GDB_PACKET_SIZE);
+	} else if (strncmp(p, "qXfer:features:read:target.xml:", 31) == 0) {
+		gdb_target_xml(g, p + 31);
+	} else if (strcmp(p, "qAttached") == 0) {
+		strcpy(g->reply, "1");
+	} else if (strcmp(p, "qC") == 0) {
+		strcpy(g->reply, "QC1");
+	} else if (strcmp(p, "qfThreadInfo") == 0) {
+		strcpy(g->reply, "m1");
+	} else if (strcmp(p, "qsThreadInfo") == 0) {
+		strcpy(g->reply, "l");
+	}
+}
+
+/* serve one request; FALSE once the session is over */
+static bool gdb_handle(gdb_t *g)
+{
+	char *p = g->packet + 1, *out;
+	uint32_t address, length, reg, i;
+	char type;
+
+	g->reply[0] = '\0';
+	switch (g->packet[0]) {
+	case '?':
+		gdb_stop_reply(g, false);
+		break;
+	case 'g':
+		out = g->reply;
+		for (i = 0; i < GDB_NUM_REGS; i++) {
+			out = gdb_put_word(out, gdb_read_reg(i));
+		}
+		break;
+	case 'G':
+		for (i = 0; i < GDB_NUM_REGS && strlen(p) >= 8 * (i + 1); i++) {
+			gdb_write_reg(i, gdb_get_word(p + 8 * i));
+		}
+		strcpy(g->reply, "OK");
+		break;
+	case 'p':
+		reg = strtoul(p, NULL, 16);
+		if (reg < GDB_NUM_REGS) {
+			gdb_put_word(g->reply, gdb_read_reg(reg));
+		} else {
+			strcpy(g->reply, "E01");
+		}
+		break;
+	case 'P':
+		reg = strtoul(p, &p, 16);
+		if (reg < GDB_NUM_REGS && *p == '=') {
+			gdb_write_reg(reg, gdb_get_word(p + 1));
+			strcpy(g->reply, "OK");
+		} else {
+			strcpy(g->reply, "E01");
+		}
+		break;
+	case 'm':
+		if (sscanf(p, "%x,%x", &address, &length) != 2 || length > GDB_PACKET_SIZE / 2) {
+			strcpy(g->reply, "E01");
+			break;
+		}
+		out = g->reply;
+		for (i = 0; i < length; i++) {
+			out += sprintf(out, "%02x", gdb_read_byte(g, address + i));
+		}
+		break;
+	case 'M':
+		if (sscanf(p, "%x,%x", &address, &length) != 2 || (p = strchr(p, ':')) == NULL ||
+				strlen(p + 1) < 2 * length) {
+			strcpy(g->reply, "E01");
+			break;
+		}
+		for (i = 0, p++; i < length; i++, p += 2) {
+			gdb_write_byte(g, address + i, (gdb_hex(p[0]) << 4) | gdb_hex(p[1]));
+		}
+		strcpy(g->reply, "OK");
+		break;
+	case 'c':
+	case 's':
+		if (*p != '\0') {
+			CURRENT_STATE.PC = strtoul(p, NULL, 16);
+		}
+		gdb_resume(g, g->packet[0] == 's');
+		break;
+	case 'Z':
+	case 'z':
+		type = *p;
+		if (sscanf(p + 1, ",%x,%x", &address, &length) != 2) {
+			strcpy(g->reply, "E01");
+		} else if (type == '0') {
+			strcpy(g->reply, g->packet[0] == 'Z' ? gdb_insert_breakpoint(g, address) : gdb_remove_breakpoint(g, address));
+		} else if (type >= '2' && type <= '4') {
+			strcpy(g->reply, gdb_watch(g, type, address, g->packet[0] == 'Z'));
+		}
+		break;
+	case 'H':
+	case 'T':
+		strcpy(g->reply, "OK");
+		break;
+	case 'q':
+		gdb_query(g);
+		break;
+	case 'Q':
+		if (strcmp(g->packet, "QStartNoAckMode") == 0) {
+			gdb_send(g, "OK");
+			g->no_ack = TRUE;
+			return true;
+		}
+		break;
+	case 'D':
+		gdb_send(g, "OK");
+		return false;
+	case 'k':
+		return false;
+	case 'v':
+		if (strncmp(g->packet, "vKill", 5) == 0) {
+			gdb_send(g, "OK");
+			return false;
+		}
+		break;
+	}
+	return gdb_send(g, g->reply);
+}
+
+/* a listening socket on localhost:<port>, or at a unix socket path; -1 after printing why not */
+static int gdb_listen(const char *where)
+{
+	struct sockaddr_in in;
+	struct sockaddr_un un;
+	long port = strtol(where, NULL, 10);
+	int fd, one = 1;
+
+	if (gdb_is_port(where)) {
+		if (port < 1 || port > 65535) {
+			printf("Error: Bad GDB port %s\n", where);
+			return -1;
+		}
+		memset(&in, 0, sizeof(in));
+		in.sin_family = AF_INET;
+		in.sin_port = htons(port);
+		in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+			printf("Error: Can't create a socket for GDB\n");
+			return -1;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, (struct sockaddr *)&in, sizeof(in)) < 0 || listen(fd, 1) < 0) {
+			printf("Error: Can't listen for GDB on port %ld\n", port);
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+	if (strlen(where) >= sizeof(un.sun_path)) {
+		printf("Error: GDB socket path %s is too long\n", where);
+		return -1;
+	}
+	memset(&un, 0, sizeof(un));
+	un.sun_family = AF_UNIX;
+	strcpy(un.sun_path, where);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		printf("Error: Can't create a socket for GDB\n");
+		return -1;
+	}
+	unlink(where);
+	if (bind(fd, (struct sockaddr *)&un, sizeof(un)) < 0 || listen(fd, 1) < 0) {
+		printf("Error: Can't listen for GDB on %s\n", where);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/***************************************************************/
+/* Wait for a debugger on where (a TCP port on localhost or a unix socket path) and    */
+/* serve it until it detaches or goes. FALSE if there was no session.                     */
+/***************************************************************/
+int gdb_serve(const char *where)
+{
+	gdb_t *g;
+	int listener, one = 1;
+	uint32_t i;
+
+	if (NUM_HARTS > 1) {
+		printf("Error: GDB can only debug a single hart\n");
+		return FALSE;
+	}
+	if ((listener = gdb_listen(where)) < 0) {
+		return FALSE;
+	}
+	if ((g = calloc(1, sizeof(gdb_t))) == NULL) {
+		printf("Error: Out of memory for the GDB stub\n");
+		exit(-1);
+	}
+	printf("Waiting for GDB on %s...\n", where);
+	fflush(stdout);
+	g->fd = accept(listener, NULL, NULL);
+	close(listener);
+	if (!gdb_is_port(where)) {
+		unlink(where);
+	}
+	if (g->fd < 0) {
+		printf("Error: Can't accept a GDB connection\n");
+		free(g);
+		return FALSE;
+	}
+	setsockopt(g->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	EBREAK_TRAPS = TRUE;
+	while (gdb_receive(g) >= 0 && gdb_handle(g)) {
+	}
+	EBREAK_TRAPS = FALSE;
+
+	/* the guest goes on without the debugger's breakpoints and watchpoints */
+	for (i = 0; i < g->num_breakpoints; i++) {
+		mem_write_32(g->breakpoints[i], g->saved[i]);
+	}
+	if (g->num_watches > 0) {
+		watch_clear();
+	}
+	close(g->fd);
+	free(g);
+	console_flush();
+	return TRUE;
+}
+
+int riscv_sim_gdb(riscv_sim_t *sim, const char *where)
+{
+	SIM = sim;
+	return gdb_serve(where);
+}
@@ -4,28 +4,25 @@
 #include <stdint.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <time.h>
 
 #include "mu-riscv.h"
 
-/***************************************************************/
-/* Print out a list of commands available                                                                  */
-/***************************************************************/
-void help() {        
-	printf("------------------------------------------------------------------\n\n");
-	printf("\t**********MU-RISCV Help MENU**********\n\n");
-	printf("sim\t-- simulate program to completion \n");
-	printf("run <n>\t-- simulate program for <n> instructions\n");
-	printf("rdump\t-- dump register values\n");
-	printf("reset\t-- clears all registers/memory and re-loads the program\n");
-	printf("input <reg> <val>\t-- set GPR <reg> to <val>\n");
-	printf("mdump <start> <stop>\t-- dump memory from <start> to <stop> address\n");
-	printf("high <val>\t-- set the HI register to <val>\n");
-	printf("low <val>\t-- set the LO register to <val>\n");
-	printf("print\t-- print the program loaded into memory\n");
-	printf("?\t-- display help menu\n");
-	printf("quit\t-- exit the simulator\n\n");
-	printf("------------------------------------------------------------------\n\n");
-}
+/* the simulator the calling thread is working on */
+__thread riscv_sim_t *SIM;
+
+mem_region_t MEM_REGIONS[NUM_MEM_REGION] = {
+	{ MEM_TEXT_BEGIN, MEM_TEXT_END },
+	{ MEM_DATA_BEGIN, MEM_DATA_END },
+	{ MEM_KDATA_BEGIN, MEM_KDATA_END },
+	{ MEM_KTEXT_BEGIN, MEM_KTEXT_END }
+};
 
 /***************************************************************/
 /* Turn a byte to a word                                                                          */
@@ -46,961 +43,4488 @@ uint32_t half_to_word(uint16_t half)
 }
 
 /***************************************************************/
-/* Read a 32-bit word from memory                                                                            */
+/* Find the memory region holding an address (NULL if none)                            */
 /***************************************************************/
-uint32_t mem_read_32(uint32_t address)
+static inline mem_region_t *find_region(uint32_t address)
 {
 	int i;
 	for (i = 0; i < NUM_MEM_REGION; i++) {
 		if ( (address >= MEM_REGIONS[i].begin) &&  ( address <= MEM_REGIONS[i].end) ) {
-			uint32_t offset = address - MEM_REGIONS[i].begin;
-			return (MEM_REGIONS[i].mem[offset+3] << 24) |
-					(MEM_REGIONS[i].mem[offset+2] << 16) |
-					(MEM_REGIONS[i].mem[offset+1] <<  8) |
-					(MEM_REGIONS[i].mem[offset+0] <<  0);
+			return &MEM_REGIONS[i];
 		}
 	}
-	return 0;
+	return NULL;
 }
 
-uint32_t mem_read_16(uint32_t address, uint32_t value)
+/***************************************************************/
+/* Note a page that stopped being shared with SNAPSHOT_BASE                                 */
+/***************************************************************/
+static void page_dirty(uint32_t address)
 {
-	int i;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		if ( (address >= MEM_REGIONS[i].begin) &&  ( address <= MEM_REGIONS[i].end) ) {
-			uint32_t offset = address - MEM_REGIONS[i].begin;
-			return	(MEM_REGIONS[i].mem[offset+1] <<  8) |
-					(MEM_REGIONS[i].mem[offset+0] <<  0);
+	if (SNAPSHOT_BASE == NULL) {
+		return;
+	}
+	if (NUM_DIRTY == DIRTY_CAPACITY) {
+		DIRTY_CAPACITY = DIRTY_CAPACITY ? DIRTY_CAPACITY * 2 : 64;
+		DIRTY_PAGES = realloc(DIRTY_PAGES, DIRTY_CAPACITY * sizeof(uint32_t));
+		if (DIRTY_PAGES == NULL) {
+			printf("Error: Out of memory tracking dirty pages\n");
+			exit(-1);
 		}
 	}
-	return 0;
-	
+	DIRTY_PAGES[NUM_DIRTY++] = address >> PAGE_SHIFT;
 }
 
-uint32_t mem_read_8(uint32_t address, uint32_t value)
+static uint8_t *page_alloc(uint32_t address)
 {
-	int i;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		if ( (address >= MEM_REGIONS[i].begin) &&  ( address <= MEM_REGIONS[i].end) ) {
-			uint32_t offset = address - MEM_REGIONS[i].begin;
-			return	(MEM_REGIONS[i].mem[offset+0] <<  0);
-		}
+	uint8_t *page = calloc(1, PAGE_SIZE + sizeof(uint32_t));
+	if (page == NULL) {
+		printf("Error: Out of memory allocating page at 0x%08x\n", address & ~PAGE_MASK);
+		exit(-1);
+	}
+	PAGE_REFS(page) = 1;
+	return page;
+}
+
+/* drop one holder of a page, freeing it with the last */
+static void page_release(uint8_t *page)
+{
+	if (page != NULL && --PAGE_REFS(page) == 0) {
+		free(page);
 	}
-	return 0;
 }
 
 /***************************************************************/
-/* Write a 32-bit word to memory                                                                                */
+/* Make the page backing an address private to the live memory, creating it (and its    */
+/* page table) if needed. Harts on other threads may be doing the same, so the table    */
+/* is only changed under MEMORY_LOCK and new entries are published with release stores. */
 /***************************************************************/
-void mem_write_32(uint32_t address, uint32_t value)
+static uint8_t *page_private(uint32_t address)
 {
-	int i;
-	uint32_t offset;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		if ( (address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end) ) {
-			offset = address - MEM_REGIONS[i].begin;
+	uint8_t **l2, *page, *copy;
 
-			MEM_REGIONS[i].mem[offset+3] = (value >> 24) & 0xFF;
-			MEM_REGIONS[i].mem[offset+2] = (value >> 16) & 0xFF;
-			MEM_REGIONS[i].mem[offset+1] = (value >>  8) & 0xFF;
-			MEM_REGIONS[i].mem[offset+0] = (value >>  0) & 0xFF;
+	pthread_mutex_lock(&MEMORY_LOCK);
+	l2 = PAGE_TABLE[PT_L1_INDEX(address)];
+	if (l2 == NULL) {
+		l2 = calloc(PT_L2_ENTRIES, sizeof(uint8_t *));
+		if (l2 == NULL) {
+			printf("Error: Out of memory allocating page table\n");
+			exit(-1);
 		}
+		__atomic_store_n(&PAGE_TABLE[PT_L1_INDEX(address)], l2, __ATOMIC_RELEASE);
 	}
-}
 
-void SYSCALL(CPU_State given_state)
-{
-	uint32_t code = given_state.REGS[2];
-	//TODO : implement the rest of the syscall codes....
-	switch(code)
-	{
-		case(1):
-			//print int
-			printf("%d\n",given_state.REGS[4]);
-			break;
-		case(2):
-			//print float in f12
-			break;
-		case(3):
-			//print double in f12
-			break;
-		case(4):
-			//print string in memory address $a0
-			break;
-		case(5):
-			//read int to $v0
-			(void) scanf("%d", &NEXT_STATE.REGS[2]);
-			break;
-		case(6):
-			//read float
-			scanf("%f", (float*) &NEXT_STATE.REGS[2]);
-			break;
-		case(7):
-			//read double
-			scanf("%lf", (double*) &NEXT_STATE.REGS[2]);
-			break;
-		case(8):
-			//read string
-			//$a0 = memory address of string input buffer
-			// $a1 = length of string buffer (n)
-			break;
-		case(9):
-			//sbrk
-			break;
-		case(10):
-			RUN_FLAG = FALSE;
-			break;
-		default:
-			break;
+	page = l2[PT_L2_INDEX(address)];
+	if (page == NULL) {
+		page = page_alloc(address);
+		__atomic_store_n(&l2[PT_L2_INDEX(address)], page, __ATOMIC_RELEASE);
+		PAGES_ALLOCATED++;
+		page_dirty(address);
+	} else if (PAGE_REFS(page) > 1) {
+		/* copy on write */
+		copy = page_alloc(address);
+		memcpy(copy, page, PAGE_SIZE);
+		PAGE_REFS(page)--;
+		page = copy;
+		__atomic_store_n(&l2[PT_L2_INDEX(address)], page, __ATOMIC_RELEASE);
+		page_dirty(address);
+		tlb_flush();
 	}
-
+	pthread_mutex_unlock(&MEMORY_LOCK);
+	return page;
 }
 
 /***************************************************************/
-/* Execute one cycle                                                                                                              */
+/* Return the host page backing an address.                                                   */
+/* Untouched pages return NULL unless alloc is set, in which case a zeroed page is created.  */
+/* alloc means the caller is about to write, so a page shared with a snapshot is copied.     */
 /***************************************************************/
-void cycle() {                                                
-	handle_instruction();
-	CURRENT_STATE = NEXT_STATE;
-	SYSCALL(CURRENT_STATE);
-	INSTRUCTION_COUNT++;
-	//if(PROGRAM_SIZE == INSTRUCTION_COUNT) RUN_FLAG = false; //end program after handling last instruction
-	if(CURRENT_STATE.PC > (PROGRAM_SIZE * 4) + MEM_TEXT_BEGIN) RUN_FLAG = false;
+static inline uint8_t *page_lookup(uint32_t address, bool alloc)
+{
+	uint8_t **l2 = __atomic_load_n(&PAGE_TABLE[PT_L1_INDEX(address)], __ATOMIC_ACQUIRE);
+	uint8_t *page;
+
+	if (l2 == NULL) {
+		return alloc ? page_private(address) : NULL;
+	}
+	page = __atomic_load_n(&l2[PT_L2_INDEX(address)], __ATOMIC_ACQUIRE);
+	if (!alloc || (page != NULL && PAGE_REFS(page) == 1)) {
+		return page;
+	}
+	return page_private(address);
 }
 
 /***************************************************************/
-/* Simulate RISCV for n cycles                                                                                       */
+/* Watchpoints. Their pages are flagged in WATCH_PAGES and kept out of the TLBs, so      */
+/* only accesses to those pages reach watch_access(); the rest take the usual paths.    */
 /***************************************************************/
-void run(int num_cycles) {                                      
-	
-	if (RUN_FLAG == FALSE) {
-		printf("Simulation Stopped\n\n");
+static inline bool page_watched(uint32_t address)
+{
+	return WATCH_PAGES != NULL && ((WATCH_PAGES[address >> (PAGE_SHIFT + 3)] >> ((address >> PAGE_SHIFT) & 7)) & 1);
+}
+
+static void debug_stop(stop_kind_t kind, uint32_t pc, uint32_t address)
+{
+	DEBUG_STOP.hart = HART_ID;
+	DEBUG_STOP.pc = pc;
+	DEBUG_STOP.address = address;
+	__atomic_store_n(&DEBUG_STOP.kind, kind, __ATOMIC_RELEASE);
+}
+
+/* an access to a watched page; it counts if the running instruction made it */
+static void watch_access(uint32_t address, uint32_t size, bool write)
+{
+	uint32_t i;
+
+	if (!WATCH_ARMED) {
 		return;
 	}
-
-	printf("Running simulator for %d cycles...\n\n", num_cycles);
-	int i;
-	for (i = 0; i < num_cycles; i++) {
-		if (RUN_FLAG == FALSE) {
-			printf("Simulation Stopped.\n\n");
-			break;
+	for (i = 0; i < NUM_WATCHES; i++) {
+		/* in 64 bits so a word at the top of the address space doesn't wrap to 0 */
+		if (address < (uint64_t)WATCHES[i].address + WATCH_SIZE && WATCHES[i].address < (uint64_t)address + size &&
+				(WATCHES[i].kind & (write ? WATCH_WRITE : WATCH_READ))) {
+			debug_stop(write ? STOP_WRITE : STOP_READ, CURRENT_STATE.PC, address);
+			return;
 		}
-		cycle();
 	}
 }
 
-/**************************************************************rdump*/
-/* simulate to completion                                                                                               */
 /***************************************************************/
-void runAll() {                                                     
-	if (RUN_FLAG == FALSE) {
-		printf("Simulation Stopped.\n\n");
-		return;
-	}
+/* Software TLB. Each hart caches the backing page of recently used guest pages, so a   */
+/* hit skips the region search and the page table walk. A page that is replaced (copy  */
+/* on write, snapshot restore, reset) or becomes shared bumps PAGE_EPOCH, which makes  */
+/* every hart drop its entries on its next access. Untouched and watched pages are not  */
+/* cached.                                                                                   */
+/***************************************************************/
+void tlb_flush()
+{
+	__atomic_add_fetch(&PAGE_EPOCH, 1, __ATOMIC_RELEASE);
+}
 
-	printf("Simulation Started...\n\n");
-	while (RUN_FLAG){
-		cycle();
+static void tlb_clear(uint32_t epoch)
+{
+	uint32_t i;
+	for (i = 0; i < TLB_ENTRIES; i++) {
+		TLB[i].tag = TLB_INVALID;
 	}
-	printf("Simulation Finished.\n\n");
+	TLB_EPOCH = epoch;
 }
 
-/***************************************************************/ 
-/* Dump a word-aligned region of memory to the terminal                              */
-/***************************************************************/
-void mdump(uint32_t start, uint32_t stop) {          
-	uint32_t address;
+static uint8_t *tlb_fill(uint32_t address, uint32_t size, bool write)
+{
+	uint32_t epoch = __atomic_load_n(&PAGE_EPOCH, __ATOMIC_ACQUIRE);
+	tlb_entry_t *entry = &TLB[(address >> PAGE_SHIFT) & (TLB_ENTRIES - 1)];
+	uint8_t *page;
 
-	printf("-------------------------------------------------------------\n");
-	printf("Memory content [0x%08x..0x%08x] :\n", start, stop);
-	printf("-------------------------------------------------------------\n");
-	printf("\t[Address in Hex (Dec) ]\t[Value]\n");
-	for (address = start; address <= stop; address += 4){
-		printf("\t0x%08x (%d) :\t0x%08x\n", address, address, mem_read_32(address));
+	TLB_MISSES++;
+	if (TLB_EPOCH != epoch) {
+		tlb_clear(epoch);
+	}
+	if (find_region(address) == NULL) {
+		return NULL;
+	}
+	page = page_lookup(address, write);
+	if (page_watched(address)) {
+		watch_access(address, size, write);
+		return page;
+	}
+	if (page != NULL) {
+		entry->tag = address & ~PAGE_MASK;
+		entry->writable = PAGE_REFS(page) == 1;
+		entry->page = page;
 	}
-	printf("\n");
+	return page;
 }
 
-/***************************************************************/
-/* Dump current values of registers to the teminal                                              */   
-/***************************************************************/
-void rdump() {                               
-	int i; 
-	printf("-------------------------------------\n");
-	printf("Dumping Register Content\n");
-	printf("-------------------------------------\n");
-	printf("# Instructions Executed\t: %u\n", INSTRUCTION_COUNT);
-	printf("PC\t: 0x%08x\n", CURRENT_STATE.PC);
-	printf("-------------------------------------\n");
-	printf("[Register]\t[Value]\n");
-	printf("-------------------------------------\n");
-	for (i = 0; i < RISCV_REGS; i++){
-		printf("[R%d]\t: 0x%08x\n", i, CURRENT_STATE.REGS[i]);
+/* the backing page of an address in a region, as page_lookup(); NULL outside every region */
+static inline uint8_t *tlb_lookup(uint32_t address, uint32_t size, bool write)
+{
+	tlb_entry_t *entry = &TLB[(address >> PAGE_SHIFT) & (TLB_ENTRIES - 1)];
+
+	if (entry->tag == (address & ~PAGE_MASK) && (entry->writable || !write) &&
+			TLB_EPOCH == __atomic_load_n(&PAGE_EPOCH, __ATOMIC_RELAXED)) {
+		TLB_HITS++;
+		return entry->page;
 	}
-	printf("-------------------------------------\n");
-	printf("[HI]\t: 0x%08x\n", CURRENT_STATE.HI);
-	printf("[LO]\t: 0x%08x\n", CURRENT_STATE.LO);
-	printf("-------------------------------------\n");
+	return tlb_fill(address, size, write);
 }
 
 /***************************************************************/
-/* Read a command from standard input.                                                               */  
+/* Byte at a time; used when an access straddles a page                                      */
 /***************************************************************/
-void handle_command() {                         
-	char buffer[20];
-	uint32_t start, stop, cycles;
-	uint32_t register_no;
-	int register_value;
-	int hi_reg_value, lo_reg_value;
-
-	printf("MU-RISCV SIM:> ");
+static uint32_t read_bytes(uint32_t address, uint32_t size)
+{
+	uint32_t value = 0, i;
+	uint8_t *page;
 
-	if (scanf("%s", buffer) == EOF){
-		exit(0);
+	for (i = 0; i < size; i++) {
+		if (page_watched(address + i)) {
+			watch_access(address + i, 1, false);
+		}
+		if (find_region(address + i) != NULL && (page = page_lookup(address + i, false)) != NULL) {
+			value |= page[(address + i) & PAGE_MASK] << (i * 8);
+		}
 	}
+	return value;
+}
 
-	switch(buffer[0]) {
-		case 'S':
-		case 's':
-			runAll(); 
-			break;
-		case 'M':
-		case 'm':
-			if (scanf("%x %x", &start, &stop) != 2){
-				break;
-			}
-			mdump(start, stop);
-			break;
-		case '?':
-			help();
-			break;
-		case 'Q':
-		case 'q':
-			printf("**************************\n");
-			printf("Exiting MU-RISCV! Good Bye...\n");
-			printf("**************************\n");
-			exit(0);
-		case 'R':
-		case 'r':
-			if (buffer[1] == 'd' || buffer[1] == 'D'){
-				rdump();
-			}else if(buffer[1] == 'e' || buffer[1] == 'E'){
-				reset();
-			}
-			else {
-				if (scanf("%d", &cycles) != 1) {
-					break;
-				}
-				run(cycles);
-			}
-			break;
-		case 'I':
-		case 'i':
-			if (scanf("%u %i", &register_no, &register_value) != 2){
-				break;
-			}
-			CURRENT_STATE.REGS[register_no] = register_value;
-			NEXT_STATE.REGS[register_no] = register_value;
-			break;
-		case 'H':
-		case 'h':
-			if (scanf("%i", &hi_reg_value) != 1){
-				break;
-			}
-			CURRENT_STATE.HI = hi_reg_value; 
-			NEXT_STATE.HI = hi_reg_value; 
-			break;
-		case 'L':
-		case 'l':
-			if (scanf("%i", &lo_reg_value) != 1){
-				break;
-			}
-			CURRENT_STATE.LO = lo_reg_value;
-			NEXT_STATE.LO = lo_reg_value;
-			break;
-		case 'P':
-		case 'p':
-			print_program(); 
-			break;
-		default:
-			printf("Invalid Command.\n");
-			break;
+static void write_bytes(uint32_t address, uint32_t value, uint32_t size)
+{
+	uint32_t i;
+
+	for (i = 0; i < size; i++) {
+		if (page_watched(address + i)) {
+			watch_access(address + i, 1, true);
+		}
+		if (find_region(address + i) != NULL) {
+			page_lookup(address + i, true)[(address + i) & PAGE_MASK] = value >> (i * 8);
+			decode_invalidate(address + i);
+		}
 	}
 }
 
 /***************************************************************/
-/* reset registers/memory and reload program                                                    */
+/* Sized loads and stores. Guest memory is little-endian, as the host keeps it, so an  */
+/* access within one page (and so one region) is a single, possibly misaligned, host    */
+/* load or store of its size. Loads zero-extend.                                           */
 /***************************************************************/
-void reset() {   
-	int i;
-	/*reset registers*/
-	for (i = 0; i < RISCV_REGS; i++){
-		CURRENT_STATE.REGS[i] = 0;
+static inline uint32_t mem_read(uint32_t address, uint32_t size)
+{
+	uint32_t value = 0;
+	uint8_t *page;
+
+	if ((address & PAGE_MASK) > PAGE_SIZE - size) {
+		return read_bytes(address, size);
 	}
-	CURRENT_STATE.HI = 0;
-	CURRENT_STATE.LO = 0;
-	
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		memset(MEM_REGIONS[i].mem, 0, region_size);
+	page = tlb_lookup(address, size, false);
+	if (page != NULL) {
+		memcpy(&value, page + (address & PAGE_MASK), size);
 	}
-	
-	/*load program*/
-	load_program();
-	
-	/*reset PC*/
-	INSTRUCTION_COUNT = 0;
-	CURRENT_STATE.PC =  MEM_TEXT_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
-	RUN_FLAG = TRUE;
+	return value;
 }
 
-/***************************************************************/
-/* Allocate and set memory to zero                                                                            */
-/***************************************************************/
-void init_memory() {                                           
-	int i;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		MEM_REGIONS[i].mem = malloc(region_size);
-		memset(MEM_REGIONS[i].mem, 0, region_size);
-	}
-}
+static inline void mem_write(uint32_t address, uint32_t value, uint32_t size)
+{
+	uint8_t *page;
 
-/**************************************************************/
-/* load program into memory                                                                                      */
-/**************************************************************/
-void load_program() {                   
-	FILE * fp;
-	int i, word;
-	uint32_t address;
-	/* Open program file. */
-	fp = fopen(prog_file, "r");
-	if (fp == NULL) {
-		printf("Error: Can't open program file %s\n", prog_file);
-		exit(-1);
+	if ((address & PAGE_MASK) > PAGE_SIZE - size) {
+		write_bytes(address, value, size);
+		return;
 	}
-
-	/* Read in the program. */
-
-	i = 0;
-	while( fscanf(fp, "%x\n", &word) != EOF ) {
-		address = MEM_TEXT_BEGIN + i;
-		mem_write_32(address, word);
-		printf("writing 0x%08x into address 0x%08x (%d)\n", word, address, address);
-		i += 4;
+	page = tlb_lookup(address, size, true);
+	if (page == NULL) {
+		return;
+	}
+	memcpy(page + (address & PAGE_MASK), &value, size);
+	decode_invalidate(address);
+	if (size > 1) {
+		decode_invalidate(address + size - 1);
 	}
-	PROGRAM_SIZE = i/4;
-	printf("Program loaded into memory.\n%d words written into memory.\n\n", PROGRAM_SIZE);
-	fclose(fp);
 }
 
-static inline uint32_t rd_get(uint32_t instruction)
+uint32_t mem_read_8(uint32_t address)
 {
-	return (instruction & 0xF80) >> 7;
+	return mem_read(address, 1);
 }
 
-static inline uint32_t funct3_get(uint32_t instruction)
+uint32_t mem_read_16(uint32_t address)
 {
-	return (instruction & 0x7000) >> 12;
+	return mem_read(address, 2);
 }
 
-static inline uint32_t rs1_get(uint32_t instruction)
+uint32_t mem_read_32(uint32_t address)
 {
-	return (instruction & 0xf8000) >> 15;
+	return mem_read(address, 4);
 }
 
-static inline uint32_t rs2_get(uint32_t instruction)
+/* an instruction fetch; it reads the word without tripping read watchpoints */
+static uint32_t fetch_32(uint32_t address)
 {
-	return (instruction & 0x1f00000) >> 20;
+	int armed = WATCH_ARMED;
+	uint32_t word;
+
+	WATCH_ARMED = FALSE;
+	word = mem_read_32(address);
+	WATCH_ARMED = armed;
+	return word;
 }
 
-static inline uint32_t funct7_get(uint32_t instruction)
+void mem_write_8(uint32_t address, uint32_t value)
 {
-	return (instruction & 0xfe000000) >> 25;
+	mem_write(address, value, 1);
 }
 
-static inline uint32_t bigImm_get(uint32_t instruction)
+void mem_write_16(uint32_t address, uint32_t value)
 {
-	return (instruction & 0xfff00000) >> 20;
+	mem_write(address, value, 2);
 }
 
-void R_Processing(uint32_t rd, uint32_t f3, uint32_t rs1, uint32_t rs2, uint32_t f7) {
-	//printf("internal debugging: rd = %x , f3 = %x , rs1 = %x , rs2 = %x , f7 = %x\n" ,rd,f3,rs1,rs2,f7 );
-	switch(f3){
-		case 0:
-			switch(f7){
-				case 0:		//add
-					NEXT_STATE.REGS[rd] = NEXT_STATE.REGS[rs1] + NEXT_STATE.REGS[rs2];
-					break;
-				case 32:	//sub
-					NEXT_STATE.REGS[rd] = NEXT_STATE.REGS[rs1] - NEXT_STATE.REGS[rs2];
-					break;
-				default:
-					RUN_FLAG = FALSE;
-					break;
-				}	
-			break;
-		case 1:				//left shift logical
-			NEXT_STATE.REGS[rd] = (NEXT_STATE.REGS[rs1] << NEXT_STATE.REGS[rs2]);
-			break;
-		case 2:				//set less than
-			NEXT_STATE.REGS[rd] = (rs1 < rs2)?1:0;
-			break;
-		case 3:				//set less than unsigned
-			NEXT_STATE.REGS[rd] = (rs1 < rs2)?1:0;
-			break;
-		case 4:				//xor
-			NEXT_STATE.REGS[rd] = (NEXT_STATE.REGS[rs1] ^ NEXT_STATE.REGS[rs2]);
-			break;
-		case 5:
-			switch(f7){
-				case 0:		//right shift logical
-					NEXT_STATE.REGS[rd] = (NEXT_STATE.REGS[rs1] >> rs2);
-					break;
-				case 32:	//right shift arithmetic
-					NEXT_STATE.REGS[rd] = (NEXT_STATE.REGS[rs1] >> rs2);
-					break;
-			}
+void mem_write_32(uint32_t address, uint32_t value)
+{
+	mem_write(address, value, 4);
+}
 
+/* note a load or store in RETIRE; returns the value */
+static inline uint32_t retire_load(uint32_t address, uint32_t size, uint32_t value)
+{
+	RETIRE.access |= RETIRE_LOAD;
+	RETIRE.size = size;
+	RETIRE.address = address;
+	RETIRE.loaded = value;
+	return value;
+}
 
-		case 6: 			//or
-			NEXT_STATE.REGS[rd] = (NEXT_STATE.REGS[rs1] | NEXT_STATE.REGS[rs2]);
-			break;
-		case 7:				//and
-			NEXT_STATE.REGS[rd] = (NEXT_STATE.REGS[rs1] & NEXT_STATE.REGS[rs2]);
-			break;
-		default:
-			RUN_FLAG = FALSE;
-			break;
-	} 			
+static inline void retire_store(uint32_t address, uint32_t size, uint32_t value)
+{
+	RETIRE.access |= RETIRE_STORE;
+	RETIRE.size = size;
+	RETIRE.address = address;
+	RETIRE.stored = size == 4 ? value : value & ((1u << (size * 8)) - 1);
 }
 
-void ILoad_Processing(uint32_t rd, uint32_t f3, uint32_t rs1, uint32_t imm) {
-	// I noticed that this function reads the memory address from NEXT_STATE rather than CURRENT_STATE.
-	// That's probably fine since the two should be the same at this point,
-	// but it might cause problems in the future if we need to implement pipelining.
-	switch (f3)
-	{
-	case 0: //lb
-		NEXT_STATE.REGS[rd] = byte_to_word((mem_read_32(NEXT_STATE.REGS[rs1] + imm)) & 0xFF);
-		break;
+/***************************************************************/
+/* RV32A. Aligned words inside a region are updated with host atomics on the page itself */
+/* (guest words are stored little-endian, as the host keeps them). Misaligned ones are   */
+/* done as a plain load and store, where the hardware would trap.                          */
+/***************************************************************/
+static uint32_t amo_apply(uint8_t op, uint32_t old, uint32_t value)
+{
+	switch (op) {
+	case OP_AMOSWAP_W: return value;
+	case OP_AMOADD_W: return old + value;
+	case OP_AMOXOR_W: return old ^ value;
+	case OP_AMOAND_W: return old & value;
+	case OP_AMOOR_W: return old | value;
+	case OP_AMOMIN_W: return (int32_t)old < (int32_t)value ? old : value;
+	case OP_AMOMAX_W: return (int32_t)old > (int32_t)value ? old : value;
+	case OP_AMOMINU_W: return old < value ? old : value;
+	default: return old > value ? old : value;
+	}
+}
 
-	case 1: //lh
-		NEXT_STATE.REGS[rd] = half_to_word((mem_read_32(NEXT_STATE.REGS[rs1] + imm)) & 0xFFFF);
-		break;
+static inline bool atomic_capable(uint32_t address)
+{
+	return (address & 3) == 0 && find_region(address) != NULL;
+}
 
-	case 2: //lw
-		NEXT_STATE.REGS[rd] = mem_read_32(NEXT_STATE.REGS[rs1] + imm);
-		break;
-	case 4:
-		// lbu load byte unsigned
-		NEXT_STATE.REGS[rd] = (mem_read_32(NEXT_STATE.REGS[rs1] + imm)) & 0xFF;
-		break;
-	case 5:
-		// lhu load half unsigned
-		NEXT_STATE.REGS[rd] = (mem_read_32(NEXT_STATE.REGS[rs1] + imm)) & 0xFFFF;
-		break;
-	
+/* returns the old word, which becomes op(old, value) */
+static uint32_t atomic_rmw(uint8_t op, uint32_t address, uint32_t value)
+{
+	uint32_t *word, old;
+
+	if (!atomic_capable(address)) {
+		old = mem_read_32(address);
+		mem_write_32(address, amo_apply(op, old, value));
+		retire_load(address, 4, old);
+		retire_store(address, 4, amo_apply(op, old, value));
+		return old;
+	}
+	if (page_watched(address)) {
+		watch_access(address, 4, true);
+	}
+	word = (uint32_t *)(page_lookup(address, true) + (address & PAGE_MASK));
+	switch (op) {
+	case OP_AMOSWAP_W: old = __atomic_exchange_n(word, value, __ATOMIC_SEQ_CST); break;
+	case OP_AMOADD_W: old = __atomic_fetch_add(word, value, __ATOMIC_SEQ_CST); break;
+	case OP_AMOXOR_W: old = __atomic_fetch_xor(word, value, __ATOMIC_SEQ_CST); break;
+	case OP_AMOAND_W: old = __atomic_fetch_and(word, value, __ATOMIC_SEQ_CST); break;
+	case OP_AMOOR_W: old = __atomic_fetch_or(word, value, __ATOMIC_SEQ_CST); break;
 	default:
-		printf("Invalid instruction");
-		RUN_FLAG = FALSE;
+		old = __atomic_load_n(word, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(word, &old, amo_apply(op, old, value), false,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		}
 		break;
 	}
+	decode_invalidate(address);
+	retire_load(address, 4, old);
+	retire_store(address, 4, amo_apply(op, old, value));
+	return old;
 }
 
-void Iimm_Processing(uint32_t rd, uint32_t f3, uint32_t rs1, uint32_t imm) {
-	uint32_t imm0_4 = (imm << 7) >> 7;
-	uint32_t imm5_11 = imm >> 5;
-	switch (f3)
-	{
-	case 0: //addi
-		NEXT_STATE.REGS[rd] = NEXT_STATE.REGS[rs1] + imm;
-		break;
-
-	case 4: //xori
-		NEXT_STATE.REGS[rd] = NEXT_STATE.REGS[rs1] ^ imm;
-		break;
-	
-	case 6: //ori
-		NEXT_STATE.REGS[rd] = NEXT_STATE.REGS[rs1] | imm;
-		break;
-	
-	case 7: //andi
-		NEXT_STATE.REGS[rd] = NEXT_STATE.REGS[rs1] & imm;
-		break;
-	
-	case 1: //slli
-		NEXT_STATE.REGS[rd] = NEXT_STATE.REGS[rs1] << imm0_4;
-		break;
-	
-	case 5: //srli and srai
-		switch (imm5_11)
-		{
-		case 0: //srli
-			NEXT_STATE.REGS[rd] = NEXT_STATE.REGS[rs1] >> imm0_4;
-			break;
+static uint32_t atomic_lr(uint32_t address)
+{
+	uint8_t *page;
+	uint32_t value;
 
-		case 32: //srai
-			//NEXT_STATE.REGS[rd] = NEXT_STATE.REGS[rs1] >> imm0_4;
-			break;
-		
-		default:
-			RUN_FLAG = FALSE;
-			break;
+	if (!atomic_capable(address)) {
+		value = mem_read_32(address);
+	} else {
+		if (page_watched(address)) {
+			watch_access(address, 4, false);
 		}
-		break;
-	
-	case 2:		//slti
-		NEXT_STATE.REGS[rd] = (rs1 < imm)?1:0;
-		break;
+		page = page_lookup(address, false);
+		value = page ? __atomic_load_n((uint32_t *)(page + (address & PAGE_MASK)), __ATOMIC_SEQ_CST) : 0;
+	}
+	RESERVED = TRUE;
+	RESERVATION = address;
+	RESERVED_VALUE = value;
+	return retire_load(address, 4, value);
+}
 
-	case 3:
-		NEXT_STATE.REGS[rd] = (rs1 < imm)?1:0;
-		break;
+/* 0 if the store happened. It does while the word still holds what lr.w read, which    */
+/* misses a store of the same value in between (the usual compare-and-swap emulation). */
+static uint32_t atomic_sc(uint32_t address, uint32_t value)
+{
+	uint32_t expected = RESERVED_VALUE, *word;
 
-	default:
-		printf("Invalid instruction");
-		RUN_FLAG = FALSE;
-		break;
+	if (!RESERVED || RESERVATION != address) {
+		RESERVED = FALSE;
+		return 1;
+	}
+	RESERVED = FALSE;
+	if (!atomic_capable(address)) {
+		mem_write_32(address, value);
+		retire_store(address, 4, value);
+		return 0;
 	}
+	if (page_watched(address)) {
+		watch_access(address, 4, true);
+	}
+	word = (uint32_t *)(page_lookup(address, true) + (address & PAGE_MASK));
+	if (!__atomic_compare_exchange_n(word, &expected, value, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		return 1;
+	}
+	decode_invalidate(address);
+	retire_store(address, 4, value);
+	return 0;
 }
 
-void S_Processing(uint32_t imm4, uint32_t f3, uint32_t rs1, uint32_t rs2, uint32_t imm11) {
-	// I noticed that this function reads the memory address from NEXT_STATE rather than CURRENT_STATE.
-	// That's probably fine since the two should be the same at this point,
-	// but it might cause problems in the future if we need to implement pipelining.
-	// Recombine immediate
-	uint32_t imm = (imm11 << 5) + imm4;
-
-	switch (f3)
-	{
-	case 0: //sb
-		mem_write_32((CURRENT_STATE.REGS[rs1] + imm), CURRENT_STATE.REGS[rs2]);
-		break;
-	
-	case 1: //sh
-		mem_write_32((CURRENT_STATE.REGS[rs1] + imm), CURRENT_STATE.REGS[rs2]);
-		break;
-
-	case 2: //sw
-		mem_write_32((CURRENT_STATE.REGS[rs1] + imm), CURRENT_STATE.REGS[rs2]);
-		break;
-
-	default:
-		printf("Invalid instruction");
-		RUN_FLAG = FALSE;
-		break;
+/***************************************************************/
+/* Buffered console output for the print syscalls                                                */
+/***************************************************************/
+void console_flush()
+{
+	if (CONSOLE_LEN > 0) {
+		fwrite(CONSOLE_BUF, 1, CONSOLE_LEN, CONSOLE_OUT);
+		CONSOLE_LEN = 0;
 	}
+	fflush(CONSOLE_OUT);
 }
 
-static inline int32_t int12_cast(int32_t q)
+/* make room for len more bytes */
+static inline void console_reserve(uint32_t len)
 {
-	int8_t hi8 = (q >> 4) & 0xff;
-	int8_t lo4 = q & 0xf;
+	if (CONSOLE_BUF == NULL) {
+		CONSOLE_BUF = malloc(CONSOLE_BUF_SIZE);
+		if (CONSOLE_BUF == NULL) {
+			printf("Error: Out of memory allocating console buffer\n");
+			exit(-1);
+		}
+	}
+	if (CONSOLE_LEN + len > CONSOLE_BUF_SIZE) {
+		console_flush();
+	}
+}
 
-	int32_t hi8_cast = hi8;
-	hi8_cast <<= 4;
-	hi8_cast += lo4;
-	return hi8_cast;
+static void console_putc(char c)
+{
+	console_reserve(1);
+	CONSOLE_BUF[CONSOLE_LEN++] = c;
 }
 
-void B_Processing(uint32_t opcode) 
+/***************************************************************/
+/* The exit syscalls stop every hart of the machine, not just the one that made them  */
+/***************************************************************/
+static void machine_exit(int32_t code)
 {
-	int32_t imm = ( (((opcode >> 7) & 1) << 10) | (((opcode >> 31) & 1) << 11) | (((opcode >> 25) & 0x3F) << 4) | (((opcode >> 8) & 0xF))); 
-	uint32_t funct3 = funct3_get(opcode);
-	uint32_t rs1 = CURRENT_STATE.REGS[rs1_get(opcode)];
-	uint32_t rs2 = CURRENT_STATE.REGS[rs2_get(opcode)];
-	uint8_t imm_mult = 0;
+	riscv_sim_t *self = SIM;
+	uint32_t i;
 
-	imm = int12_cast(imm);
+	EXIT_CODE = code;
+	for (i = 0; i < NUM_HARTS; i++) {
+		SIM = HARTS[i];
+		__atomic_store_n(&RUN_FLAG, FALSE, __ATOMIC_RELAXED);
+	}
+	SIM = self;
+}
 
-	switch(funct3)
-	{
-		case 0x0:
-			imm_mult = (rs1 == rs2);
-			break;
-		case 0x1:
-			imm_mult = (rs1 != rs2);
-			break;
-		case 0x4:
-			imm_mult = (rs1 < rs2);
-			break;
-		case 0x5:
-			imm_mult = (rs1 >= rs2);
-			break;
-		case 0x6:
-			imm_mult = (rs1 < rs2);
-			break;
-		case 0x7:
-			imm_mult = (rs1 >= rs2);
-			break;
-		default:
-			RUN_FLAG = FALSE;
-			break;
+/* read syscalls: input that was read before a rewind comes from the log */
+static bool input_replay(void *value, uint32_t len)
+{
+	if (RECORD_INTERVAL == 0 || INPUT_POS + len > INPUT_LEN) {
+		return false;
+	}
+	memcpy(value, INPUT_LOG + INPUT_POS, len);
+	INPUT_POS += len;
+	return true;
+}
 
+static void input_record(const void *value, uint32_t len)
+{
+	if (RECORD_INTERVAL == 0) {
+		return;
 	}
-	CURRENT_STATE.PC += (((imm<<1)-4) * (imm_mult));
+	if (INPUT_LEN + len > INPUT_CAPACITY) {
+		INPUT_CAPACITY = INPUT_CAPACITY ? INPUT_CAPACITY * 2 : 4096;
+		if ((INPUT_LOG = realloc(INPUT_LOG, INPUT_CAPACITY)) == NULL) {
+			printf("Error: Out of memory allocating input log\n");
+			exit(-1);
+		}
+	}
+	memcpy(INPUT_LOG + INPUT_LEN, value, len);
+	INPUT_LEN += len;
+	INPUT_POS = INPUT_LEN;
 }
 
-void J_Processing() {
-	// hi
+static int input_getc()
+{
+	int c;
+
+	if (!input_replay(&c, sizeof(c))) {
+		c = getc(CONSOLE_IN);
+		input_record(&c, sizeof(c));
+	}
+	return c;
 }
 
-void U_Processing() {
-	// hi
+/* output printed before a rewind is not printed again */
+static inline bool output_replayed()
+{
+	return RECORD_INTERVAL != 0 && INSTRUCTION_COUNT < RECORD_HORIZON;
 }
 
-void R_print(uint32_t rd, uint32_t f3, uint32_t rs1,uint32_t rs2,uint32_t f7)
+/***************************************************************/
+/* Run the syscall requested by an ecall: code in a7, arguments in a0/a1, result in a0 */
+/***************************************************************/
+void SYSCALL(CPU_State *state)
 {
-	char * arg_string = "\0";
-	switch(f3){
-		case 0:
-			switch(f7){
-				case 0:		//add
-					arg_string = "add";
-					break;
-				case 32:	//sub
-					arg_string = "sub";
-					break;
-				default:
-					RUN_FLAG = FALSE;
-					break;
-				}	
+	uint32_t code = state->REGS[REG_A7];
+	uint32_t address, length, i;
+	int c;
+
+	switch(code)
+	{
+		case(1):
+			//print int in a0
+			if (output_replayed()) {
+				break;
+			}
+			console_reserve(16);
+			CONSOLE_LEN += sprintf(CONSOLE_BUF + CONSOLE_LEN, "%d\n", (int32_t)state->REGS[REG_A0]);
+			break;
+		case(2):
+			//print float in f12
 			break;
-		case 1:				//left shift logical
-			arg_string = "sll";
+		case(3):
+			//print double in f12
+			break;
+		case(4):
+			//print the NUL-terminated string at a0
+			if (output_replayed()) {
+				break;
+			}
+			for (address = state->REGS[REG_A0]; (c = mem_read_8(address)) != 0; address++) {
+				console_putc(c);
+			}
 			break;
-		case 2:				//set less than
-			arg_string = "slt";
+		case(5):
+			//read int to a0
+			console_flush();
+			if (!input_replay(&state->REGS[REG_A0], 8)) {
+				(void) fscanf(CONSOLE_IN, "%d", &state->REGS[REG_A0]);
+				input_record(&state->REGS[REG_A0], 8);
+			}
 			break;
-		case 3:				//set less than unsigned
-			arg_string = "sltu";
+		case(6):
+			//read float
+			console_flush();
+			if (!input_replay(&state->REGS[REG_A0], 8)) {
+				fscanf(CONSOLE_IN, "%f", (float*) &state->REGS[REG_A0]);
+				input_record(&state->REGS[REG_A0], 8);
+			}
 			break;
-		case 4:				//xor
-			arg_string = "xor";
+		case(7):
+			//read double into a0/a1
+			console_flush();
+			if (!input_replay(&state->REGS[REG_A0], 8)) {
+				fscanf(CONSOLE_IN, "%lf", (double*) &state->REGS[REG_A0]);
+				input_record(&state->REGS[REG_A0], 8);
+			}
 			break;
-		case 5:
-			switch(f7){
-				case 0:		//right shift logical
-					arg_string = "srl";
+		case(8):
+			//read a line of at most a1 - 1 characters into the buffer at a0, NUL-terminated
+			console_flush();
+			address = state->REGS[REG_A0];
+			length = state->REGS[REG_A1];
+			if (length == 0) {
+				break;
+			}
+			for (i = 0; i < length - 1; i++) {
+				c = input_getc();
+				if (c == EOF) {
 					break;
-				case 32:	//right shift arithmetic
-					arg_string = "sra";
+				}
+				mem_write_8(address + i, c);
+				if (c == '\n') {
+					i++;
 					break;
+				}
 			}
-
-
-		case 6:				//or
-			arg_string = "or";
+			mem_write_8(address + i, 0);
+			break;
+		case(9):
+			//sbrk: grow the heap by a0 bytes, return the old break in a0
+			address = __atomic_fetch_add(&HEAP_BREAK, state->REGS[REG_A0], __ATOMIC_RELAXED);
+			state->REGS[REG_A0] = address;
+			break;
+		case(10):
+			machine_exit(0);
 			break;
-		case 7:				//and
-			arg_string = "and";
+		case(17):
+		case(93):
+			//exit with the status in a0
+			machine_exit(state->REGS[REG_A0]);
 			break;
 		default:
-			RUN_FLAG = FALSE;
 			break;
 	}
-	printf("%s x%u x%u x%u\n",arg_string,rd,rs1,rs2);
-	
-}
-void ILoad_print(uint32_t rd, uint32_t f3, uint32_t rs1, uint32_t imm) {
-	char * arg_string = "\0";
-	switch (f3)
-	{
-	case 0: //lb
-		arg_string = "lb";
-		break;
 
-	case 1: //lh
-		arg_string = "lh";
-		break;
+}
 
-	case 2: //lw
-		arg_string = "lw";
-		break;
-	case 4:
-		break;
-	case 5:
-		break;
-	
-	default:
-		printf("Invalid instruction");
-		RUN_FLAG = FALSE;
-		break;
+/***************************************************************/
+/* Execute one cycle                                                                                                              */
+/***************************************************************/
+void cycle() {                                                
+	handle_instruction();
+	if (RETIRE.trapped) {
+		return;
+	}
+	INSTRUCTION_COUNT++;
+	//if(PROGRAM_SIZE == INSTRUCTION_COUNT) RUN_FLAG = false; //end program after handling last instruction
+	if(CURRENT_STATE.PC > (PROGRAM_SIZE * 4) + MEM_TEXT_BEGIN) RUN_FLAG = false;
+	if (RETIRE_HOOK != NULL) {
+		RETIRE_HOOK(&RETIRE);
 	}
-	printf("%s x%u %u(x%u)\n",arg_string,rd,imm,rs1);
 }
 
-void Iimm_print(uint32_t rd, uint32_t f3, uint32_t rs1, uint32_t imm)
+/***************************************************************/
+/* hart_execute() while watchpoints or breakpoints are set: an instruction at a time in */
+/* the interpreter, stopping before a breakpoint and after an access that hits a watch. */
+/***************************************************************/
+static bool breakpoint_at(uint32_t pc)
 {
-	uint32_t imm0_4 = (imm << 7) >> 7;
-	uint32_t imm5_11 = imm >> 5;
-
-	char * arg_string = "\0";
-	switch (f3)
-	{
-	case 0: //addi
-		arg_string = "addi";
-		break;
-
-	case 4: //xori
-		arg_string = "xori";
-		break;
-	
-	case 6: //ori
-		arg_string = "ori";
-		break;
-	
-	case 7: //andi
-		arg_string = "andi";
-		break;
-	
-	case 1: //slli
-		arg_string = "slli";
-		break;
-	
-	case 5: //srli and srai
-		switch (imm5_11)
-		{
-		case 0: //srli
-			arg_string = "srli";
-			break;
+	uint32_t i;
+	for (i = 0; i < NUM_BREAKPOINTS; i++) {
+		if (BREAKPOINTS[i] == pc) {
+			return true;
+		}
+	}
+	return false;
+}
 
-		case 32: //srai
-			arg_string = "srai";
-			break;
-		
-		default:
-			RUN_FLAG = FALSE;
+static uint32_t debug_execute(uint32_t num_cycles)
+{
+	while (num_cycles > 0 && RUN_FLAG && __atomic_load_n(&DEBUG_STOP.kind, __ATOMIC_ACQUIRE) == STOP_NONE) {
+		/* the breakpoint last stopped at lets the hart past */
+		if (CURRENT_STATE.PC != BREAK_SKIP_PC && breakpoint_at(CURRENT_STATE.PC)) {
+			BREAK_SKIP_PC = CURRENT_STATE.PC;
+			debug_stop(STOP_BREAK, CURRENT_STATE.PC, CURRENT_STATE.PC);
 			break;
 		}
-		break;
-	
-	case 2:		//slti
-		arg_string = "slti";
-		break;
-
-	case 3:		//sktiu
-		arg_string = "sltiu";
-		break;
-
-	default:
-		printf("Invalid instruction");
-		RUN_FLAG = FALSE;
-		break;
+		BREAK_SKIP_PC = BREAK_NONE;
+		WATCH_ARMED = TRUE;
+		if (TRACE != NULL) {
+			trace_cycle();
+		} else {
+			cycle();
+		}
+		WATCH_ARMED = FALSE;
+		num_cycles--;
 	}
-	printf("%s x%u x%u x%u\n",arg_string,rd,rs1,imm0_4);
+	return num_cycles;
 }
 
-void S_print(uint32_t imm4, uint32_t f3, uint32_t rs1, uint32_t rs2, uint32_t imm11) {
-	// Recombine immediate
-	uint32_t imm = (imm11 << 5) + imm4;
-	char * arg_string = "\0";
+/* watch the word at address for kind (WATCH_READ | WATCH_WRITE); FALSE if there are too many */
+int watch_add(uint32_t address, int kind)
+{
+	uint32_t page, last;
 
-	switch (f3)
-	{
-	case 0: //sb
-		arg_string = "sb";
-		break;
-	
-	case 1: //sh
-		arg_string = "sh";
-		break;
+	if (NUM_WATCHES == MAX_WATCHES) {
+		return FALSE;
+	}
+	if (WATCH_PAGES == NULL && (WATCH_PAGES = calloc(1u << (32 - PAGE_SHIFT - 3), 1)) == NULL) {
+		printf("Error: Out of memory allocating watchpoints\n");
+		exit(-1);
+	}
+	WATCHES[NUM_WATCHES].address = address;
+	WATCHES[NUM_WATCHES].kind = kind;
+	NUM_WATCHES++;
+	/* the word may run off the top of the address space; only the pages below 4 GiB are flagged */
+	last = ((uint64_t)address + WATCH_SIZE - 1 > 0xFFFFFFFF ? 0xFFFFFFFF : address + WATCH_SIZE - 1) >> PAGE_SHIFT;
+	for (page = address >> PAGE_SHIFT; page <= last; page++) {
+		WATCH_PAGES[page >> 3] |= 1 << (page & 7);
+	}
+	DEBUGGING = TRUE;
+	/* the pages leave every TLB */
+	tlb_flush();
+	return TRUE;
+}
 
-	case 2: //sw
-		arg_string = "sw";
-		break;
+void watch_clear()
+{
+	free(WATCH_PAGES);
+	WATCH_PAGES = NULL;
+	NUM_WATCHES = 0;
+	DEBUGGING = NUM_BREAKPOINTS > 0;
+}
 
-	default:
-		printf("Invalid instruction");
-		RUN_FLAG = FALSE;
-		break;
+/* stop before the instruction at pc; FALSE if there are too many */
+int break_add(uint32_t pc)
+{
+	if (NUM_BREAKPOINTS == MAX_BREAKPOINTS) {
+		return FALSE;
 	}
-	printf("%s x%u %u(x%u)\n",arg_string,rs2,imm,rs1);
+	BREAKPOINTS[NUM_BREAKPOINTS++] = pc;
+	DEBUGGING = TRUE;
+	return TRUE;
 }
 
-void B_print(uint32_t opcode)
+void break_clear()
 {
-	int32_t imm = ( (((opcode >> 7) & 1) << 10) | (((opcode >> 31) & 1) << 11) | (((opcode >> 25) & 0x3F) << 4) | (((opcode >> 8) & 0xF))); 
-	uint32_t funct3 = funct3_get(opcode);
-	uint32_t rs1 = rs1_get(opcode);
-	uint32_t rs2 = rs2_get(opcode);
-
-	char * arg_string = "\0";
+	NUM_BREAKPOINTS = 0;
+	DEBUGGING = NUM_WATCHES > 0;
+}
 
-	imm = int12_cast(imm);
+static void text_sync();
 
-	switch(funct3)
-	{
-		case 0x0:
-			arg_string = "beq";
-			break;
-		case 0x1:
-			arg_string = "beq";
-			break;
-		case 0x4:
-			arg_string = "beq";
-			break;
-		case 0x5:
-			arg_string = "beq";
-			break;
-		case 0x6:
-			arg_string = "beq";
-			break;
-		case 0x7:
-			arg_string = "beq";
-			break;
-		default:
-			printf("Invalid Instruction\n");
-			break;
+/***************************************************************/
+/* Execute up to num_cycles instructions of the current hart on the selected engine.     */
+/* Returns how many of them were left when the hart stopped.                              */
+/***************************************************************/
+static uint32_t hart_execute(uint32_t num_cycles) {
+	uint32_t retired;
 
+	if (__atomic_load_n(&TEXT_PENDING, __ATOMIC_ACQUIRE)) {
+		text_sync();
+	}
+	if (DEBUGGING) {
+		return debug_execute(num_cycles);
+	}
+	/*the trace is recorded around cycle(), an instruction at a time*/
+	if (TRACE != NULL) {
+		while (num_cycles > 0 && RUN_FLAG) {
+			trace_cycle();
+			num_cycles--;
+		}
+		return num_cycles;
+	}
+	while (num_cycles > 0 && RUN_FLAG) {
+		/*a retire hook, the profiler or the timing, cache and predictor models need every instruction to go through cycle()*/
+		if (ENGINE != ENGINE_INTERP && RETIRE_HOOK == NULL && !PROFILING && !TIMING && !CACHE_SIM &&
+				PREDICTOR == PRED_OFF) {
+			/*the JIT runs inside the block engine*/
+			retired = (ENGINE == ENGINE_THREADED) ? run_threaded(num_cycles) : run_blocks(num_cycles);
+			if (retired > 0) {
+				num_cycles -= retired;
+				continue;
+			}
+		}
+		/*interpreter, or an instruction the fast engines cannot run*/
+		cycle();
+		num_cycles--;
 	}
-	printf("%s x%u, x%u, %d\n",arg_string,rs1,rs2,imm);
+	return num_cycles;
 }
 
+/***************************************************************/
+/* Multiple harts. Lock-step runs them in turn on the calling thread, HART_QUANTUM      */
+/* instructions at a time, so a run is repeatable. Free-running gives every hart but    */
+/* the first a host thread of its own for the length of the call.                         */
+/***************************************************************/
+typedef struct {
+	riscv_sim_t *hart;
+	uint32_t left;		/* instructions of the budget the hart did not get to */
+} hart_run_t;
 
+static void *hart_thread(void *arg)
+{
+	hart_run_t *run = arg;
+	uint32_t step;
 
+	SIM = run->hart;
+	while (run->left > 0 && RUN_FLAG && __atomic_load_n(&DEBUG_STOP.kind, __ATOMIC_ACQUIRE) == STOP_NONE) {
+		step = run->left < HART_QUANTUM ? run->left : HART_QUANTUM;
+		run->left -= step - hart_execute(step);
+		/* keep the harts' output in roughly the order it was written */
+		if (CONSOLE_LEN > 0) {
+			console_flush();
+		}
+	}
+	return NULL;
+}
 
-void instruction_map(uint32_t args, bool PRINT_FLAG)
+static uint32_t harts_execute(uint32_t num_cycles)
 {
-	uint8_t type = (uint8_t)(args & 0x7f);
-	switch(type)
-	{
-		case(0x03): //IL
-		{
-			if(PRINT_FLAG) {ILoad_print(rd_get(args), funct3_get(args), rs1_get(args), bigImm_get(args)); break;}
-			ILoad_Processing(rd_get(args) , funct3_get(args) , rs1_get(args) , bigImm_get(args));
-			break;
-		}
-		case(0x13): //Iimm
-		{
-			if(PRINT_FLAG) { Iimm_print(rd_get(args) , funct3_get(args) , rs1_get(args) , bigImm_get(args)); break;}
-			Iimm_Processing(rd_get(args) , funct3_get(args) , rs1_get(args) , bigImm_get(args));
-			break;
+	riscv_sim_t *self = SIM;
+	hart_run_t runs[MAX_HARTS];
+	pthread_t threads[MAX_HARTS];
+	bool started[MAX_HARTS];
+	uint32_t i, n = NUM_HARTS, left = num_cycles, step;
+	bool ran;
+
+	/* a trace is fed from one thread at a time, so it makes free-running harts take turns */
+	if (HART_MODE == HARTS_FREE && TRACE == NULL) {
+		for (i = 0; i < n; i++) {
+			runs[i].hart = HARTS[i];
+			runs[i].left = num_cycles;
+			started[i] = i > 0 && pthread_create(&threads[i], NULL, hart_thread, &runs[i]) == 0;
 		}
-		case(0x23): //S 
-		{
-			if(PRINT_FLAG) { S_print(rd_get(args) , funct3_get(args), rs1_get(args) , rs2_get(args), funct7_get(args)); break;}
-			S_Processing(rd_get(args) , funct3_get(args), rs1_get(args) , rs2_get(args), funct7_get(args));
-			break;
+		hart_thread(&runs[0]);
+		for (i = 1; i < n; i++) {
+			if (started[i]) {
+				pthread_join(threads[i], NULL);
+			} else {
+				hart_thread(&runs[i]);
+			}
+			if (runs[i].left < left) {
+				left = runs[i].left;
+			}
 		}
-		case(0x33): //R
-		{
-			if(PRINT_FLAG) { R_print(rd_get(args) , funct3_get(args), rs1_get(args) , rs2_get(args), funct7_get(args)); break;}
-			R_Processing(rd_get(args) , funct3_get(args), rs1_get(args) , rs2_get(args), funct7_get(args));
-			break;
+		SIM = self;
+		return runs[0].left < left ? runs[0].left : left;
+	}
+
+	while (left > 0) {
+		step = left < HART_QUANTUM ? left : HART_QUANTUM;
+		ran = false;
+		for (i = 0; i < n && DEBUG_STOP.kind == STOP_NONE; i++) {
+			SIM = HARTS[i];
+			if (RUN_FLAG) {
+				hart_execute(step);
+				ran = true;
+				if (CONSOLE_LEN > 0) {
+					console_flush();
+				}
+			}
 		}
-		case(0x63):
-		{
-			if(PRINT_FLAG){B_print(args); break;}
-			B_Processing(args);
+		SIM = self;
+		if (!ran || DEBUG_STOP.kind != STOP_NONE) {
 			break;
 		}
-		default:
-			break;
-
+		left -= step;
 	}
+	return left;
 }
 
-/************************************************************/
-/* decode and execute instruction                                                                     */ 
-/************************************************************/
-void handle_instruction()
-{
-	/*IMPLEMENT THIS*/
-	/* execute one instruction at a time. Use/update CURRENT_STATE and and NEXT_STATE, as necessary.*/
-	uint32_t PC = CURRENT_STATE.PC;
-	uint32_t instruction = mem_read_32(PC);
-	instruction_map(instruction,false);
-	NEXT_STATE.PC = CURRENT_STATE.PC + 4;
+/***************************************************************/
+/* Execute up to num_cycles instructions (on every hart).                                    */
+/* Returns how many of them were left when the simulation stopped.                       */
+/***************************************************************/
+static uint32_t record_execute(uint32_t num_cycles);
+
+uint32_t execute(uint32_t num_cycles) {
+	DEBUG_STOP.kind = STOP_NONE;
+	if (NUM_HARTS > 1) {
+		return harts_execute(num_cycles);
+	}
+	return RECORD_INTERVAL ? record_execute(num_cycles) : hart_execute(num_cycles);
 }
 
+/* TRUE while any hart can still run */
+int harts_running() {
+	riscv_sim_t *self = SIM;
+	uint32_t i;
+	int running = FALSE;
 
-/************************************************************/
-/* Initialize Memory                                                                                                    */ 
-/************************************************************/
-void initialize() { 
-	init_memory();
-	CURRENT_STATE.PC = MEM_TEXT_BEGIN;
-	CURRENT_STATE.REGS[2] = MEM_STACK_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
+	for (i = 0; i < NUM_HARTS && !running; i++) {
+		SIM = HARTS[i];
+		running = RUN_FLAG;
+	}
+	SIM = self;
+	return running;
+}
+
+/* put the current hart (not the first) at the program entry with its own stack */
+static void hart_start()
+{
+	memset(&CURRENT_STATE, 0, sizeof(CURRENT_STATE));
+	CURRENT_STATE.PC = PROGRAM_ENTRY;
+	CURRENT_STATE.REGS[2] = MEM_STACK_BEGIN - HART_ID * HART_STACK_SIZE;
+	CURRENT_STATE.REGS[REG_A0] = HART_ID;
+	INSTRUCTION_COUNT = 0;
+	RESERVED = FALSE;
+	pipeline_clear();
 	RUN_FLAG = TRUE;
 }
 
-/************************************************************/
-/* Print the program loaded into memory (in RISCV assembly format)    */ 
-/************************************************************/
-void print_program(){
-	/*IMPLEMENT THIS*/
-	/* execute one instruction at a time. Use/update CURRENT_STATE and and NEXT_STATE, as necessary.*/
+/* restart every hart from first on */
+static void harts_start(uint32_t first)
+{
+	riscv_sim_t *self = SIM;
+	uint32_t i;
+
+	for (i = first; i < NUM_HARTS; i++) {
+		SIM = HARTS[i];
+		hart_start();
+	}
+	SIM = self;
+}
 
+static void init_hart();
+static void hart_free();
 
-	uint32_t temp_pc = MEM_TEXT_BEGIN, i = 0;
+/* a new hart sharing the current one's memory, settings and program */
+static riscv_sim_t *hart_create(uint32_t id)
+{
+	riscv_sim_t *self = SIM, *hart = calloc(1, sizeof(riscv_sim_t));
+	engine_t engine = ENGINE;
+	FILE *out = CONSOLE_OUT, *in = CONSOLE_IN;
+	uint32_t size = PROGRAM_SIZE, entry = PROGRAM_ENTRY;
+	trace_t *trace = TRACE;
 
-	while(i < PROGRAM_SIZE){
-		uint32_t instruction = mem_read_32(temp_pc);
-		instruction_map(instruction,true);
-		temp_pc += 4;
-		i++;
-		//exit loop at some point
+	if (hart == NULL) {
+		printf("Error: Out of memory allocating hart %u\n", id);
+		exit(-1);
 	}
+	hart->MACHINE = self->MACHINE;
+	SIM = hart;
+	init_hart();
+	HART_ID = id;
+	ENGINE = engine;
+	CONSOLE_OUT = out;
+	CONSOLE_IN = in;
+	PROGRAM_SIZE = size;
+	PROGRAM_ENTRY = entry;
+	TRACE = trace;
+	build_decode_cache();
+	hart_start();
+	SIM = self;
+	return hart;
 }
 
+static void hart_destroy(riscv_sim_t *hart)
+{
+	riscv_sim_t *self = SIM;
 
+	SIM = hart;
+	console_flush();
+	hart_free();
+	free(hart);
+	SIM = self;
+}
 
+/***************************************************************/
+/* harts <n>[:lockstep|:free][:<quantum>]. New harts start at the program entry;         */
+/* the first hart is left as it is.                                                          */
+/***************************************************************/
+int harts_config(const char *arg)
+{
+	uint32_t count, quantum = 0;
+	hart_mode_t mode = HARTS_LOCKSTEP;
+	char *end;
 
-/************************************************************/
-/* Print the instruction at given memory address (in RISCV assembly format)    */
-/************************************************************/
-void print_instruction(uint32_t addr){
-
-	uint32_t instruction = mem_read_32(addr);
-		uint32_t maskopcode = 0x7F;
-		uint32_t opcode = instruction & maskopcode;
-		if(opcode == 51) { //R-type
-			uint32_t maskrd = 0xF80;
-			uint32_t rd = instruction & maskrd;
-			rd = rd >> 7;
-			uint32_t maskf3 = 0x7000;
-			uint32_t f3 = instruction & maskf3;
-			f3 = f3 >> 12;
-			uint32_t maskrs1 = 0xF8000;
-			uint32_t rs1 = instruction & maskrs1;
-			rs1 = rs1 >> 15;
-			uint32_t maskrs2 = 0x1F00000;
-			uint32_t rs2 = instruction & maskrs2;
-			rs2 = rs2 >> 20;
-			uint32_t maskf7 = 0xFE000000;
-			uint32_t f7 = instruction & maskf7;
-			f7 = f7 >> 25;
-			R_print(rd,f3,rs1,rs2,f7);
-		} else {
-			printf("instruction print not yet created\n");
+	count = strtoul(arg, &end, 0);
+	if (end == arg || count < 1 || count > MAX_HARTS || HART_ID != 0) {
+		return FALSE;
+	}
+	/* record/replay checkpoints only hold the first hart's input */
+	if (count > 1 && RECORD_INTERVAL) {
+		return FALSE;
+	}
+	if (strncmp(end, ":lockstep", 9) == 0) {
+		end += 9;
+	} else if (strncmp(end, ":free", 5) == 0) {
+		mode = HARTS_FREE;
+		end += 5;
+	}
+	if (*end == ':') {
+		quantum = strtoul(end + 1, &end, 0);
+		if (quantum == 0) {
+			return FALSE;
 		}
-		CURRENT_STATE = NEXT_STATE;
-	return;
+	}
+	if (*end != '\0') {
+		return FALSE;
+	}
+	while (NUM_HARTS > count) {
+		hart_destroy(HARTS[--NUM_HARTS]);
+	}
+	while (NUM_HARTS < count) {
+		HARTS[NUM_HARTS] = hart_create(NUM_HARTS);
+		NUM_HARTS++;
+	}
+	HART_MODE = mode;
+	HART_QUANTUM = quantum ? quantum : mode == HARTS_FREE ? HART_QUANTUM_FREE : HART_QUANTUM_LOCKSTEP;
+	return TRUE;
 }
 
 /***************************************************************/
-/* main                                                                                                                                   */
+/* reset registers/memory and reload program                                                    */
 /***************************************************************/
-int main(int argc, char *argv[]) {                              
-	printf("\n**************************\n");
-	printf("Welcome to MU-RISCV SIM...\n");
-	printf("**************************\n\n");
-	
-	if (argc < 2) {
-		printf("Error: You should provide input file.\nUsage: %s <input program> \n\n",  argv[0]);
-		exit(1);
-	}
+void reset() {   
+	uint32_t interval = RECORD_INTERVAL;
+	int i, loaded;
 
-	strcpy(prog_file, argv[1]);
+	/*a recording starts over from the beginning*/
+	record_stop();
+
+	/*caches and predictors start cold again*/
+	cache_clear();
+	if (PREDICTOR != PRED_OFF) {
+		predictor_clear();
+	}
+
+	/*back to the post-load image, touching only what changed since*/
+	if (snapshot_restore(BOOT_SNAPSHOT)) {
+		if (interval) {
+			record_start(interval);
+		}
+		return;
+	}
+
+	/*reset registers*/
+	for (i = 0; i < RISCV_REGS; i++){
+		CURRENT_STATE.REGS[i] = 0;
+	}
+	CURRENT_STATE.HI = 0;
+	CURRENT_STATE.LO = 0;
+	
+	/*drop every touched page; they read back as zero*/
+	free_memory();
+	
+	/*load program*/
+	loaded = load_program();
+	
+	/*reset PC and heap*/
+	HEAP_BREAK = MEM_HEAP_BEGIN;
+	INSTRUCTION_COUNT = 0;
+	EXIT_CODE = 0;
+	pipeline_clear();
+	CURRENT_STATE.PC =  PROGRAM_ENTRY;
+	RUN_FLAG = loaded >= 0;
+	RESERVED = FALSE;
+	harts_start(1);
+	if (interval) {
+		record_start(interval);
+	}
+}
+
+/***************************************************************/
+/* Set up an empty page table; pages are allocated on first write                          */
+/***************************************************************/
+void init_memory() {                                           
+	if (SIM->MACHINE == NULL) {
+		SIM->MACHINE = calloc(1, sizeof(machine_t));
+		if (SIM->MACHINE == NULL) {
+			printf("Error: Out of memory allocating machine\n");
+			exit(-1);
+		}
+		pthread_mutex_init(&MEMORY_LOCK, NULL);
+	}
+	memset(PAGE_TABLE, 0, sizeof(PAGE_TABLE));
+	PAGES_ALLOCATED = 0;
+	tlb_flush();
+}
+
+/***************************************************************/
+/* Release every allocated page, leaving all of memory reading as zero                  */
+/***************************************************************/
+void free_memory() {
+	uint32_t i, j;
+	for (i = 0; i < PT_L1_ENTRIES; i++) {
+		if (PAGE_TABLE[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < PT_L2_ENTRIES; j++) {
+			page_release(PAGE_TABLE[i][j]);
+		}
+		free(PAGE_TABLE[i]);
+		PAGE_TABLE[i] = NULL;
+	}
+	PAGES_ALLOCATED = 0;
+	NUM_DIRTY = 0;
+	SNAPSHOT_BASE = NULL;
+	tlb_flush();
+}
+
+/**************************************************************/
+/* Snapshots share pages with live memory and are restored by swapping page pointers. */
+/* Restoring the base snapshot only touches the pages dirtied since it was taken.       */
+/**************************************************************/
+snapshot_t *snapshot_find(const char *name)
+{
+	snapshot_t *snap;
+	for (snap = SNAPSHOTS; snap != NULL; snap = snap->next) {
+		if (strcmp(snap->name, name) == 0) {
+			return snap;
+		}
+	}
+	return NULL;
+}
+
+static void snapshot_free(snapshot_t *snap)
+{
+	uint32_t i;
+	for (i = 0; i < snap->num_pages; i++) {
+		page_release(snap->pages[i]);
+	}
+	if (SNAPSHOT_BASE == snap) {
+		SNAPSHOT_BASE = NULL;
+		NUM_DIRTY = 0;
+	}
+	free(snap->page_numbers);
+	free(snap->pages);
+	free(snap->harts);
+	free(snap);
+}
+
+/* save the machine under name (NULL for an unlisted snapshot), replacing any of that name */
+snapshot_t *snapshot_take(const char *name)
+{
+	snapshot_t *snap, **link;
+	riscv_sim_t *self = SIM;
+	uint32_t i, j, n = 0;
+
+	console_flush();
+	snap = calloc(1, sizeof(snapshot_t));
+	if (snap == NULL) {
+		printf("Error: Out of memory allocating snapshot\n");
+		exit(-1);
+	}
+	snap->page_numbers = malloc((PAGES_ALLOCATED + 1) * sizeof(uint32_t));
+	snap->pages = malloc((PAGES_ALLOCATED + 1) * sizeof(uint8_t *));
+	if (snap->page_numbers == NULL || snap->pages == NULL) {
+		printf("Error: Out of memory allocating snapshot\n");
+		exit(-1);
+	}
+	for (i = 0; i < PT_L1_ENTRIES; i++) {
+		if (PAGE_TABLE[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < PT_L2_ENTRIES; j++) {
+			if (PAGE_TABLE[i][j] != NULL) {
+				snap->page_numbers[n] = (i << PT_L2_BITS) | j;
+				snap->pages[n] = PAGE_TABLE[i][j];
+				PAGE_REFS(snap->pages[n])++;
+				n++;
+			}
+		}
+	}
+	snap->num_pages = n;
+	snap->state = CURRENT_STATE;
+	snap->instruction_count = INSTRUCTION_COUNT;
+	snap->heap_break = HEAP_BREAK;
+	snap->run_flag = RUN_FLAG;
+	snap->exit_code = EXIT_CODE;
+	snap->pipeline = PIPELINE;
+	snap->num_harts = NUM_HARTS - 1;
+	if (snap->num_harts > 0) {
+		snap->harts = malloc(snap->num_harts * sizeof(hart_state_t));
+		if (snap->harts == NULL) {
+			printf("Error: Out of memory allocating snapshot\n");
+			exit(-1);
+		}
+		for (i = 0; i < snap->num_harts; i++) {
+			SIM = HARTS[i + 1];
+			console_flush();
+			snap->harts[i].state = CURRENT_STATE;
+			snap->harts[i].instruction_count = INSTRUCTION_COUNT;
+			snap->harts[i].run_flag = RUN_FLAG;
+		}
+		SIM = self;
+	}
+
+	if (name != NULL) {
+		strncpy(snap->name, name, SNAPSHOT_NAME_LEN - 1);
+		for (link = &SNAPSHOTS; *link != NULL; link = &(*link)->next) {
+			if (strcmp((*link)->name, snap->name) == 0) {
+				snapshot_t *old = *link;
+				*link = old->next;
+				snapshot_free(old);
+				break;
+			}
+		}
+		snap->next = SNAPSHOTS;
+		SNAPSHOTS = snap;
+	}
+
+	/* every live page is now shared with snap */
+	SNAPSHOT_BASE = snap;
+	NUM_DIRTY = 0;
+	tlb_flush();
+	return snap;
+}
+
+/* point the live page table at snap's page (or nothing) for one page number */
+static void snapshot_put_page(uint32_t number, uint8_t *page)
+{
+	uint32_t address = number << PAGE_SHIFT, i;
+	uint8_t **l2 = PAGE_TABLE[PT_L1_INDEX(address)];
+	uint8_t *old;
+
+	if (l2 == NULL) {
+		if (page == NULL) {
+			return;
+		}
+		l2 = calloc(PT_L2_ENTRIES, sizeof(uint8_t *));
+		if (l2 == NULL) {
+			printf("Error: Out of memory allocating page table\n");
+			exit(-1);
+		}
+		PAGE_TABLE[PT_L1_INDEX(address)] = l2;
+	}
+	old = l2[PT_L2_INDEX(address)];
+	if (old == page) {
+		return;
+	}
+	if (page != NULL) {
+		PAGE_REFS(page)++;
+	}
+	PAGES_ALLOCATED += (page != NULL) - (old != NULL);
+	l2[PT_L2_INDEX(address)] = page;
+	page_release(old);
+
+	/* translated text on this page is stale */
+	if (address - MEM_TEXT_BEGIN < DECODE_CACHE_SIZE * 4) {
+		for (i = 0; i < PAGE_SIZE; i += 4) {
+			decode_invalidate(address + i);
+		}
+	}
+}
+
+/* snap's page for a page number, NULL if it had none */
+static uint8_t *snapshot_page(const snapshot_t *snap, uint32_t number)
+{
+	uint32_t lo = 0, hi = snap->num_pages, mid;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (snap->page_numbers[mid] < number) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (lo < snap->num_pages && snap->page_numbers[lo] == number) ? snap->pages[lo] : NULL;
+}
+
+int snapshot_restore(snapshot_t *snap)
+{
+	riscv_sim_t *self = SIM;
+	uint32_t i, j, n;
+
+	if (snap == NULL) {
+		return FALSE;
+	}
+	console_flush();
+	if (snap == SNAPSHOT_BASE) {
+		/* only pages written or created since snap can differ */
+		for (i = 0; i < NUM_DIRTY; i++) {
+			snapshot_put_page(DIRTY_PAGES[i], snapshot_page(snap, DIRTY_PAGES[i]));
+		}
+	} else {
+		/* walk both, snap's page numbers are ascending like the table walk */
+		n = 0;
+		for (i = 0; i < PT_L1_ENTRIES; i++) {
+			if (PAGE_TABLE[i] == NULL) {
+				continue;
+			}
+			for (j = 0; j < PT_L2_ENTRIES; j++) {
+				if (PAGE_TABLE[i][j] == NULL) {
+					continue;
+				}
+				while (n < snap->num_pages && snap->page_numbers[n] < ((i << PT_L2_BITS) | j)) {
+					n++;
+				}
+				if (n == snap->num_pages || snap->page_numbers[n] != ((i << PT_L2_BITS) | j)) {
+					snapshot_put_page((i << PT_L2_BITS) | j, NULL);
+				}
+			}
+		}
+		for (n = 0; n < snap->num_pages; n++) {
+			snapshot_put_page(snap->page_numbers[n], snap->pages[n]);
+		}
+		SNAPSHOT_BASE = snap;
+	}
+	NUM_DIRTY = 0;
+	tlb_flush();
+
+	CURRENT_STATE = snap->state;
+	INSTRUCTION_COUNT = snap->instruction_count;
+	HEAP_BREAK = snap->heap_break;
+	RUN_FLAG = snap->run_flag;
+	EXIT_CODE = snap->exit_code;
+	PIPELINE = snap->pipeline;
+	RESERVED = FALSE;
+
+	/* harts the snapshot has no state for start over */
+	for (i = 1; i < NUM_HARTS && i <= snap->num_harts; i++) {
+		SIM = HARTS[i];
+		console_flush();
+		CURRENT_STATE = snap->harts[i - 1].state;
+		INSTRUCTION_COUNT = snap->harts[i - 1].instruction_count;
+		RUN_FLAG = snap->harts[i - 1].run_flag;
+		RESERVED = FALSE;
+	}
+	SIM = self;
+	harts_start(i);
+	return TRUE;
+}
+
+/**************************************************************/
+/* Record/replay. While recording, a checkpoint (an unlisted snapshot, which shares     */
+/* every page not written since the one before) is taken each RECORD_INTERVAL           */
+/* instructions and the read syscalls' results are logged. Going back restores the    */
+/* nearest earlier checkpoint and re-executes forward with the logged input.          */
+/**************************************************************/
+static void checkpoints_free(uint32_t keep)
+{
+	while (NUM_CHECKPOINTS > keep) {
+		snapshot_free(CHECKPOINTS[--NUM_CHECKPOINTS]);
+	}
+}
+
+static void checkpoint()
+{
+	snapshot_t *snap;
+	uint32_t i, n;
+
+	if (NUM_CHECKPOINTS > 0 && CHECKPOINTS[NUM_CHECKPOINTS - 1]->instruction_count >= INSTRUCTION_COUNT) {
+		/* re-executing after a rewind: this one is already there */
+		return;
+	}
+	if (NUM_CHECKPOINTS == RECORD_MAX_CHECKPOINTS) {
+		/* keep the first and every other one, and take them half as often */
+		RECORD_INTERVAL *= 2;
+		for (i = n = 1; i < NUM_CHECKPOINTS; i++) {
+			if (CHECKPOINTS[i]->instruction_count % RECORD_INTERVAL == 0) {
+				CHECKPOINTS[n++] = CHECKPOINTS[i];
+			} else {
+				snapshot_free(CHECKPOINTS[i]);
+			}
+		}
+		NUM_CHECKPOINTS = n;
+		if (INSTRUCTION_COUNT % RECORD_INTERVAL != 0) {
+			return;
+		}
+	}
+	snap = snapshot_take(NULL);
+	snap->input_pos = INPUT_POS;
+	CHECKPOINTS[NUM_CHECKPOINTS++] = snap;
+}
+
+/* hart_execute(), stopping at each checkpoint */
+static uint32_t record_execute(uint32_t num_cycles)
+{
+	uint32_t left = num_cycles, step;
+
+	while (left > 0 && RUN_FLAG && DEBUG_STOP.kind == STOP_NONE) {
+		step = RECORD_INTERVAL - INSTRUCTION_COUNT % RECORD_INTERVAL;
+		step = left < step ? left : step;
+		left -= step - hart_execute(step);
+		if (INSTRUCTION_COUNT % RECORD_INTERVAL == 0) {
+			checkpoint();
+		}
+	}
+	if (INSTRUCTION_COUNT > RECORD_HORIZON) {
+		RECORD_HORIZON = INSTRUCTION_COUNT;
+	}
+	return left;
+}
+
+/* start recording from here, dropping any earlier recording (after a hand edit to the */
+/* state, since replay could not reproduce it); FALSE with more than one hart          */
+int record_start(uint32_t interval)
+{
+	if (NUM_HARTS > 1 || interval == 0) {
+		return FALSE;
+	}
+	record_stop();
+	if (CHECKPOINTS == NULL && (CHECKPOINTS = malloc(RECORD_MAX_CHECKPOINTS * sizeof(snapshot_t *))) == NULL) {
+		printf("Error: Out of memory allocating checkpoints\n");
+		exit(-1);
+	}
+	RECORD_INTERVAL = interval;
+	RECORD_HORIZON = INSTRUCTION_COUNT;
+	CHECKPOINTS[0] = snapshot_take(NULL);
+	CHECKPOINTS[0]->input_pos = 0;
+	NUM_CHECKPOINTS = 1;
+	return TRUE;
+}
+
+void record_stop()
+{
+	checkpoints_free(0);
+	INPUT_LEN = INPUT_POS = 0;
+	RECORD_INTERVAL = 0;
+}
+
+/* back (or forward) to instruction count; FALSE if that is before the recording */
+int record_seek(uint32_t count)
+{
+	snapshot_t *snap = NULL;
+	uint32_t i;
+	int debugging = DEBUGGING;
+
+	for (i = NUM_CHECKPOINTS; i > 0 && snap == NULL; i--) {
+		if (CHECKPOINTS[i - 1]->instruction_count <= count) {
+			snap = CHECKPOINTS[i - 1];
+		}
+	}
+	if (RECORD_INTERVAL == 0 || snap == NULL) {
+		return FALSE;
+	}
+	if (count < INSTRUCTION_COUNT || snap->instruction_count > INSTRUCTION_COUNT) {
+		snapshot_restore(snap);
+		INPUT_POS = snap->input_pos;
+	}
+	/* straight there, past any watchpoint or breakpoint on the way */
+	DEBUGGING = FALSE;
+	DEBUG_STOP.kind = STOP_NONE;
+	record_execute(count - INSTRUCTION_COUNT);
+	DEBUGGING = debugging;
+	BREAK_SKIP_PC = CURRENT_STATE.PC;
+	console_flush();
+	return TRUE;
+}
+
+/* back to the last watchpoint or breakpoint hit before now (DEBUG_STOP says which), or */
+/* to the start of the recording if there was none                                       */
+int record_reverse()
+{
+	uint32_t target = INSTRUCTION_COUNT, last = record_first();
+	debug_stop_t hit = { STOP_NONE, 0, 0, 0 };
+
+	if (!record_seek(last)) {
+		return FALSE;
+	}
+	if (DEBUGGING) {
+		/* forward again with the logged input, noting each hit */
+		BREAK_SKIP_PC = BREAK_NONE;
+		while (INSTRUCTION_COUNT < target && RUN_FLAG) {
+			DEBUG_STOP.kind = STOP_NONE;
+			record_execute(target - INSTRUCTION_COUNT);
+			if (DEBUG_STOP.kind == STOP_NONE) {
+				break;
+			}
+			if (INSTRUCTION_COUNT < target) {
+				hit = DEBUG_STOP;
+				last = INSTRUCTION_COUNT;
+			}
+		}
+		record_seek(last);
+	}
+	DEBUG_STOP = hit;
+	return TRUE;
+}
+
+/* the first instruction count recorded */
+uint32_t record_first()
+{
+	return NUM_CHECKPOINTS > 0 ? CHECKPOINTS[0]->instruction_count : 0;
+}
+
+/**************************************************************/
+/* Copy a block of bytes into guest memory a page at a time                            */
+/**************************************************************/
+void mem_write_block(uint32_t address, const uint8_t *src, uint32_t len)
+{
+	uint32_t chunk, i;
+
+	while (len > 0) {
+		chunk = PAGE_SIZE - (address & PAGE_MASK);
+		if (chunk > len) {
+			chunk = len;
+		}
+		if (find_region(address) != NULL) {
+			memcpy(page_lookup(address, true) + (address & PAGE_MASK), src, chunk);
+			/* keep the decode cache honest if this lands on translated text */
+			if (address - MEM_TEXT_BEGIN < DECODE_CACHE_SIZE * 4) {
+				for (i = 0; i < chunk; i += 4) {
+					decode_invalidate(address + i);
+				}
+			}
+		}
+		address += chunk;
+		src += chunk;
+		len -= chunk;
+	}
+}
+
+/**************************************************************/
+/* Map the whole program file read-only; returns its size in *size                     */
+/**************************************************************/
+static int map_program(uint8_t **image, size_t *size)
+{
+	struct stat st;
+	int fd;
+
+	*image = NULL;
+	fd = open(prog_file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		printf("Error: Can't open program file %s\n", prog_file);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	*size = st.st_size;
+	if (*size == 0) {
+		close(fd);
+		return 0;
+	}
+	*image = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (*image == MAP_FAILED) {
+		*image = NULL;
+		printf("Error: Can't map program file %s\n", prog_file);
+		return -1;
+	}
+	return 0;
+}
+
+/**************************************************************/
+/* Text file of hex words, one per line, loaded from MEM_TEXT_BEGIN                     */
+/**************************************************************/
+static int load_hex() {
+	FILE * fp;
+	int i, word;
+	uint32_t address;
+	/* Open program file. */
+	fp = fopen(prog_file, "r");
+	if (fp == NULL) {
+		printf("Error: Can't open program file %s\n", prog_file);
+		return -1;
+	}
+
+	/* Read in the program. */
+
+	i = 0;
+	while( fscanf(fp, "%x\n", &word) != EOF ) {
+		address = MEM_TEXT_BEGIN + i;
+		mem_write_32(address, word);
+		if (!QUIET) {
+			printf("writing 0x%08x into address 0x%08x (%d)\n", word, address, address);
+		}
+		i += 4;
+	}
+	fclose(fp);
+	PROGRAM_SIZE = i/4;
+	PROGRAM_ENTRY = MEM_TEXT_BEGIN;
+	return i;
+}
+
+/**************************************************************/
+/* Flat little-endian binary image loaded from MEM_TEXT_BEGIN                            */
+/**************************************************************/
+static int load_binary(uint8_t *image, size_t size) {
+	if (size > MEM_TEXT_END - MEM_TEXT_BEGIN + 1) {
+		printf("Error: %s does not fit in the text segment\n", prog_file);
+		return -1;
+	}
+	mem_write_block(MEM_TEXT_BEGIN, image, size);
+	PROGRAM_SIZE = (size + 3) / 4;
+	PROGRAM_ENTRY = MEM_TEXT_BEGIN;
+	return size;
+}
+
+/**************************************************************/
+/* ELF32 RISC-V executable: PT_LOAD segments go to their virtual addresses            */
+/**************************************************************/
+static int load_elf(uint8_t *image, size_t size) {
+	Elf32_Ehdr *ehdr = (Elf32_Ehdr *)image;
+	Elf32_Phdr *phdr;
+	mem_region_t *region;
+	uint32_t i, loaded = 0, text_end = MEM_TEXT_BEGIN;
+
+	if (size < sizeof(Elf32_Ehdr) || ehdr->e_ident[EI_CLASS] != ELFCLASS32 ||
+			ehdr->e_ident[EI_DATA] != ELFDATA2LSB || ehdr->e_machine != EM_RISCV) {
+		printf("Error: %s is not a 32-bit little-endian RISC-V ELF file\n", prog_file);
+		return -1;
+	}
+	if (ehdr->e_phentsize != sizeof(Elf32_Phdr) ||
+			ehdr->e_phoff + (uint64_t)ehdr->e_phnum * sizeof(Elf32_Phdr) > size) {
+		printf("Error: %s has a malformed program header table\n", prog_file);
+		return -1;
+	}
+
+	/* every segment is checked before any is written, so a bad file leaves memory alone */
+	phdr = (Elf32_Phdr *)(image + ehdr->e_phoff);
+	for (i = 0; i < ehdr->e_phnum; i++, phdr++) {
+		if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0) {
+			continue;
+		}
+		region = find_region(phdr->p_vaddr);
+		if (phdr->p_filesz > phdr->p_memsz || phdr->p_offset + (uint64_t)phdr->p_filesz > size ||
+				region == NULL || phdr->p_vaddr + (uint64_t)phdr->p_memsz - 1 > region->end) {
+			printf("Error: segment at 0x%08x in %s does not fit guest memory\n", phdr->p_vaddr, prog_file);
+			return -1;
+		}
+	}
+
+	phdr = (Elf32_Phdr *)(image + ehdr->e_phoff);
+	for (i = 0; i < ehdr->e_phnum; i++, phdr++) {
+		if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0) {
+			continue;
+		}
+		region = find_region(phdr->p_vaddr);
+		/* the rest of p_memsz is .bss, which reads as zero from untouched pages */
+		mem_write_block(phdr->p_vaddr, image + phdr->p_offset, phdr->p_filesz);
+		if (!QUIET) {
+			printf("loading %u bytes into [0x%08x..0x%08x]\n", phdr->p_filesz,
+					phdr->p_vaddr, phdr->p_vaddr + phdr->p_memsz - 1);
+		}
+		if ((phdr->p_flags & PF_X) && region->begin == MEM_TEXT_BEGIN &&
+				phdr->p_vaddr + phdr->p_memsz > text_end) {
+			text_end = phdr->p_vaddr + phdr->p_memsz;
+		}
+		loaded += phdr->p_filesz;
+	}
+	/* the decode cache and end-of-program check cover text up to the last executable byte */
+	PROGRAM_SIZE = (text_end - MEM_TEXT_BEGIN + 3) / 4;
+	PROGRAM_ENTRY = ehdr->e_entry;
+	return loaded;
+}
+
+/**************************************************************/
+/* load program into memory; returns the bytes loaded, -1 if it could not be             */
+/**************************************************************/
+int load_program() {                   
+	program_format_t format = PROGRAM_FORMAT;
+	uint8_t *image = NULL;
+	size_t size = 0;
+	int loaded;
+	size_t len;
+
+	if (format != FORMAT_HEX && map_program(&image, &size) < 0) {
+		return -1;
+	}
+	if (format == FORMAT_AUTO) {
+		len = strlen(prog_file);
+		if (size >= SELFMAG && memcmp(image, ELFMAG, SELFMAG) == 0) {
+			format = FORMAT_ELF;
+		} else if (len > 4 && strcmp(prog_file + len - 4, ".bin") == 0) {
+			format = FORMAT_BINARY;
+		} else {
+			format = FORMAT_HEX;
+		}
+	}
+
+	switch (format) {
+		case FORMAT_ELF:
+			loaded = load_elf(image, size);
+			break;
+		case FORMAT_BINARY:
+			loaded = load_binary(image, size);
+			break;
+		default:
+			loaded = load_hex();
+			break;
+	}
+	if (image != NULL) {
+		munmap(image, size);
+	}
+
+	if (loaded >= 0) {
+		build_decode_cache();
+	}
+	return loaded;
+}
+
+static inline uint32_t rd_get(uint32_t instruction)
+{
+	return (instruction & 0xF80) >> 7;
+}
+
+static inline uint32_t funct3_get(uint32_t instruction)
+{
+	return (instruction & 0x7000) >> 12;
+}
+
+static inline uint32_t rs1_get(uint32_t instruction)
+{
+	return (instruction & 0xf8000) >> 15;
+}
+
+static inline uint32_t rs2_get(uint32_t instruction)
+{
+	return (instruction & 0x1f00000) >> 20;
+}
+
+static inline uint32_t funct7_get(uint32_t instruction)
+{
+	return (instruction & 0xfe000000) >> 25;
+}
+
+/* sign-extended immediates for each instruction format */
+static inline int32_t iImm_get(uint32_t instruction)
+{
+	return (int32_t)instruction >> 20;
+}
+
+static inline int32_t sImm_get(uint32_t instruction)
+{
+	return (((int32_t)instruction >> 25) << 5) | ((instruction >> 7) & 0x1F);
+}
+
+static inline int32_t bImm_get(uint32_t instruction)
+{
+	return (((int32_t)instruction >> 31) << 12) |
+			(((instruction >> 7) & 0x1) << 11) |
+			(((instruction >> 25) & 0x3F) << 5) |
+			(((instruction >> 8) & 0xF) << 1);
+}
+
+static inline int32_t uImm_get(uint32_t instruction)
+{
+	return (int32_t)(instruction & 0xFFFFF000);
+}
+
+static inline int32_t jImm_get(uint32_t instruction)
+{
+	return (((int32_t)instruction >> 31) << 20) |
+			(instruction & 0xFF000) |
+			(((instruction >> 20) & 0x1) << 11) |
+			(((instruction >> 21) & 0x3FF) << 1);
+}
+
+/************************************************************/
+/* Instruction handlers.                                                                                          */
+/* Each updates CURRENT_STATE in place; RETIRE.next_pc already holds PC+4.              */
+/************************************************************/
+#define RS1 CURRENT_STATE.REGS[d->rs1]
+#define RS2 CURRENT_STATE.REGS[d->rs2]
+#define RD  CURRENT_STATE.REGS[d->rd]
+
+/* R-type */
+static void exec_add(decoded_inst_t *d)  { RD = RS1 + RS2; }
+static void exec_sub(decoded_inst_t *d)  { RD = RS1 - RS2; }
+static void exec_sll(decoded_inst_t *d)  { RD = RS1 << (RS2 & 0x1F); }
+static void exec_slt(decoded_inst_t *d)  { RD = ((int32_t)RS1 < (int32_t)RS2) ? 1 : 0; }
+static void exec_sltu(decoded_inst_t *d) { RD = (RS1 < RS2) ? 1 : 0; }
+static void exec_xor(decoded_inst_t *d)  { RD = RS1 ^ RS2; }
+static void exec_srl(decoded_inst_t *d)  { RD = RS1 >> (RS2 & 0x1F); }
+static void exec_sra(decoded_inst_t *d)  { RD = (int32_t)RS1 >> (RS2 & 0x1F); }
+static void exec_or(decoded_inst_t *d)   { RD = RS1 | RS2; }
+static void exec_and(decoded_inst_t *d)  { RD = RS1 & RS2; }
+
+/* I-type arithmetic; shift amounts are pre-masked into imm */
+static void exec_addi(decoded_inst_t *d)  { RD = RS1 + d->imm; }
+static void exec_slti(decoded_inst_t *d)  { RD = ((int32_t)RS1 < d->imm) ? 1 : 0; }
+static void exec_sltiu(decoded_inst_t *d) { RD = (RS1 < (uint32_t)d->imm) ? 1 : 0; }
+static void exec_xori(decoded_inst_t *d)  { RD = RS1 ^ d->imm; }
+static void exec_ori(decoded_inst_t *d)   { RD = RS1 | d->imm; }
+static void exec_andi(decoded_inst_t *d)  { RD = RS1 & d->imm; }
+static void exec_slli(decoded_inst_t *d)  { RD = RS1 << d->imm; }
+static void exec_srli(decoded_inst_t *d)  { RD = RS1 >> d->imm; }
+static void exec_srai(decoded_inst_t *d)  { RD = (int32_t)RS1 >> d->imm; }
+
+/* I-type loads */
+#define LOAD(size, read) retire_load(RS1 + d->imm, size, read(RS1 + d->imm))
+static void exec_lb(decoded_inst_t *d)  { RD = byte_to_word(LOAD(1, mem_read_8)); }
+static void exec_lh(decoded_inst_t *d)  { RD = half_to_word(LOAD(2, mem_read_16)); }
+static void exec_lw(decoded_inst_t *d)  { RD = LOAD(4, mem_read_32); }
+static void exec_lbu(decoded_inst_t *d) { RD = LOAD(1, mem_read_8); }
+static void exec_lhu(decoded_inst_t *d) { RD = LOAD(2, mem_read_16); }
+#undef LOAD
+
+/* S-type */
+#define STORE(size, write) do { write(RS1 + d->imm, RS2); retire_store(RS1 + d->imm, size, RS2); } while (0)
+static void exec_sb(decoded_inst_t *d) { STORE(1, mem_write_8); }
+static void exec_sh(decoded_inst_t *d) { STORE(2, mem_write_16); }
+static void exec_sw(decoded_inst_t *d) { STORE(4, mem_write_32); }
+#undef STORE
+
+/* B-type */
+#define BRANCH_IF(cond) do { if (cond) RETIRE.next_pc = CURRENT_STATE.PC + d->imm; } while (0)
+static void exec_beq(decoded_inst_t *d)  { BRANCH_IF(RS1 == RS2); }
+static void exec_bne(decoded_inst_t *d)  { BRANCH_IF(RS1 != RS2); }
+static void exec_blt(decoded_inst_t *d)  { BRANCH_IF((int32_t)RS1 < (int32_t)RS2); }
+static void exec_bge(decoded_inst_t *d)  { BRANCH_IF((int32_t)RS1 >= (int32_t)RS2); }
+static void exec_bltu(decoded_inst_t *d) { BRANCH_IF(RS1 < RS2); }
+static void exec_bgeu(decoded_inst_t *d) { BRANCH_IF(RS1 >= RS2); }
+#undef BRANCH_IF
+
+/* U-type and J-type */
+static void exec_lui(decoded_inst_t *d)   { RD = d->imm; }
+static void exec_auipc(decoded_inst_t *d) { RD = CURRENT_STATE.PC + d->imm; }
+
+static void exec_jal(decoded_inst_t *d)
+{
+	RD = CURRENT_STATE.PC + 4;
+	RETIRE.next_pc = CURRENT_STATE.PC + d->imm;
+}
+
+static void exec_jalr(decoded_inst_t *d)
+{
+	uint32_t target = (RS1 + d->imm) & ~1u;
+	RD = CURRENT_STATE.PC + 4;
+	RETIRE.next_pc = target;
+}
+
+static void exec_ecall(decoded_inst_t *d) { SYSCALL(&CURRENT_STATE); }
+
+/* a nop unless a debugger is attached; then it stops the run without retiring */
+static void exec_ebreak(decoded_inst_t *d)
+{
+	if (EBREAK_TRAPS) {
+		RETIRE.next_pc = CURRENT_STATE.PC;
+		RETIRE.trapped = TRUE;
+		debug_stop(STOP_BREAK, CURRENT_STATE.PC, CURRENT_STATE.PC);
+		RUN_FLAG = FALSE;
+	}
+}
+static void exec_mhartid(decoded_inst_t *d) { RD = HART_ID; }
+
+/* A extension */
+static void exec_lr_w(decoded_inst_t *d)      { RD = atomic_lr(RS1); }
+static void exec_sc_w(decoded_inst_t *d)      { RD = atomic_sc(RS1, RS2); }
+static void exec_amoswap_w(decoded_inst_t *d) { RD = atomic_rmw(OP_AMOSWAP_W, RS1, RS2); }
+static void exec_amoadd_w(decoded_inst_t *d)  { RD = atomic_rmw(OP_AMOADD_W, RS1, RS2); }
+static void exec_amoxor_w(decoded_inst_t *d)  { RD = atomic_rmw(OP_AMOXOR_W, RS1, RS2); }
+static void exec_amoand_w(decoded_inst_t *d)  { RD = atomic_rmw(OP_AMOAND_W, RS1, RS2); }
+static void exec_amoor_w(decoded_inst_t *d)   { RD = atomic_rmw(OP_AMOOR_W, RS1, RS2); }
+static void exec_amomin_w(decoded_inst_t *d)  { RD = atomic_rmw(OP_AMOMIN_W, RS1, RS2); }
+static void exec_amomax_w(decoded_inst_t *d)  { RD = atomic_rmw(OP_AMOMAX_W, RS1, RS2); }
+static void exec_amominu_w(decoded_inst_t *d) { RD = atomic_rmw(OP_AMOMINU_W, RS1, RS2); }
+static void exec_amomaxu_w(decoded_inst_t *d) { RD = atomic_rmw(OP_AMOMAXU_W, RS1, RS2); }
+
+/* unknown opcodes are skipped, malformed known ones stop the simulation */
+static void exec_nop(decoded_inst_t *d) { }
+
+static void exec_invalid(decoded_inst_t *d)
+{
+	printf("Invalid instruction");
+	RUN_FLAG = FALSE;
+}
+
+#undef RS1
+#undef RS2
+#undef RD
+
+/* handlers indexed by OP_* */
+static const inst_handler_t HANDLERS[NUM_OPS] = {
+	[OP_INVALID] = exec_invalid, [OP_NOP] = exec_nop,
+	[OP_ADD] = exec_add, [OP_SUB] = exec_sub, [OP_SLL] = exec_sll, [OP_SLT] = exec_slt,
+	[OP_SLTU] = exec_sltu, [OP_XOR] = exec_xor, [OP_SRL] = exec_srl, [OP_SRA] = exec_sra,
+	[OP_OR] = exec_or, [OP_AND] = exec_and,
+	[OP_ADDI] = exec_addi, [OP_SLTI] = exec_slti, [OP_SLTIU] = exec_sltiu, [OP_XORI] = exec_xori,
+	[OP_ORI] = exec_ori, [OP_ANDI] = exec_andi, [OP_SLLI] = exec_slli, [OP_SRLI] = exec_srli,
+	[OP_SRAI] = exec_srai,
+	[OP_LB] = exec_lb, [OP_LH] = exec_lh, [OP_LW] = exec_lw, [OP_LBU] = exec_lbu, [OP_LHU] = exec_lhu,
+	[OP_SB] = exec_sb, [OP_SH] = exec_sh, [OP_SW] = exec_sw,
+	[OP_BEQ] = exec_beq, [OP_BNE] = exec_bne, [OP_BLT] = exec_blt, [OP_BGE] = exec_bge,
+	[OP_BLTU] = exec_bltu, [OP_BGEU] = exec_bgeu,
+	[OP_LUI] = exec_lui, [OP_AUIPC] = exec_auipc, [OP_JAL] = exec_jal, [OP_JALR] = exec_jalr,
+	[OP_ECALL] = exec_ecall, [OP_EBREAK] = exec_ebreak,
+	[OP_LR_W] = exec_lr_w, [OP_SC_W] = exec_sc_w, [OP_AMOSWAP_W] = exec_amoswap_w,
+	[OP_AMOADD_W] = exec_amoadd_w, [OP_AMOXOR_W] = exec_amoxor_w, [OP_AMOAND_W] = exec_amoand_w,
+	[OP_AMOOR_W] = exec_amoor_w, [OP_AMOMIN_W] = exec_amomin_w, [OP_AMOMAX_W] = exec_amomax_w,
+	[OP_AMOMINU_W] = exec_amominu_w, [OP_AMOMAXU_W] = exec_amomaxu_w,
+	[OP_MHARTID] = exec_mhartid,
+};
+
+/************************************************************/
+/* Decode an instruction word into its handler and operands. The same tables drive    */
+/* execution and disassembly: the opcode and funct fields pick the op, and the op's   */
+/* format says where its immediate lives and how it prints.                            */
+/************************************************************/
+/* fixed-size so the disassembler can copy a name without looking for its end first */
+static const char OP_NAMES[NUM_OPS][OP_NAME_SIZE] = {
+	[OP_INVALID] = "invalid", [OP_NOP] = "nop",
+	[OP_ADD] = "add", [OP_SUB] = "sub", [OP_SLL] = "sll", [OP_SLT] = "slt",
+	[OP_SLTU] = "sltu", [OP_XOR] = "xor", [OP_SRL] = "srl", [OP_SRA] = "sra",
+	[OP_OR] = "or", [OP_AND] = "and",
+	[OP_ADDI] = "addi", [OP_SLTI] = "slti", [OP_SLTIU] = "sltiu", [OP_XORI] = "xori",
+	[OP_ORI] = "ori", [OP_ANDI] = "andi", [OP_SLLI] = "slli", [OP_SRLI] = "srli",
+	[OP_SRAI] = "srai",
+	[OP_LB] = "lb", [OP_LH] = "lh", [OP_LW] = "lw", [OP_LBU] = "lbu", [OP_LHU] = "lhu",
+	[OP_SB] = "sb", [OP_SH] = "sh", [OP_SW] = "sw",
+	[OP_BEQ] = "beq", [OP_BNE] = "bne", [OP_BLT] = "blt", [OP_BGE] = "bge",
+	[OP_BLTU] = "bltu", [OP_BGEU] = "bgeu",
+	[OP_LUI] = "lui", [OP_AUIPC] = "auipc", [OP_JAL] = "jal", [OP_JALR] = "jalr",
+	[OP_ECALL] = "ecall", [OP_EBREAK] = "ebreak",
+	[OP_LR_W] = "lr.w", [OP_SC_W] = "sc.w", [OP_AMOSWAP_W] = "amoswap.w", [OP_AMOADD_W] = "amoadd.w",
+	[OP_AMOXOR_W] = "amoxor.w", [OP_AMOAND_W] = "amoand.w", [OP_AMOOR_W] = "amoor.w",
+	[OP_AMOMIN_W] = "amomin.w", [OP_AMOMAX_W] = "amomax.w", [OP_AMOMINU_W] = "amominu.w",
+	[OP_AMOMAXU_W] = "amomaxu.w", [OP_MHARTID] = "csrr",
+};
+
+/* operand layouts; FMT_NONE ops have neither operands nor an immediate */
+enum {
+	FMT_NONE,
+	FMT_R,		/* rd rs1 rs2 */
+	FMT_I,		/* rd rs1 imm */
+	FMT_SHIFT,	/* rd rs1 shamt, the shamt in the rs2 field */
+	FMT_LOAD,	/* rd imm(rs1), also jalr */
+	FMT_STORE,	/* rs2 imm(rs1) */
+	FMT_BRANCH,	/* rs1, rs2, target */
+	FMT_U,		/* rd imm[31:12] */
+	FMT_J,		/* rd target */
+	FMT_LR,		/* rd (rs1) */
+	FMT_AMO,	/* rd rs2 (rs1) */
+	FMT_CSR		/* rd mhartid */
+};
+
+static const uint8_t OP_FORMATS[NUM_OPS] = {
+	[OP_ADD] = FMT_R, [OP_SUB] = FMT_R, [OP_SLL] = FMT_R, [OP_SLT] = FMT_R, [OP_SLTU] = FMT_R,
+	[OP_XOR] = FMT_R, [OP_SRL] = FMT_R, [OP_SRA] = FMT_R, [OP_OR] = FMT_R, [OP_AND] = FMT_R,
+	[OP_ADDI] = FMT_I, [OP_SLTI] = FMT_I, [OP_SLTIU] = FMT_I, [OP_XORI] = FMT_I, [OP_ORI] = FMT_I,
+	[OP_ANDI] = FMT_I, [OP_SLLI] = FMT_SHIFT, [OP_SRLI] = FMT_SHIFT, [OP_SRAI] = FMT_SHIFT,
+	[OP_LB] = FMT_LOAD, [OP_LH] = FMT_LOAD, [OP_LW] = FMT_LOAD, [OP_LBU] = FMT_LOAD, [OP_LHU] = FMT_LOAD,
+	[OP_JALR] = FMT_LOAD,
+	[OP_SB] = FMT_STORE, [OP_SH] = FMT_STORE, [OP_SW] = FMT_STORE,
+	[OP_BEQ] = FMT_BRANCH, [OP_BNE] = FMT_BRANCH, [OP_BLT] = FMT_BRANCH, [OP_BGE] = FMT_BRANCH,
+	[OP_BLTU] = FMT_BRANCH, [OP_BGEU] = FMT_BRANCH,
+	[OP_LUI] = FMT_U, [OP_AUIPC] = FMT_U, [OP_JAL] = FMT_J,
+	[OP_LR_W] = FMT_LR, [OP_SC_W] = FMT_AMO, [OP_AMOSWAP_W] = FMT_AMO, [OP_AMOADD_W] = FMT_AMO,
+	[OP_AMOXOR_W] = FMT_AMO, [OP_AMOAND_W] = FMT_AMO, [OP_AMOOR_W] = FMT_AMO, [OP_AMOMIN_W] = FMT_AMO,
+	[OP_AMOMAX_W] = FMT_AMO, [OP_AMOMINU_W] = FMT_AMO, [OP_AMOMAXU_W] = FMT_AMO,
+	[OP_MHARTID] = FMT_CSR,
+};
+
+/* ops by funct3; OP_INVALID (0) fills the encodings RV32IA leaves unused */
+static const uint8_t LOAD_OPS[8] = {
+	OP_LB, OP_LH, OP_LW, OP_INVALID, OP_LBU, OP_LHU
+};
+static const uint8_t STORE_OPS[8] = {
+	OP_SB, OP_SH, OP_SW
+};
+static const uint8_t BRANCH_OPS[8] = {
+	OP_BEQ, OP_BNE, OP_INVALID, OP_INVALID, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU
+};
+static const uint8_t OP_IMM_OPS[8] = {
+	OP_ADDI, OP_SLLI, OP_SLTI, OP_SLTIU, OP_XORI, OP_SRLI, OP_ORI, OP_ANDI
+};
+/* register-register ops by funct7 == 0x20 and funct3 */
+static const uint8_t OP_OPS[2][8] = {
+	{ OP_ADD, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_OR, OP_AND },
+	{ OP_SUB, OP_INVALID, OP_INVALID, OP_INVALID, OP_INVALID, OP_SRA }
+};
+/* atomics by funct5; aq and rl are ignored, every atomic is sequentially consistent */
+static const uint8_t AMO_OPS[32] = {
+	[0x00] = OP_AMOADD_W, [0x01] = OP_AMOSWAP_W, [0x02] = OP_LR_W, [0x03] = OP_SC_W,
+	[0x04] = OP_AMOXOR_W, [0x08] = OP_AMOOR_W, [0x0C] = OP_AMOAND_W, [0x10] = OP_AMOMIN_W,
+	[0x14] = OP_AMOMAX_W, [0x18] = OP_AMOMINU_W, [0x1C] = OP_AMOMAXU_W
+};
+
+void decode_instruction(uint32_t instruction, decoded_inst_t *d)
+{
+	uint32_t f3 = funct3_get(instruction), f7 = funct7_get(instruction);
+	uint8_t op;
+
+	d->rd = rd_get(instruction);
+	d->rs1 = rs1_get(instruction);
+	d->rs2 = rs2_get(instruction);
+
+	switch (instruction & 0x7F)
+	{
+	case 0x03: op = LOAD_OPS[f3]; break;
+	case 0x23: op = STORE_OPS[f3]; break;
+	case 0x63: op = BRANCH_OPS[f3]; break;
+	case 0x13: //Iimm; funct7 has to be clear for the shifts but srai
+		op = OP_IMM_OPS[f3];
+		if (op == OP_SRLI && f7 == 0x20) {
+			op = OP_SRAI;
+		} else if (OP_FORMATS[op] == FMT_SHIFT && f7 != 0) {
+			op = OP_INVALID;
+		}
+		break;
+	case 0x33: //R
+		op = f7 == 0 ? OP_OPS[0][f3] : f7 == 0x20 ? OP_OPS[1][f3] : OP_INVALID;
+		break;
+	case 0x37: op = OP_LUI; break;
+	case 0x17: op = OP_AUIPC; break;
+	case 0x6F: op = OP_JAL; break;
+	case 0x67: op = f3 == 0 ? OP_JALR : OP_INVALID; break;
+	case 0x73: //ecall, ebreak and csrr rd, mhartid; other SYSTEM instructions are ignored
+		if (instruction == 0x00000073) {
+			op = OP_ECALL;
+		} else if (instruction == EBREAK_INSTRUCTION) {
+			op = OP_EBREAK;
+		} else if ((instruction & 0xFFFFF07F) == 0xF1402073) {
+			op = OP_MHARTID;
+		} else {
+			op = OP_NOP;
+		}
+		break;
+	case 0x2F: //A
+		op = f3 == 2 ? AMO_OPS[instruction >> 27] : OP_INVALID;
+		if (op == OP_LR_W && d->rs2 != 0) {
+			op = OP_INVALID;
+		}
+		break;
+	default:
+		op = OP_NOP;
+		break;
+	}
+
+	switch (OP_FORMATS[op])
+	{
+	case FMT_I: case FMT_LOAD: d->imm = iImm_get(instruction); break;
+	case FMT_SHIFT: d->imm = d->rs2; break;
+	case FMT_STORE: d->imm = sImm_get(instruction); break;
+	case FMT_BRANCH: d->imm = bImm_get(instruction); break;
+	case FMT_U: d->imm = uImm_get(instruction); break;
+	case FMT_J: d->imm = jImm_get(instruction); break;
+	default: d->imm = 0; break;
+	}
+	d->op = op;
+	d->handler = HANDLERS[op];
+}
+
+/************************************************************/
+/* Disassembly into a caller's buffer, formatted by hand rather than through printf so */
+/* whole firmware images disassemble about as fast as they can be written out.        */
+/************************************************************/
+static inline char *put_str(char *p, const char *s)
+{
+	while (*s != '\0') {
+		*p++ = *s++;
+	}
+	return p;
+}
+
+/* " x<r>" */
+static inline char *put_reg(char *p, uint32_t r)
+{
+	*p++ = ' ';
+	*p++ = 'x';
+	if (r >= 10) {
+		*p++ = '0' + r / 10;
+	}
+	*p++ = '0' + r % 10;
+	return p;
+}
+
+/* "(x<r>)" */
+static inline char *put_base(char *p, uint32_t r)
+{
+	*p++ = '(';
+	*p++ = 'x';
+	if (r >= 10) {
+		*p++ = '0' + r / 10;
+	}
+	*p++ = '0' + r % 10;
+	*p++ = ')';
+	return p;
+}
+
+static inline char *put_dec(char *p, int32_t value)
+{
+	char digits[10];
+	uint32_t u = value < 0 ? -(uint32_t)value : (uint32_t)value;
+	int n = 0;
+
+	if (value < 0) {
+		*p++ = '-';
+	}
+	do {
+		digits[n++] = '0' + u % 10;
+		u /= 10;
+	} while (u != 0);
+	while (n > 0) {
+		*p++ = digits[--n];
+	}
+	return p;
+}
+
+/* "00" to "ff", so hex goes out two digits at a time */
+#define HEX_ROW(hi) hi "0" hi "1" hi "2" hi "3" hi "4" hi "5" hi "6" hi "7" \
+	hi "8" hi "9" hi "a" hi "b" hi "c" hi "d" hi "e" hi "f"
+static const char HEX_PAIRS[] =
+	HEX_ROW("0") HEX_ROW("1") HEX_ROW("2") HEX_ROW("3") HEX_ROW("4") HEX_ROW("5") HEX_ROW("6") HEX_ROW("7")
+	HEX_ROW("8") HEX_ROW("9") HEX_ROW("a") HEX_ROW("b") HEX_ROW("c") HEX_ROW("d") HEX_ROW("e") HEX_ROW("f");
+#undef HEX_ROW
+
+static inline char *put_hex(char *p, uint32_t value, int digits)
+{
+	if (digits & 1) {
+		digits--;
+		*p++ = HEX_PAIRS[2 * ((value >> (4 * digits)) & 0xF) + 1];
+	}
+	while (digits > 0) {
+		digits -= 2;
+		memcpy(p, &HEX_PAIRS[2 * ((value >> (4 * digits)) & 0xFF)], 2);
+		p += 2;
+	}
+	return p;
+}
+
+/* one instruction as text ending in a newline, at most DISASM_LINE_MAX bytes with the NUL; its length */
+uint32_t disasm_decoded(char *buf, uint32_t pc, const decoded_inst_t *d)
+{
+	char *p = buf;
+
+	memcpy(p, OP_NAMES[d->op], OP_NAME_SIZE);
+	p += strlen(p);
+
+	switch (OP_FORMATS[d->op])
+	{
+	case FMT_R:
+		p = put_reg(put_reg(put_reg(p, d->rd), d->rs1), d->rs2);
+		break;
+	case FMT_I: case FMT_SHIFT:
+		p = put_reg(put_reg(p, d->rd), d->rs1);
+		*p++ = ' ';
+		p = put_dec(p, d->imm);
+		break;
+	case FMT_LOAD: case FMT_STORE:
+		p = put_reg(p, OP_FORMATS[d->op] == FMT_STORE ? d->rs2 : d->rd);
+		*p++ = ' ';
+		p = put_base(put_dec(p, d->imm), d->rs1);
+		break;
+	case FMT_BRANCH:
+		p = put_reg(p, d->rs1);
+		*p++ = ',';
+		p = put_reg(p, d->rs2);
+		p = put_str(p, ", 0x");
+		p = put_hex(p, pc + d->imm, 8);
+		break;
+	case FMT_U:
+		p = put_reg(p, d->rd);
+		p = put_str(p, " 0x");
+		p = put_hex(p, (uint32_t)d->imm >> 12, 5);
+		break;
+	case FMT_J:
+		p = put_reg(p, d->rd);
+		p = put_str(p, " 0x");
+		p = put_hex(p, pc + d->imm, 8);
+		break;
+	case FMT_LR:
+		p = put_reg(p, d->rd);
+		*p++ = ' ';
+		p = put_base(p, d->rs1);
+		break;
+	case FMT_AMO:
+		p = put_reg(put_reg(p, d->rd), d->rs2);
+		*p++ = ' ';
+		p = put_base(p, d->rs1);
+		break;
+	case FMT_CSR:
+		p = put_str(put_reg(p, d->rd), " mhartid");
+		break;
+	}
+	*p++ = '\n';
+	*p = '\0';
+	return p - buf;
+}
+
+/************************************************************/
+/* Decode cache: one predecoded entry per word of the loaded text                       */
+/************************************************************/
+
+/* indexed by OP_*; NUM_OPS is the re-translate stub, NUM_OPS + 1 the end-of-text exit */
+static const void *const *THREADED_LABELS;
+
+/* placeholder handler for invalidated entries: decode again, then execute */
+static void exec_undecoded(decoded_inst_t *d)
+{
+	uint32_t address = MEM_TEXT_BEGIN + (uint32_t)(d - DECODE_CACHE) * 4;
+	decode_instruction(fetch_32(address), d);
+	d->handler(d);
+}
+
+void build_decode_cache()
+{
+	uint32_t i;
+
+	free(DECODE_CACHE);
+	free(THREADED_CODE);
+	free(TEXT_DIRTY);
+	THREADED_CODE = NULL;
+	flush_blocks();
+	/* one extra entry for the word executed just past the end of the program */
+	DECODE_CACHE_SIZE = PROGRAM_SIZE + 1;
+	DECODE_CACHE = malloc(DECODE_CACHE_SIZE * sizeof(decoded_inst_t));
+	TEXT_DIRTY = calloc((DECODE_CACHE_SIZE >> TEXT_PAGE_SHIFT) / 8 + 1, 1);
+	TEXT_PENDING = FALSE;
+	if (DECODE_CACHE == NULL || TEXT_DIRTY == NULL) {
+		printf("Error: Out of memory allocating decode cache\n");
+		exit(-1);
+	}
+	for (i = 0; i < DECODE_CACHE_SIZE; i++) {
+		decode_instruction(fetch_32(MEM_TEXT_BEGIN + i * 4), &DECODE_CACHE[i]);
+	}
+}
+
+static void decode_invalidate_index(uint32_t index)
+{
+	DECODE_CACHE[index].handler = exec_undecoded;
+	if (THREADED_CODE != NULL) {
+		THREADED_CODE[index].label = THREADED_LABELS[NUM_OPS];
+	}
+	if (BLOCK_MAP != NULL) {
+		BLOCKS_STALE = TRUE;
+	}
+}
+
+/* called on every store so self-modifying code re-decodes. Other harts may be running  */
+/* on their own threads, so they are only told; each catches up in text_sync().        */
+void decode_invalidate(uint32_t address)
+{
+	uint32_t index = (address - MEM_TEXT_BEGIN) >> 2, page = index >> TEXT_PAGE_SHIFT, i;
+	riscv_sim_t *self = SIM;
+
+	if (index >= DECODE_CACHE_SIZE) {
+		return;
+	}
+	decode_invalidate_index(index);
+	for (i = 0; i < NUM_HARTS && NUM_HARTS > 1; i++) {
+		SIM = HARTS[i];
+		if (SIM != self && index < DECODE_CACHE_SIZE) {
+			__atomic_fetch_or(&TEXT_DIRTY[page >> 3], 1 << (page & 7), __ATOMIC_RELEASE);
+			__atomic_store_n(&TEXT_PENDING, TRUE, __ATOMIC_RELEASE);
+		}
+	}
+	SIM = self;
+}
+
+/* drop what this hart decoded from the text pages other harts stored to; between runs only */
+static void text_sync()
+{
+	uint32_t i, page, index, end;
+	uint8_t bits;
+
+	__atomic_store_n(&TEXT_PENDING, FALSE, __ATOMIC_RELAXED);
+	for (i = 0; i <= (DECODE_CACHE_SIZE >> TEXT_PAGE_SHIFT) / 8; i++) {
+		bits = __atomic_load_n(&TEXT_DIRTY[i], __ATOMIC_RELAXED);
+		if (bits == 0 || (bits = __atomic_exchange_n(&TEXT_DIRTY[i], 0, __ATOMIC_ACQUIRE)) == 0) {
+			continue;
+		}
+		for (page = i * 8; bits != 0; page++, bits >>= 1) {
+			if (bits & 1) {
+				end = (page + 1) << TEXT_PAGE_SHIFT;
+				for (index = page << TEXT_PAGE_SHIFT; index < end && index < DECODE_CACHE_SIZE; index++) {
+					decode_invalidate_index(index);
+				}
+			}
+		}
+	}
+}
+
+/* cached entry for PC, or a freshly decoded one in scratch outside the cached text */
+static inline decoded_inst_t *decode_lookup(uint32_t pc, decoded_inst_t *scratch)
+{
+	uint32_t index = (pc - MEM_TEXT_BEGIN) >> 2;
+	if ((pc & 3) == 0 && index < DECODE_CACHE_SIZE) {
+		return &DECODE_CACHE[index];
+	}
+	decode_instruction(fetch_32(pc), scratch);
+	return scratch;
+}
+
+/************************************************************/
+/* In-place semantics shared by the threaded and block engines. Each entry expands    */
+/* inside an engine that defines RS1, RS2, IMM and PC_HERE for the current op.        */
+/************************************************************/
+
+/* ops that write rd: X(name, value) */
+#define INPLACE_RD_OPS(X) \
+	X(ADD, RS1 + RS2) \
+	X(SUB, RS1 - RS2) \
+	X(SLL, RS1 << (RS2 & 0x1F)) \
+	X(SLT, ((int32_t)RS1 < (int32_t)RS2) ? 1 : 0) \
+	X(SLTU, (RS1 < RS2) ? 1 : 0) \
+	X(XOR, RS1 ^ RS2) \
+	X(SRL, RS1 >> (RS2 & 0x1F)) \
+	X(SRA, (int32_t)RS1 >> (RS2 & 0x1F)) \
+	X(OR, RS1 | RS2) \
+	X(AND, RS1 & RS2) \
+	X(ADDI, RS1 + IMM) \
+	X(SLTI, ((int32_t)RS1 < IMM) ? 1 : 0) \
+	X(SLTIU, (RS1 < (uint32_t)IMM) ? 1 : 0) \
+	X(XORI, RS1 ^ IMM) \
+	X(ORI, RS1 | IMM) \
+	X(ANDI, RS1 & IMM) \
+	X(SLLI, RS1 << IMM) \
+	X(SRLI, RS1 >> IMM) \
+	X(SRAI, (int32_t)RS1 >> IMM) \
+	X(LB, byte_to_word(mem_read_8(RS1 + IMM))) \
+	X(LH, half_to_word(mem_read_16(RS1 + IMM))) \
+	X(LW, mem_read_32(RS1 + IMM)) \
+	X(LBU, mem_read_8(RS1 + IMM)) \
+	X(LHU, mem_read_16(RS1 + IMM)) \
+	X(LUI, IMM) \
+	X(AUIPC, PC_HERE + IMM) \
+	X(MHARTID, HART_ID)
+
+/* atomics, which write memory as well as rd: X(name, value) */
+#define INPLACE_ATOMIC_OPS(X) \
+	X(LR_W, atomic_lr(RS1)) \
+	X(SC_W, atomic_sc(RS1, RS2)) \
+	X(AMOSWAP_W, atomic_rmw(OP_AMOSWAP_W, RS1, RS2)) \
+	X(AMOADD_W, atomic_rmw(OP_AMOADD_W, RS1, RS2)) \
+	X(AMOXOR_W, atomic_rmw(OP_AMOXOR_W, RS1, RS2)) \
+	X(AMOAND_W, atomic_rmw(OP_AMOAND_W, RS1, RS2)) \
+	X(AMOOR_W, atomic_rmw(OP_AMOOR_W, RS1, RS2)) \
+	X(AMOMIN_W, atomic_rmw(OP_AMOMIN_W, RS1, RS2)) \
+	X(AMOMAX_W, atomic_rmw(OP_AMOMAX_W, RS1, RS2)) \
+	X(AMOMINU_W, atomic_rmw(OP_AMOMINU_W, RS1, RS2)) \
+	X(AMOMAXU_W, atomic_rmw(OP_AMOMAXU_W, RS1, RS2))
+
+/* stores: X(name, statement) */
+#define INPLACE_STORE_OPS(X) \
+	X(SB, mem_write_8(RS1 + IMM, RS2)) \
+	X(SH, mem_write_16(RS1 + IMM, RS2)) \
+	X(SW, mem_write_32(RS1 + IMM, RS2))
+
+/* conditional branches: X(name, condition) */
+#define INPLACE_BRANCH_OPS(X) \
+	X(BEQ, RS1 == RS2) \
+	X(BNE, RS1 != RS2) \
+	X(BLT, (int32_t)RS1 < (int32_t)RS2) \
+	X(BGE, (int32_t)RS1 >= (int32_t)RS2) \
+	X(BLTU, RS1 < RS2) \
+	X(BGEU, RS1 >= RS2)
+
+/* [OP_x] = &&op_x for every op listed above */
+#define LABEL_ENTRY(name, expr) [OP_##name] = &&op_##name,
+#define INPLACE_LABELS \
+	INPLACE_RD_OPS(LABEL_ENTRY) INPLACE_STORE_OPS(LABEL_ENTRY) INPLACE_BRANCH_OPS(LABEL_ENTRY) \
+	INPLACE_ATOMIC_OPS(LABEL_ENTRY) \
+	[OP_INVALID] = &&op_invalid, [OP_NOP] = &&op_nop, [OP_ECALL] = &&op_ecall, \
+	[OP_EBREAK] = &&op_ebreak, \
+	[OP_JAL] = &&op_jal, [OP_JALR] = &&op_jalr,
+
+static inline bool op_is_branch(uint8_t op)
+{
+	return op >= OP_BEQ && op <= OP_BGEU;
+}
+
+static inline bool op_is_atomic(uint8_t op)
+{
+	return op >= OP_LR_W && op <= OP_AMOMAXU_W;
+}
+
+/* ops after which execution does not simply continue at PC+4 */
+static inline bool op_ends_block(uint8_t op)
+{
+	return op_is_branch(op) || op == OP_JAL || op == OP_JALR || op == OP_INVALID || op == OP_ECALL;
+}
+
+static inline bool op_writes_rd(uint8_t op)
+{
+	return !op_is_branch(op) && op != OP_SB && op != OP_SH && op != OP_SW &&
+			op != OP_NOP && op != OP_INVALID && op != OP_ECALL && op != OP_EBREAK;
+}
+
+/************************************************************/
+/* Direct-threaded engine.                                                                                       */
+/* The decode cache is translated into a stream of label addresses so every handler   */
+/* jumps straight to the next one. State is updated in place in CURRENT_STATE.          */
+/************************************************************/
+static void translate_threaded(uint32_t index)
+{
+	decoded_inst_t *d = &DECODE_CACHE[index];
+	threaded_inst_t *t = &THREADED_CODE[index];
+	uint32_t target;
+
+	if (d->handler == exec_undecoded) {
+		t->label = THREADED_LABELS[NUM_OPS];
+		return;
+	}
+	t->label = THREADED_LABELS[d->op];
+	t->op = d->op;
+	t->rd = d->rd;
+	t->rs1 = d->rs1;
+	t->rs2 = d->rs2;
+	t->imm = d->imm;
+	t->target = NULL;
+	if (op_is_branch(d->op) || d->op == OP_JAL) {
+		target = index + (d->imm >> 2);
+		if ((d->imm & 3) == 0 && target < DECODE_CACHE_SIZE) {
+			t->target = &THREADED_CODE[target];
+		}
+	}
+}
+
+static void build_threaded_code()
+{
+	uint32_t i;
+
+	/* plus a sentinel that exits when execution falls off the end of the text */
+	THREADED_CODE = malloc((DECODE_CACHE_SIZE + 1) * sizeof(threaded_inst_t));
+	if (THREADED_CODE == NULL) {
+		printf("Error: Out of memory allocating threaded code\n");
+		exit(-1);
+	}
+	for (i = 0; i < DECODE_CACHE_SIZE; i++) {
+		translate_threaded(i);
+	}
+	THREADED_CODE[DECODE_CACHE_SIZE].label = THREADED_LABELS[NUM_OPS + 1];
+}
+
+/* budget == 0 only publishes the label table */
+static uint32_t threaded_engine(uint32_t budget)
+{
+	static const void *const labels[NUM_OPS + 2] = {
+		INPLACE_LABELS
+		[NUM_OPS] = &&op_undecoded, [NUM_OPS + 1] = &&leave,
+	};
+	uint32_t *regs = CURRENT_STATE.REGS;
+	uint32_t left = budget;
+	uint32_t index, address;
+	threaded_inst_t *t;
+
+	if (budget == 0) {
+		THREADED_LABELS = labels;
+		return 0;
+	}
+	index = (CURRENT_STATE.PC - MEM_TEXT_BEGIN) >> 2;
+	if ((CURRENT_STATE.PC & 3) != 0 || index >= DECODE_CACHE_SIZE) {
+		return 0;
+	}
+	t = &THREADED_CODE[index];
+
+#define RS1 regs[t->rs1]
+#define RS2 regs[t->rs2]
+#define IMM t->imm
+#define PC_HERE (MEM_TEXT_BEGIN + (uint32_t)(t - THREADED_CODE) * 4)
+/* retire the current instruction; t already points at the next one */
+#define NEXT() do { \
+		regs[0] = 0; \
+		left--; \
+		if (left == 0) goto leave; \
+		goto *t->label; \
+	} while (0)
+#define RD_OP(name, expr) op_##name: regs[t->rd] = (expr); t++; NEXT();
+#define STORE_OP(name, stmt) op_##name: stmt; t++; NEXT();
+#define BRANCH_OP(name, cond) op_##name: if (cond) goto taken; t++; NEXT();
+#define ATOMIC_OP(name, expr) RD_OP(name, expr)
+
+	goto *t->label;
+
+	INPLACE_RD_OPS(RD_OP)
+	INPLACE_STORE_OPS(STORE_OP)
+	INPLACE_BRANCH_OPS(BRANCH_OP)
+	INPLACE_ATOMIC_OPS(ATOMIC_OP)
+
+op_jal:
+	regs[t->rd] = PC_HERE + 4;
+taken:
+	if (t->target != NULL) {
+		t = t->target;
+		NEXT();
+	}
+	address = PC_HERE + t->imm;
+	goto leave_text;
+
+op_jalr:
+	address = (RS1 + t->imm) & ~1u;
+	regs[t->rd] = PC_HERE + 4;
+	index = (address - MEM_TEXT_BEGIN) >> 2;
+	if ((address & 3) == 0 && index < DECODE_CACHE_SIZE) {
+		t = &THREADED_CODE[index];
+		NEXT();
+	}
+	goto leave_text;
+
+op_nop:
+	t++;
+	NEXT();
+
+op_invalid:
+	printf("Invalid instruction");
+	RUN_FLAG = FALSE;
+	t++;
+	left--;
+	CURRENT_STATE.PC = PC_HERE;
+	goto done;
+
+op_ecall:
+	t++;
+	left--;
+	CURRENT_STATE.PC = PC_HERE;
+	SYSCALL(&CURRENT_STATE);
+	if (RUN_FLAG && left > 0) {
+		goto *t->label;
+	}
+	goto done;
+
+/* with a debugger attached the interpreter takes the trap */
+op_ebreak:
+	if (!EBREAK_TRAPS) {
+		t++;
+		NEXT();
+	}
+	CURRENT_STATE.PC = PC_HERE;
+	goto done;
+
+op_undecoded:
+	index = t - THREADED_CODE;
+	decode_instruction(fetch_32(PC_HERE), &DECODE_CACHE[index]);
+	translate_threaded(index);
+	goto *t->label;
+
+leave:
+	CURRENT_STATE.PC = PC_HERE;
+	goto done;
+
+/* retired an instruction whose successor is outside the translated text */
+leave_text:
+	regs[0] = 0;
+	left--;
+	CURRENT_STATE.PC = address;
+
+done:
+	INSTRUCTION_COUNT += budget - left;
+	if (CURRENT_STATE.PC > (PROGRAM_SIZE * 4) + MEM_TEXT_BEGIN) RUN_FLAG = FALSE;
+	return budget - left;
+
+#undef RS1
+#undef RS2
+#undef IMM
+#undef PC_HERE
+#undef NEXT
+#undef RD_OP
+#undef STORE_OP
+#undef BRANCH_OP
+#undef ATOMIC_OP
+}
+
+/************************************************************/
+/* Run up to budget instructions on the threaded engine. Returns the number retired,   */
+/* 0 when PC is outside the translated text and the caller must fall back to cycle(). */
+/************************************************************/
+uint32_t run_threaded(uint32_t budget)
+{
+	if (THREADED_LABELS == NULL) {
+		threaded_engine(0);
+	}
+	if (THREADED_CODE == NULL) {
+		build_threaded_code();
+	}
+	return threaded_engine(budget);
+}
+
+/************************************************************/
+/* x86-64 JIT.                                                                                                          */
+/* Blocks that run JIT_THRESHOLD times are compiled to native code. Guest registers */
+/* stay in memory, addressed off rbx; loads and stores call the C memory routines. */
+/* A compiled block returns JIT_EXIT_* in the low two bits of its result.              */
+/************************************************************/
+#define JIT_THRESHOLD 32
+#define JIT_BUFFER_SIZE (16u << 20)
+#define JIT_MAX_OP_BYTES 48		/* longest sequence emitted for one op */
+
+#define JIT_EXIT_FALLTHROUGH 0
+#define JIT_EXIT_TAKEN 1
+#define JIT_EXIT_INDIRECT 2		/* jalr: target left in CURRENT_STATE.PC */
+#define JIT_EXIT_STALE 3		/* a store hit the text: (retired << 2) | JIT_EXIT_STALE */
+
+#if defined(__x86_64__)
+
+static __thread uint8_t *jit_p;	/* where the block being compiled is emitted */
+
+static void emit8(uint8_t v) { *jit_p++ = v; }
+static void emit32(uint32_t v) { memcpy(jit_p, &v, 4); jit_p += 4; }
+static void emit64(uint64_t v) { memcpy(jit_p, &v, 8); jit_p += 8; }
+
+/* host registers for the reg field of a modrm byte */
+#define X86_EAX 0
+#define X86_ECX 1
+#define X86_ESI 6
+#define X86_EDI 7
+
+/* <opcode> host, [rbx + 4*guest] */
+static void emit_guest_op(uint8_t opcode, int host, uint8_t guest)
+{
+	emit8(opcode);
+	emit8(0x43 | (host << 3));
+	emit8(guest * 4);
+}
+
+static void emit_load_guest(int host, uint8_t guest) { emit_guest_op(0x8B, host, guest); }
+static void emit_store_eax(uint8_t guest) { emit_guest_op(0x89, X86_EAX, guest); }
+
+/* mov dword [rbx + 4*guest], imm32 */
+static void emit_store_imm(uint8_t guest, uint32_t imm)
+{
+	emit8(0xC7);
+	emit8(0x43);
+	emit8(guest * 4);
+	emit32(imm);
+}
+
+static void emit_call(void *fn)
+{
+	emit8(0x48); emit8(0xB8); emit64((uint64_t)(uintptr_t)fn);	/* mov rax, fn */
+	emit8(0xFF); emit8(0xD0);									/* call rax */
+}
+
+/* mov eax, value; pop rbx; ret */
+static void emit_exit(uint32_t value)
+{
+	emit8(0xB8); emit32(value);
+	emit8(0x5B);
+	emit8(0xC3);
+}
+
+/* setcc al; movzx eax, al; mov [rd], eax */
+static void emit_setcc_store(uint8_t cc, uint8_t rd)
+{
+	emit8(0x0F); emit8(cc); emit8(0xC0);
+	emit8(0x0F); emit8(0xB6); emit8(0xC0);
+	emit_store_eax(rd);
+}
+
+/* edi = rs1 + imm */
+static void emit_address(threaded_inst_t *t)
+{
+	emit_load_guest(X86_EDI, t->rs1);
+	emit8(0x81); emit8(0xC7); emit32(t->imm);
+}
+
+/* compile one op; returns FALSE for ops the JIT leaves to the interpreter */
+static int jit_op(threaded_inst_t *t, uint32_t pc, uint32_t retired)
+{
+	/* reg-reg ALU opcodes: op eax, [rbx + 4*rs2] */
+	static const uint8_t alu_rr[NUM_OPS] = {
+		[OP_ADD] = 0x03, [OP_SUB] = 0x2B, [OP_XOR] = 0x33, [OP_OR] = 0x0B, [OP_AND] = 0x23
+	};
+	/* reg-imm ALU opcodes: op eax, imm32 */
+	static const uint8_t alu_ri[NUM_OPS] = {
+		[OP_ADDI] = 0x05, [OP_XORI] = 0x35, [OP_ORI] = 0x0D, [OP_ANDI] = 0x25
+	};
+	/* modrm for shl/shr/sar eax */
+	static const uint8_t shift[NUM_OPS] = {
+		[OP_SLL] = 0xE0, [OP_SRL] = 0xE8, [OP_SRA] = 0xF8,
+		[OP_SLLI] = 0xE0, [OP_SRLI] = 0xE8, [OP_SRAI] = 0xF8
+	};
+	/* jcc rel8 taken when the branch is */
+	static const uint8_t jcc[NUM_OPS] = {
+		[OP_BEQ] = 0x74, [OP_BNE] = 0x75, [OP_BLT] = 0x7C,
+		[OP_BGE] = 0x7D, [OP_BLTU] = 0x72, [OP_BGEU] = 0x73
+	};
+
+	/* results written to x0 are discarded; loads have no other effect */
+	if (op_writes_rd(t->op) && t->rd == 0 && t->op != OP_JAL && t->op != OP_JALR && !op_is_atomic(t->op)) {
+		return TRUE;
+	}
+
+	switch (t->op) {
+	case OP_NOP:
+		return TRUE;
+	case OP_ADD: case OP_SUB: case OP_XOR: case OP_OR: case OP_AND:
+		emit_load_guest(X86_EAX, t->rs1);
+		emit_guest_op(alu_rr[t->op], X86_EAX, t->rs2);
+		emit_store_eax(t->rd);
+		return TRUE;
+	case OP_ADDI: case OP_XORI: case OP_ORI: case OP_ANDI:
+		emit_load_guest(X86_EAX, t->rs1);
+		emit8(alu_ri[t->op]); emit32(t->imm);
+		emit_store_eax(t->rd);
+		return TRUE;
+	case OP_SLL: case OP_SRL: case OP_SRA:
+		emit_load_guest(X86_EAX, t->rs1);
+		emit_load_guest(X86_ECX, t->rs2);
+		emit8(0xD3); emit8(shift[t->op]);
+		emit_store_eax(t->rd);
+		return TRUE;
+	case OP_SLLI: case OP_SRLI: case OP_SRAI:
+		emit_load_guest(X86_EAX, t->rs1);
+		emit8(0xC1); emit8(shift[t->op]); emit8(t->imm);
+		emit_store_eax(t->rd);
+		return TRUE;
+	case OP_SLT: case OP_SLTU:
+		emit_load_guest(X86_EAX, t->rs1);
+		emit_guest_op(0x3B, X86_EAX, t->rs2);
+		emit_setcc_store(t->op == OP_SLT ? 0x9C : 0x92, t->rd);
+		return TRUE;
+	case OP_SLTI: case OP_SLTIU:
+		emit_load_guest(X86_EAX, t->rs1);
+		emit8(0x3D); emit32(t->imm);
+		emit_setcc_store(t->op == OP_SLTI ? 0x9C : 0x92, t->rd);
+		return TRUE;
+	case OP_LUI:
+		emit_store_imm(t->rd, t->imm);
+		return TRUE;
+	case OP_AUIPC:
+		emit_store_imm(t->rd, pc + t->imm);
+		return TRUE;
+	case OP_LB: case OP_LH: case OP_LW: case OP_LBU: case OP_LHU:
+		emit_address(t);
+		emit_call(t->op == OP_LW ? (void *)mem_read_32 :
+				t->op == OP_LH || t->op == OP_LHU ? (void *)mem_read_16 : (void *)mem_read_8);
+		/* the sized reads zero-extend */
+		switch (t->op) {
+		case OP_LB:  emit8(0x0F); emit8(0xBE); emit8(0xC0); break;	/* movsx eax, al */
+		case OP_LH:  emit8(0x0F); emit8(0xBF); emit8(0xC0); break;	/* movsx eax, ax */
+		}
+		emit_store_eax(t->rd);
+		return TRUE;
+	case OP_SB: case OP_SH: case OP_SW:
+		emit_address(t);
+		emit_load_guest(X86_ESI, t->rs2);
+		emit_call(t->op == OP_SW ? (void *)mem_write_32 :
+				t->op == OP_SH ? (void *)mem_write_16 : (void *)mem_write_8);
+		/* leave if the store invalidated the translated text */
+		emit8(0x48); emit8(0xB8); emit64((uint64_t)(uintptr_t)&BLOCKS_STALE);	/* mov rax, &BLOCKS_STALE */
+		emit8(0x83); emit8(0x38); emit8(0x00);									/* cmp dword [rax], 0 */
+		emit8(0x74); emit8(7);													/* je past the exit */
+		emit_exit((retired << 2) | JIT_EXIT_STALE);
+		return TRUE;
+	case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU:
+		emit_load_guest(X86_EAX, t->rs1);
+		emit_guest_op(0x3B, X86_EAX, t->rs2);
+		emit8(jcc[t->op]); emit8(7);
+		emit_exit(JIT_EXIT_FALLTHROUGH);
+		emit_exit(JIT_EXIT_TAKEN);
+		return TRUE;
+	case OP_JAL:
+		if (t->rd != 0) {
+			emit_store_imm(t->rd, pc + 4);
+		}
+		emit_exit(JIT_EXIT_TAKEN);
+		return TRUE;
+	case OP_JALR:
+		emit_load_guest(X86_EAX, t->rs1);
+		emit8(0x05); emit32(t->imm);				/* add eax, imm */
+		emit8(0x25); emit32(0xFFFFFFFE);			/* and eax, ~1 */
+		if (t->rd != 0) {
+			emit_store_imm(t->rd, pc + 4);
+		}
+		emit8(0x48); emit8(0xB9); emit64((uint64_t)(uintptr_t)&CURRENT_STATE.PC);	/* mov rcx, &PC */
+		emit8(0x89); emit8(0x01);													/* mov [rcx], eax */
+		emit_exit(JIT_EXIT_INDIRECT);
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static native_block_t jit_compile(block_t *b)
+{
+	uint32_t i;
+	uint8_t *start;
+
+	if (JIT_BUFFER == NULL) {
+		JIT_BUFFER = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (JIT_BUFFER == MAP_FAILED) {
+			printf("Warning: JIT disabled, cannot map executable memory\n");
+			JIT_BUFFER = NULL;
+			ENGINE = ENGINE_BLOCK;
+			return NULL;
+		}
+	}
+	if (JIT_USED + (b->count + 2) * JIT_MAX_OP_BYTES > JIT_BUFFER_SIZE) {
+		return NULL;
+	}
+
+	start = jit_p = JIT_BUFFER + JIT_USED;
+	emit8(0x53);								/* push rbx */
+	emit8(0x48); emit8(0x89); emit8(0xFB);		/* mov rbx, rdi */
+	for (i = 0; i < b->count; i++) {
+		if (!jit_op(&b->ops[i], b->pc + i * 4, i + 1)) {
+			return NULL;
+		}
+	}
+	if (!op_ends_block(b->ops[b->count - 1].op)) {
+		emit_exit(JIT_EXIT_FALLTHROUGH);
+	}
+	JIT_USED = jit_p - JIT_BUFFER;
+	return (native_block_t)start;
+}
+
+/* compiled code belongs to the blocks, so it goes whenever they are flushed */
+static void jit_flush()
+{
+	JIT_USED = 0;
+}
+
+#else
+
+static native_block_t jit_compile(block_t *b)
+{
+	return NULL;
+}
+
+static void jit_flush()
+{
+}
+
+#endif
+
+/************************************************************/
+/* Basic-block engine.                                                                                           */
+/* Straight-line runs ending at a branch or jump are translated once into a block,    */
+/* and blocks are chained to their successors as those are first resolved. Counting, */
+/* budget and SYSCALL checks happen once per block instead of once per instruction.   */
+/************************************************************/
+#define BLOCK_MAX_LENGTH 64
+
+static const void *const *BLOCK_LABELS;	/* indexed by OP_*; NUM_OPS is the fall-through exit */
+
+void flush_blocks()
+{
+	uint32_t i;
+
+	if (BLOCK_MAP != NULL) {
+		for (i = 0; i < DECODE_CACHE_SIZE; i++) {
+			free(BLOCK_MAP[i]);
+		}
+		free(BLOCK_MAP);
+		BLOCK_MAP = NULL;
+	}
+	jit_flush();
+	BLOCKS_STALE = FALSE;
+}
+
+static block_t *translate_block(uint32_t index)
+{
+	uint32_t count = 0, i;
+	decoded_inst_t *d;
+	threaded_inst_t *t;
+	block_t *b;
+
+	/* find the end of the block, re-decoding any entries a store invalidated */
+	for (i = index; i < DECODE_CACHE_SIZE && count < BLOCK_MAX_LENGTH; i++) {
+		d = &DECODE_CACHE[i];
+		if (d->handler == exec_undecoded) {
+			decode_instruction(fetch_32(MEM_TEXT_BEGIN + i * 4), d);
+		}
+		count++;
+		if (op_ends_block(d->op)) {
+			break;
+		}
+	}
+
+	/* one extra op for the fall-through exit */
+	b = malloc(sizeof(block_t) + (count + 1) * sizeof(threaded_inst_t));
+	if (b == NULL) {
+		printf("Error: Out of memory allocating block\n");
+		exit(-1);
+	}
+	b->pc = MEM_TEXT_BEGIN + index * 4;
+	b->count = count;
+	b->heat = 0;
+	b->native = NULL;
+	b->next[0] = NULL;
+	b->next[1] = NULL;
+	for (i = 0; i < count; i++) {
+		d = &DECODE_CACHE[index + i];
+		t = &b->ops[i];
+		t->label = BLOCK_LABELS[d->op];
+		t->op = d->op;
+		t->target = NULL;
+		t->rd = d->rd;
+		t->rs1 = d->rs1;
+		t->rs2 = d->rs2;
+		t->imm = d->imm;
+	}
+	b->ops[count].label = BLOCK_LABELS[NUM_OPS];
+	b->ops[count].op = OP_NOP;
+	return b;
+}
+
+/* block starting at pc, translated on first use; NULL outside the text */
+static block_t *block_lookup(uint32_t pc)
+{
+	uint32_t index = (pc - MEM_TEXT_BEGIN) >> 2;
+
+	if ((pc & 3) != 0 || index >= DECODE_CACHE_SIZE) {
+		return NULL;
+	}
+	if (BLOCKS_STALE) {
+		flush_blocks();
+	}
+	if (BLOCK_MAP == NULL) {
+		BLOCK_MAP = calloc(DECODE_CACHE_SIZE, sizeof(block_t *));
+		if (BLOCK_MAP == NULL) {
+			printf("Error: Out of memory allocating block map\n");
+			exit(-1);
+		}
+	}
+	if (BLOCK_MAP[index] == NULL) {
+		BLOCK_MAP[index] = translate_block(index);
+	}
+	return BLOCK_MAP[index];
+}
+
+/* budget == 0 only publishes the label table */
+static uint32_t block_engine(uint32_t budget)
+{
+	static const void *const labels[NUM_OPS + 1] = {
+		INPLACE_LABELS
+		[NUM_OPS] = &&op_fallthrough,
+	};
+	uint32_t *regs = CURRENT_STATE.REGS;
+	uint32_t left = budget;
+	uint32_t address, retired, exit;
+	threaded_inst_t *t;
+	block_t *b, *next;
+	int taken;
+
+	if (budget == 0) {
+		BLOCK_LABELS = labels;
+		return 0;
+	}
+	b = block_lookup(CURRENT_STATE.PC);
+	if (b == NULL) {
+		return 0;
+	}
+
+#define RS1 regs[t->rs1]
+#define RS2 regs[t->rs2]
+#define IMM t->imm
+#define PC_HERE (b->pc + (uint32_t)(t - b->ops) * 4)
+#define RD_OP(name, expr) op_##name: regs[t->rd] = (expr); regs[0] = 0; t++; goto *t->label;
+/* a store into the text invalidates the blocks, so leave right after it */
+#define STORE_OP(name, stmt) op_##name: stmt; t++; if (BLOCKS_STALE) goto stale; goto *t->label;
+#define BRANCH_OP(name, cond) op_##name: taken = (cond); goto chain;
+#define ATOMIC_OP(name, expr) \
+	op_##name: regs[t->rd] = (expr); regs[0] = 0; t++; if (BLOCKS_STALE) goto stale; goto *t->label;
+
+enter:
+	if (b->count > left) {
+		CURRENT_STATE.PC = b->pc;
+		goto done;
+	}
+	if (b->native != NULL) {
+		exit = b->native(regs);
+		t = &b->ops[b->count - 1];
+		switch (exit & 3) {
+		case JIT_EXIT_FALLTHROUGH:
+			taken = 0;
+			goto chain;
+		case JIT_EXIT_TAKEN:
+			taken = 1;
+			goto chain;
+		case JIT_EXIT_INDIRECT:
+			address = CURRENT_STATE.PC;
+			goto indirect;
+		default:
+			t = &b->ops[exit >> 2];
+			goto stale;
+		}
+	}
+	if (ENGINE == ENGINE_JIT && ++b->heat == JIT_THRESHOLD) {
+		b->native = jit_compile(b);
+		if (b->native != NULL) {
+			goto enter;
+		}
+	}
+	t = b->ops;
+	goto *t->label;
+
+	INPLACE_RD_OPS(RD_OP)
+	INPLACE_STORE_OPS(STORE_OP)
+	INPLACE_BRANCH_OPS(BRANCH_OP)
+	INPLACE_ATOMIC_OPS(ATOMIC_OP)
+
+op_nop:
+	t++;
+	goto *t->label;
+
+op_fallthrough:
+	taken = 0;
+	goto chain;
+
+op_jal:
+	regs[t->rd] = PC_HERE + 4;
+	regs[0] = 0;
+	taken = 1;
+	goto chain;
+
+op_jalr:
+	address = (RS1 + t->imm) & ~1u;
+	regs[t->rd] = PC_HERE + 4;
+	regs[0] = 0;
+indirect:
+	left -= b->count;
+	next = block_lookup(address);
+	if (next == NULL) {
+		CURRENT_STATE.PC = address;
+		goto done;
+	}
+	b = next;
+	goto enter;
+
+op_invalid:
+	printf("Invalid instruction");
+	RUN_FLAG = FALSE;
+	left -= b->count;
+	CURRENT_STATE.PC = PC_HERE + 4;
+	goto done;
+
+/* ends its block; an exit or a read into the text also ends the run */
+op_ecall:
+	SYSCALL(&CURRENT_STATE);
+	if (!RUN_FLAG || BLOCKS_STALE) {
+		t++;
+		goto stale;
+	}
+	taken = 0;
+	goto chain;
+
+/* with a debugger attached the interpreter takes the trap */
+op_ebreak:
+	if (!EBREAK_TRAPS) {
+		t++;
+		goto *t->label;
+	}
+	goto stale;
+
+chain:
+	left -= b->count;
+	next = b->next[taken];
+	if (next == NULL) {
+		address = taken ? PC_HERE + t->imm : b->pc + b->count * 4;
+		next = block_lookup(address);
+		if (next == NULL) {
+			CURRENT_STATE.PC = address;
+			goto done;
+		}
+		/* only this hart's stores set BLOCKS_STALE, and they leave through stale, so this */
+		/* lookup never flushes b                                                          */
+		b->next[taken] = next;
+	}
+	b = next;
+	goto enter;
+
+stale:
+	retired = t - b->ops;
+	left -= retired;
+	CURRENT_STATE.PC = b->pc + retired * 4;
+
+done:
+	INSTRUCTION_COUNT += budget - left;
+	if (CURRENT_STATE.PC > (PROGRAM_SIZE * 4) + MEM_TEXT_BEGIN) RUN_FLAG = FALSE;
+	return budget - left;
+
+#undef RS1
+#undef RS2
+#undef IMM
+#undef PC_HERE
+#undef RD_OP
+#undef STORE_OP
+#undef BRANCH_OP
+#undef ATOMIC_OP
+}
+
+/************************************************************/
+/* Run whole blocks while they fit in budget. Returns the number of instructions       */
+/* retired, 0 when the next block cannot run and the caller must fall back to cycle().  */
+/************************************************************/
+uint32_t run_blocks(uint32_t budget)
+{
+	if (BLOCK_LABELS == NULL) {
+		block_engine(0);
+	}
+	return block_engine(budget);
+}
+
+/************************************************************/
+/* Pipeline timing: each retired instruction is placed in the earliest cycles the        */
+/* latches, its operands and any pending redirect allow.                                  */
+/************************************************************/
+void pipeline_clear()
+{
+	int i;
+	memset(&PIPELINE, 0, sizeof(PIPELINE));
+	for (i = 0; i < NUM_STAGES; i++) {
+		PIPELINE.stage[i] = -1;
+	}
+}
+
+static inline int64_t max64(int64_t a, int64_t b)
+{
+	return a > b ? a : b;
+}
+
+/* which source registers an op reads in EX */
+static inline bool op_reads_rs1(uint8_t op)
+{
+	return op != OP_LUI && op != OP_AUIPC && op != OP_JAL &&
+		op != OP_NOP && op != OP_INVALID && op != OP_ECALL && op != OP_EBREAK && op != OP_MHARTID;
+}
+
+static inline bool op_reads_rs2(uint8_t op)
+{
+	return (op >= OP_ADD && op <= OP_AND) || op == OP_SB || op == OP_SH || op == OP_SW || op_is_branch(op) ||
+		(op_is_atomic(op) && op != OP_LR_W);
+}
+
+static void pipeline_retire(const decoded_inst_t *d, bool mispredict)
+{
+	pipeline_t *p = &PIPELINE;
+	int64_t fetch, decode, exec, mem, ready, earliest;
+	bool load_wait = false, taken, redirect;
+
+	fetch = max64(max64(p->stage[STAGE_IF] + 1, p->stage[STAGE_ID]), p->fetch_ready);
+	decode = max64(fetch + 1, p->stage[STAGE_EX]);
+
+	/* hold in ID until the operands can be bypassed (or read from the register file) */
+	earliest = max64(decode + 1, p->stage[STAGE_MEM]);
+	exec = earliest;
+	if (op_reads_rs1(d->op) && d->rs1 != 0 && p->reg_ready[d->rs1] > exec) {
+		exec = p->reg_ready[d->rs1];
+		load_wait = p->reg_load[d->rs1];
+	}
+	if (op_reads_rs2(d->op) && d->rs2 != 0 && p->reg_ready[d->rs2] > exec) {
+		exec = p->reg_ready[d->rs2];
+		load_wait = p->reg_load[d->rs2];
+	}
+	if (load_wait && PIPE_FORWARDING) {
+		p->load_use_stalls += exec - earliest;
+	} else {
+		p->data_stalls += exec - earliest;
+	}
+	mem = max64(exec + 1, p->stage[STAGE_WB]);
+
+	p->stage[STAGE_IF] = fetch;
+	p->stage[STAGE_ID] = decode;
+	p->stage[STAGE_EX] = exec;
+	p->stage[STAGE_MEM] = mem;
+	p->stage[STAGE_WB] = mem + 1;
+	p->instructions++;
+
+	if (op_writes_rd(d->op) && d->rd != 0) {
+		bool load = (d->op >= OP_LB && d->op <= OP_LHU) || op_is_atomic(d->op);
+		if (!PIPE_FORWARDING) {
+			ready = mem + 2;	/* written in the first half of WB, read in the second half of ID */
+		} else {
+			ready = load ? mem + 1 : exec + 1;
+		}
+		p->reg_ready[d->rd] = ready;
+		p->reg_load[d->rd] = load;
+	}
+
+	/* without a predictor fetch assumes not taken, so anything that leaves the fall-through path */
+	/* flushes what was fetched behind it; with one, only a mispredicted branch does */
+	taken = RETIRE.next_pc != RETIRE.pc + 4;
+	if (op_is_branch(d->op)) {
+		p->branches++;
+		p->taken += taken;
+	}
+	if (op_is_branch(d->op) && PREDICTOR != PRED_OFF) {
+		redirect = mispredict;
+	} else {
+		redirect = taken;
+	}
+	if (redirect) {
+		ready = (d->op == OP_JAL) ? decode + 1 : exec + PIPE_BRANCH_PENALTY - 1;
+		if (d->op == OP_JAL && PIPE_BRANCH_PENALTY == 0) {
+			ready = fetch + 1;
+		}
+		/* lost cycles: how much later the next instruction reaches ID than it would have */
+		earliest = max64(max64(fetch + 1, decode) + 1, exec);
+		if (max64(ready + 1, exec) > earliest) {
+			p->flush_cycles += max64(ready + 1, exec) - earliest;
+		}
+		p->fetch_ready = ready;
+	}
+}
+
+/* total cycles so far: the last instruction's WB plus the one cycle it spends there */
+uint64_t pipeline_cycles()
+{
+	return PIPELINE.instructions ? PIPELINE.stage[STAGE_WB] + 1 : 0;
+}
+
+/************************************************************/
+/* Branch prediction: consulted and trained once per retired B-type instruction          */
+/************************************************************/
+
+static void print_decoded(uint32_t pc, const decoded_inst_t *d);
+
+/* drop what the predictor learned and its counters, sizing the tables to the settings */
+void predictor_clear()
+{
+	uint32_t entries = 1u << PRED_TABLE_BITS;
+
+	free(BIMODAL_TABLE);
+	free(GSHARE_TABLE);
+	free(CHOOSER_TABLE);
+	free(BTB_TAG);
+	free(BTB_TARGET);
+	free(PRED_BRANCHES);
+	free(PRED_MISSES);
+	BIMODAL_TABLE = malloc(entries);
+	GSHARE_TABLE = malloc(entries);
+	CHOOSER_TABLE = malloc(entries);
+	BTB_TAG = calloc(1u << BTB_BITS, sizeof(uint32_t));
+	BTB_TARGET = calloc(1u << BTB_BITS, sizeof(uint32_t));
+	PRED_SIZE = DECODE_CACHE_SIZE;
+	PRED_BRANCHES = calloc(PRED_SIZE, sizeof(uint64_t));
+	PRED_MISSES = calloc(PRED_SIZE, sizeof(uint64_t));
+	if (BIMODAL_TABLE == NULL || GSHARE_TABLE == NULL || CHOOSER_TABLE == NULL || BTB_TAG == NULL ||
+			BTB_TARGET == NULL || PRED_BRANCHES == NULL || PRED_MISSES == NULL) {
+		printf("Error: Out of memory allocating branch predictor\n");
+		exit(-1);
+	}
+	/* weakly not taken, and a chooser weakly preferring bimodal */
+	memset(BIMODAL_TABLE, 1, entries);
+	memset(GSHARE_TABLE, 1, entries);
+	memset(CHOOSER_TABLE, 1, entries);
+	PRED_HISTORY = 0;
+	PRED_TOTAL = PRED_MISPREDICTS = PRED_BTB_MISSES = 0;
+}
+
+/* off, static, bimodal, gshare or tournament, optionally :table_bits[:btb_bits] */
+int predictor_config(const char *arg)
+{
+	static const char *const names[] = { "off", "static", "bimodal", "gshare", "tournament" };
+	uint32_t kind, table_bits = PRED_TABLE_BITS, btb_bits = BTB_BITS;
+	size_t len = strcspn(arg, ":");
+	const char *rest = arg + len;
+	char *end;
+
+	for (kind = 0; kind < sizeof(names) / sizeof(names[0]); kind++) {
+		if (strlen(names[kind]) == len && strncmp(arg, names[kind], len) == 0) {
+			break;
+		}
+	}
+	if (kind == sizeof(names) / sizeof(names[0])) {
+		return FALSE;
+	}
+	if (*rest == ':') {
+		table_bits = strtoul(rest + 1, &end, 0);
+		rest = end;
+		if (*rest == ':') {
+			btb_bits = strtoul(rest + 1, &end, 0);
+			rest = end;
+		}
+	}
+	if (*rest != '\0' || table_bits < 1 || table_bits > 24 || btb_bits < 1 || btb_bits > 24) {
+		return FALSE;
+	}
+	PREDICTOR = kind;
+	PRED_TABLE_BITS = table_bits;
+	BTB_BITS = btb_bits;
+	if (PREDICTOR != PRED_OFF) {
+		predictor_clear();
+	}
+	return TRUE;
+}
+
+static inline void counter_train(uint8_t *counter, bool up)
+{
+	if (up && *counter < 3) {
+		(*counter)++;
+	} else if (!up && *counter > 0) {
+		(*counter)--;
+	}
+}
+
+/* predict the branch RETIRE describes, train on its outcome; TRUE if fetch went the wrong way */
+static bool predict_branch()
+{
+	uint32_t pc = RETIRE.pc, index = (pc - MEM_TEXT_BEGIN) >> 2;
+	uint32_t mask = (1u << PRED_TABLE_BITS) - 1;
+	uint32_t local = (pc >> 2) & mask, global = ((pc >> 2) ^ PRED_HISTORY) & mask;
+	uint32_t slot = (pc >> 2) & ((1u << BTB_BITS) - 1);
+	bool taken = RETIRE.next_pc != pc + 4;
+	bool bimodal = BIMODAL_TABLE[local] >= 2, gshare = GSHARE_TABLE[global] >= 2;
+	bool predicted, miss;
+
+	switch (PREDICTOR) {
+		case PRED_BIMODAL:
+			predicted = bimodal;
+			break;
+		case PRED_GSHARE:
+			predicted = gshare;
+			break;
+		case PRED_TOURNAMENT:
+			predicted = CHOOSER_TABLE[local] >= 2 ? gshare : bimodal;
+			break;
+		default:
+			predicted = false;
+			break;
+	}
+
+	PRED_TOTAL++;
+	miss = predicted != taken;
+	if (miss) {
+		PRED_MISPREDICTS++;
+	} else if (taken && (BTB_TAG[slot] != pc || BTB_TARGET[slot] != RETIRE.next_pc)) {
+		/* right direction, but fetch had no target to go to */
+		PRED_BTB_MISSES++;
+		miss = true;
+	}
+	if (index < PRED_SIZE) {
+		PRED_BRANCHES[index]++;
+		PRED_MISSES[index] += miss;
+	}
+
+	if (bimodal != gshare) {
+		counter_train(&CHOOSER_TABLE[local], gshare == taken);
+	}
+	counter_train(&BIMODAL_TABLE[local], taken);
+	counter_train(&GSHARE_TABLE[global], taken);
+	PRED_HISTORY = (PRED_HISTORY << 1) | taken;
+	if (taken) {
+		BTB_TAG[slot] = pc;
+		BTB_TARGET[slot] = RETIRE.next_pc;
+	}
+	return miss;
+}
+
+static int predictor_worse(const void *a, const void *b)
+{
+	uint64_t x = PRED_MISSES[*(const uint32_t *)a], y = PRED_MISSES[*(const uint32_t *)b];
+	return (x < y) - (x > y);
+}
+
+/* aggregate accuracy, then the top branches by mispredictions */
+void predictor_report(uint32_t top)
+{
+	static const char *const names[] = { "off", "static not-taken", "bimodal", "gshare", "tournament" };
+	uint32_t *order, i, n = 0;
+	uint64_t misses = PRED_MISPREDICTS + PRED_BTB_MISSES;
+	decoded_inst_t d;
+
+	if (PREDICTOR == PRED_OFF || PRED_BRANCHES == NULL) {
+		printf("No branch predictor selected; use predictor %s.\n", PRED_NAMES);
+		return;
+	}
+	printf("-------------------------------------------------------------\n");
+	printf("Branch predictor: %s, %u-entry tables, %u-entry BTB\n", names[PREDICTOR],
+		1u << PRED_TABLE_BITS, 1u << BTB_BITS);
+	printf("-------------------------------------------------------------\n");
+	printf("Branches\t\t: %llu\n", (unsigned long long)PRED_TOTAL);
+	printf("Direction mispredicts\t: %llu\n", (unsigned long long)PRED_MISPREDICTS);
+	printf("BTB misses\t\t: %llu\n", (unsigned long long)PRED_BTB_MISSES);
+	printf("Accuracy\t\t: %.2f%%\n", PRED_TOTAL ? 100.0 * (PRED_TOTAL - misses) / PRED_TOTAL : 0.0);
+	printf("Penalty cycles\t\t: %llu\n", (unsigned long long)(misses * PIPE_BRANCH_PENALTY));
+
+	order = malloc((PRED_SIZE + 1) * sizeof(uint32_t));
+	if (order == NULL) {
+		printf("Error: Out of memory sorting branches\n");
+		exit(-1);
+	}
+	for (i = 0; i < PRED_SIZE; i++) {
+		if (PRED_BRANCHES[i] != 0) {
+			order[n++] = i;
+		}
+	}
+	qsort(order, n, sizeof(uint32_t), predictor_worse);
+	printf("-------------------------------------------------------------\n");
+	printf("[Address]\t[Count]\t\t[Misses]\t[Accuracy]\t[Penalty]\t[Instruction]\n");
+	for (i = 0; i < n && i < top; i++) {
+		uint32_t pc = MEM_TEXT_BEGIN + order[i] * 4;
+		uint64_t count = PRED_BRANCHES[order[i]], miss = PRED_MISSES[order[i]];
+		decode_instruction(mem_read_32(pc), &d);
+		printf("0x%08x\t%-10llu\t%-10llu\t%6.2f%%\t\t%-10llu\t", pc, (unsigned long long)count,
+			(unsigned long long)miss, 100.0 * (count - miss) / count, (unsigned long long)(miss * PIPE_BRANCH_PENALTY));
+		print_decoded(pc, &d);
+	}
+	free(order);
+	printf("-------------------------------------------------------------\n\n");
+}
+
+/************************************************************/
+/* Cache hierarchy: split L1 I/D over a unified L2, fed from handle_instruction()         */
+/************************************************************/
+static inline bool is_pow2(uint32_t x)
+{
+	return x != 0 && (x & (x - 1)) == 0;
+}
+
+/* (re)shape a cache, dropping its contents and counters; FALSE if the geometry is impossible */
+static int cache_setup(cache_t *c, uint32_t size, uint32_t assoc, uint32_t line, int replace, int write_back)
+{
+	uint32_t sets, ways;
+
+	if (assoc == 0 || line < 4 || !is_pow2(line) || size % (assoc * line) != 0) {
+		return FALSE;
+	}
+	sets = size / (assoc * line);
+	if (!is_pow2(sets)) {
+		return FALSE;
+	}
+	ways = sets * assoc;
+	free(c->tags);
+	free(c->valid);
+	free(c->dirty);
+	free(c->used);
+	c->tags = calloc(ways, sizeof(uint32_t));
+	c->valid = calloc(ways, 1);
+	c->dirty = calloc(ways, 1);
+	c->used = calloc(ways, sizeof(uint64_t));
+	if (c->tags == NULL || c->valid == NULL || c->dirty == NULL || c->used == NULL) {
+		printf("Error: Out of memory allocating %s\n", c->name);
+		exit(-1);
+	}
+	c->size = size;
+	c->assoc = assoc;
+	c->line = line;
+	c->line_shift = __builtin_ctz(line);
+	c->set_mask = sets - 1;
+	c->replace = replace;
+	c->write_back = write_back;
+	c->clock = 0;
+	c->last_way = 0;
+	c->reads = c->writes = c->read_misses = c->write_misses = c->evictions = c->writebacks = 0;
+	return TRUE;
+}
+
+/* invalidate every level and zero the counters */
+void cache_clear()
+{
+	cache_t *levels[] = { &L1I, &L1D, &L2 };
+	uint32_t i;
+
+	for (i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+		cache_setup(levels[i], levels[i]->size, levels[i]->assoc, levels[i]->line,
+			levels[i]->replace, levels[i]->write_back);
+	}
+}
+
+static void cache_access(cache_t *c, uint32_t address, bool write)
+{
+	uint32_t line = address >> c->line_shift;
+	uint32_t base = (line & c->set_mask) * c->assoc;
+	uint32_t way, victim;
+
+	c->clock++;
+	write ? c->writes++ : c->reads++;
+	/* most accesses land on the line used last, so try that way before the set */
+	way = c->last_way;
+	if (c->tags[way] != line || !c->valid[way]) {
+		for (way = base; way < base + c->assoc; way++) {
+			if (c->tags[way] == line && c->valid[way]) {
+				break;
+			}
+		}
+	}
+	if (way >= base && way < base + c->assoc) {
+		c->last_way = way;
+		c->used[way] = c->clock;
+		if (write) {
+			if (c->write_back) {
+				c->dirty[way] = TRUE;
+			} else if (c->next != NULL) {
+				cache_access(c->next, address, true);
+			}
+		}
+		return;
+	}
+
+	write ? c->write_misses++ : c->read_misses++;
+	if (write && !c->write_back) {
+		/* no write-allocate: straight through to the next level */
+		if (c->next != NULL) {
+			cache_access(c->next, address, true);
+		}
+		return;
+	}
+
+	/* an empty way, else the least recently used or a random one */
+	victim = base;
+	for (way = base; way < base + c->assoc; way++) {
+		if (!c->valid[way]) {
+			victim = way;
+			break;
+		}
+		if (c->used[way] < c->used[victim]) {
+			victim = way;
+		}
+	}
+	if (c->valid[victim]) {
+		if (c->replace == CACHE_RANDOM) {
+			CACHE_RANDOM_STATE ^= CACHE_RANDOM_STATE << 13;
+			CACHE_RANDOM_STATE ^= CACHE_RANDOM_STATE >> 17;
+			CACHE_RANDOM_STATE ^= CACHE_RANDOM_STATE << 5;
+			victim = base + CACHE_RANDOM_STATE % c->assoc;
+		}
+		c->evictions++;
+		if (c->dirty[victim]) {
+			c->writebacks++;
+			if (c->next != NULL) {
+				cache_access(c->next, c->tags[victim] << c->line_shift, true);
+			}
+		}
+	}
+	if (c->next != NULL) {
+		cache_access(c->next, address, false);
+	}
+	c->tags[victim] = line;
+	c->valid[victim] = TRUE;
+	c->dirty[victim] = write;
+	c->used[victim] = c->clock;
+	c->last_way = victim;
+}
+
+/* on, off, clear, or level=size:assoc:line[:lru|random][:wb|wt] with k/m size suffixes */
+int cache_config(const char *arg)
+{
+	char name[8], *end;
+	const char *spec;
+	cache_t *c;
+	uint32_t size, assoc, line;
+	int replace, write_back;
+
+	if (strcmp(arg, "on") == 0) {
+		CACHE_SIM = TRUE;
+		return TRUE;
+	} else if (strcmp(arg, "off") == 0) {
+		CACHE_SIM = FALSE;
+		return TRUE;
+	} else if (strcmp(arg, "clear") == 0) {
+		cache_clear();
+		return TRUE;
+	}
+
+	spec = strchr(arg, '=');
+	if (spec == NULL || spec - arg >= (int)sizeof(name)) {
+		return FALSE;
+	}
+	memcpy(name, arg, spec - arg);
+	name[spec - arg] = '\0';
+	if (strcasecmp(name, "l1i") == 0) {
+		c = &L1I;
+	} else if (strcasecmp(name, "l1d") == 0) {
+		c = &L1D;
+	} else if (strcasecmp(name, "l2") == 0) {
+		c = &L2;
+	} else {
+		return FALSE;
+	}
+
+	size = strtoul(spec + 1, &end, 0);
+	if (*end == 'k' || *end == 'K') {
+		size <<= 10;
+		end++;
+	} else if (*end == 'm' || *end == 'M') {
+		size <<= 20;
+		end++;
+	}
+	if (*end != ':') {
+		return FALSE;
+	}
+	assoc = strtoul(end + 1, &end, 0);
+	if (*end != ':') {
+		return FALSE;
+	}
+	line = strtoul(end + 1, &end, 0);
+	replace = c->replace;
+	write_back = c->write_back;
+	while (*end == ':') {
+		spec = end + 1;
+		end = strchr(spec, ':');
+		if (end == NULL) {
+			end = (char *)spec + strlen(spec);
+		}
+		if (strncmp(spec, "lru", end - spec) == 0) {
+			replace = CACHE_LRU;
+		} else if (strncmp(spec, "random", end - spec) == 0) {
+			replace = CACHE_RANDOM;
+		} else if (strncmp(spec, "wb", end - spec) == 0) {
+			write_back = TRUE;
+		} else if (strncmp(spec, "wt", end - spec) == 0) {
+			write_back = FALSE;
+		} else {
+			return FALSE;
+		}
+	}
+	if (*end != '\0') {
+		return FALSE;
+	}
+	return cache_setup(c, size, assoc, line, replace, write_back);
+}
+
+/* the shapes used until cache_config() says otherwise */
+static void cache_init()
+{
+	CACHE_RANDOM_STATE = 0x2545F491;
+	L1I.name = "L1I";
+	L1D.name = "L1D";
+	L2.name = "L2";
+	L1I.next = L1D.next = &L2;
+	L2.next = NULL;
+	cache_setup(&L1I, 16 << 10, 4, 64, CACHE_LRU, TRUE);
+	cache_setup(&L1D, 16 << 10, 4, 64, CACHE_LRU, TRUE);
+	cache_setup(&L2, 256 << 10, 8, 64, CACHE_LRU, TRUE);
+}
+
+void cache_stats()
+{
+	cache_t *levels[] = { &L1I, &L1D, &L2 };
+	uint32_t i;
+	uint64_t accesses, misses;
+
+	printf("-------------------------------------------------------------\n");
+	printf("Cache statistics (simulation %s)\n", CACHE_SIM ? "on" : "off");
+	printf("-------------------------------------------------------------\n");
+	for (i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+		cache_t *c = levels[i];
+		accesses = c->reads + c->writes;
+		misses = c->read_misses + c->write_misses;
+		printf("%s\t: %u bytes, %u-way, %u-byte lines, %s, %s\n", c->name, c->size, c->assoc, c->line,
+			c->replace == CACHE_LRU ? "LRU" : "random", c->write_back ? "write-back" : "write-through");
+		printf("\treads %llu (%llu misses), writes %llu (%llu misses)\n",
+			(unsigned long long)c->reads, (unsigned long long)c->read_misses,
+			(unsigned long long)c->writes, (unsigned long long)c->write_misses);
+		printf("\thits %llu, misses %llu, miss rate %.2f%%\n", (unsigned long long)(accesses - misses),
+			(unsigned long long)misses, accesses ? 100.0 * misses / accesses : 0.0);
+		printf("\tevictions %llu, writebacks %llu\n", (unsigned long long)c->evictions, (unsigned long long)c->writebacks);
+	}
+	printf("TLB\t: %u entries, direct-mapped\n", TLB_ENTRIES);
+	printf("\thits %llu, misses %llu, hit rate %.2f%%\n", (unsigned long long)TLB_HITS, (unsigned long long)TLB_MISSES,
+		TLB_HITS + TLB_MISSES ? 100.0 * TLB_HITS / (TLB_HITS + TLB_MISSES) : 0.0);
+	printf("-------------------------------------------------------------\n\n");
+}
+
+/************************************************************/
+/* Profiler: counted in handle_instruction() while PROFILING is set                       */
+/************************************************************/
+
+/* zero every counter, sizing the per-PC arrays to the current text */
+void profile_clear()
+{
+	free(PROFILE_HITS);
+	free(PROFILE_TAKEN);
+	PROFILE_SIZE = DECODE_CACHE_SIZE;
+	PROFILE_HITS = calloc(PROFILE_SIZE, sizeof(uint64_t));
+	PROFILE_TAKEN = calloc(PROFILE_SIZE, sizeof(uint64_t));
+	if (PROFILE_HITS == NULL || PROFILE_TAKEN == NULL) {
+		printf("Error: Out of memory allocating profile counters\n");
+		exit(-1);
+	}
+	memset(OP_HITS, 0, sizeof(OP_HITS));
+	memset(OP_TAKEN, 0, sizeof(OP_TAKEN));
+}
+
+/* count the instruction RETIRE describes; the mix for the text is summed up by the report */
+static inline void profile_count(uint8_t op)
+{
+	uint32_t index = (RETIRE.pc - MEM_TEXT_BEGIN) >> 2;
+	uint32_t taken = RETIRE.next_pc != RETIRE.pc + 4;
+
+	if (index < PROFILE_SIZE) {
+		PROFILE_HITS[index]++;
+		PROFILE_TAKEN[index] += taken;
+	} else {
+		OP_HITS[op]++;
+		OP_TAKEN[op] += taken;
+	}
+}
+
+/* one-line disassembly of a decoded instruction */
+static void print_decoded(uint32_t pc, const decoded_inst_t *d)
+{
+	char line[DISASM_LINE_MAX];
+
+	disasm_decoded(line, pc, d);
+	fputs(line, stdout);
+}
+
+static int profile_hotter(const void *a, const void *b)
+{
+	uint64_t x = PROFILE_HITS[*(const uint32_t *)a], y = PROFILE_HITS[*(const uint32_t *)b];
+	return (x < y) - (x > y);
+}
+
+/* print the top hot PCs and the instruction mix */
+void profile_report(uint32_t top)
+{
+	uint32_t *order, i, n = 0;
+	uint64_t total = 0, mix[NUM_OPS], taken[NUM_OPS];
+	decoded_inst_t d;
+
+	if (PROFILE_HITS == NULL) {
+		printf("No profile collected; use profile on.\n");
+		return;
+	}
+	memcpy(mix, OP_HITS, sizeof(mix));
+	memcpy(taken, OP_TAKEN, sizeof(taken));
+	for (i = 0; i < PROFILE_SIZE; i++) {
+		if (PROFILE_HITS[i] != 0) {
+			decode_instruction(mem_read_32(MEM_TEXT_BEGIN + i * 4), &d);
+			mix[d.op] += PROFILE_HITS[i];
+			taken[d.op] += PROFILE_TAKEN[i];
+		}
+	}
+	for (i = 0; i < NUM_OPS; i++) {
+		total += mix[i];
+	}
+	order = malloc(PROFILE_SIZE * sizeof(uint32_t));
+	if (order == NULL) {
+		printf("Error: Out of memory sorting profile\n");
+		exit(-1);
+	}
+	for (i = 0; i < PROFILE_SIZE; i++) {
+		if (PROFILE_HITS[i] != 0) {
+			order[n++] = i;
+		}
+	}
+	qsort(order, n, sizeof(uint32_t), profile_hotter);
+
+	printf("-------------------------------------------------------------\n");
+	printf("Hot instructions (%llu retired)\n", (unsigned long long)total);
+	printf("-------------------------------------------------------------\n");
+	printf("[Address]\t[Count]\t\t[%%]\t[Taken]\t\t[Instruction]\n");
+	for (i = 0; i < n && i < top; i++) {
+		uint32_t pc = MEM_TEXT_BEGIN + order[i] * 4;
+		decode_instruction(mem_read_32(pc), &d);
+		printf("0x%08x\t%-10llu\t%5.2f\t", pc, (unsigned long long)PROFILE_HITS[order[i]],
+			100.0 * PROFILE_HITS[order[i]] / total);
+		if (op_is_branch(d.op)) {
+			printf("%-10llu\t", (unsigned long long)PROFILE_TAKEN[order[i]]);
+		} else {
+			printf("\t\t");
+		}
+		print_decoded(pc, &d);
+	}
+	free(order);
+
+	printf("-------------------------------------------------------------\n");
+	printf("Instruction mix\n");
+	printf("-------------------------------------------------------------\n");
+	printf("[Mnemonic]\t[Count]\t\t[%%]\t[Taken]\t\t[Not taken]\n");
+	for (i = 0; i < NUM_OPS; i++) {
+		if (mix[i] == 0) {
+			continue;
+		}
+		printf("%s\t\t%-10llu\t%5.2f", OP_NAMES[i], (unsigned long long)mix[i], 100.0 * mix[i] / total);
+		if (op_is_branch(i)) {
+			printf("\t%-10llu\t%llu", (unsigned long long)taken[i], (unsigned long long)(mix[i] - taken[i]));
+		}
+		printf("\n");
+	}
+	printf("-------------------------------------------------------------\n\n");
+}
+
+/************************************************************/
+/* Binary trace. The simulation thread appends fixed-size records to a lock-free ring  */
+/* that a writer thread drains to the file, packing them if asked, so the simulation     */
+/* only waits on the disk when the writer falls a whole ring behind.                    */
+/************************************************************/
+#define TRACE_CHUNK 4096		/* records the writer takes at a time */
+#define TRACE_PACKED_MAX 21		/* bytes in the longest packed record */
+
+/* packed record: a tag byte, then only the fields the tag does not imply */
+#define TAG_KIND 0x03
+#define TAG_NEXT_PC 0x04		/* retire: PC is the last one + 4; load/store: PC is the last one */
+#define TAG_SAME_HART 0x08
+#define TAG_CACHED 0x10			/* retire: the word seen at this PC last time */
+#define TAG_RD 0x20				/* retire: rd and its value follow */
+#define TAG_SIZE_SHIFT 4		/* load/store: log2 of the access size, in the bits of the two above */
+
+struct trace {
+	trace_rec_t *ring;		/* TRACE_RING_SIZE records */
+	uint64_t head;			/* records appended; written only by the simulation thread */
+	uint64_t tail;			/* records written out; written only by the writer thread */
+	int stop;
+	int packed;
+	FILE *file;
+	pthread_t writer;
+	trace_state_t state;	/* the packer's */
+};
+
+static inline void trace_put(uint8_t kind, uint8_t reg, uint32_t pc, uint32_t word, uint32_t value)
+{
+	trace_t *t = TRACE;
+	uint64_t head = t->head;
+	trace_rec_t *rec;
+
+	while (head - __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE) {
+		sched_yield();
+	}
+	rec = &t->ring[head & (TRACE_RING_SIZE - 1)];
+	rec->pc = pc;
+	rec->word = word;
+	rec->value = value;
+	rec->kind = kind;
+	rec->reg = reg;
+	rec->hart = HART_ID;
+	__atomic_store_n(&t->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static uint8_t *put_varint(uint8_t *out, uint32_t value)
+{
+	while (value >= 0x80) {
+		*out++ = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	*out++ = value;
+	return out;
+}
+
+static int get_varint(FILE *in, uint32_t *value)
+{
+	int c, shift;
+
+	*value = 0;
+	for (shift = 0; shift < 35; shift += 7) {
+		if ((c = getc(in)) == EOF) {
+			return FALSE;
+		}
+		*value |= (uint32_t)(c & 0x7F) << shift;
+		if (!(c & 0x80)) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* signed deltas as small unsigned numbers: 0, -1, 1, -2, ... */
+static inline uint32_t zigzag(uint32_t delta)
+{
+	return (delta << 1) ^ (uint32_t)((int32_t)delta >> 31);
+}
+
+static inline uint32_t unzigzag(uint32_t value)
+{
+	return (value >> 1) ^ -(value & 1);
+}
+
+static uint8_t *trace_pack(trace_state_t *s, const trace_rec_t *rec, uint8_t *out)
+{
+	uint8_t *tag = out++;
+	uint32_t *cached;
+
+	*tag = rec->kind;
+	if (rec->hart == s->hart) {
+		*tag |= TAG_SAME_HART;
+	} else {
+		out = put_varint(out, rec->hart);
+		s->hart = rec->hart;
+	}
+	if (rec->pc == (rec->kind == TRACE_RETIRE ? s->pc + 4 : s->pc)) {
+		*tag |= TAG_NEXT_PC;
+	} else {
+		out = put_varint(out, zigzag(rec->pc - s->pc));
+	}
+	s->pc = rec->pc;
+	if (rec->kind == TRACE_RETIRE) {
+		cached = &s->words[(rec->pc >> 2) & (TRACE_WORD_CACHE - 1)];
+		if (*cached == rec->word) {
+			*tag |= TAG_CACHED;
+		} else {
+			memcpy(out, &rec->word, 4);
+			out += 4;
+			*cached = rec->word;
+		}
+		if (rec->reg != 0) {
+			*tag |= TAG_RD;
+			*out++ = rec->reg;
+			out = put_varint(out, rec->value);
+		}
+	} else {
+		*tag |= (rec->reg == 4 ? 2 : rec->reg == 2) << TAG_SIZE_SHIFT;
+		out = put_varint(out, zigzag(rec->word - s->address));
+		s->address = rec->word;
+		out = put_varint(out, rec->value);
+	}
+	return out;
+}
+
+static int trace_unpack(trace_reader_t *r, trace_rec_t *rec)
+{
+	trace_state_t *s = &r->state;
+	uint32_t value;
+	int tag = getc(r->file), c;
+
+	if (tag == EOF) {
+		return FALSE;
+	}
+	rec->kind = tag & TAG_KIND;
+	if (!(tag & TAG_SAME_HART)) {
+		if (!get_varint(r->file, &value)) {
+			return FALSE;
+		}
+		s->hart = value;
+	}
+	rec->hart = s->hart;
+	if (tag & TAG_NEXT_PC) {
+		rec->pc = rec->kind == TRACE_RETIRE ? s->pc + 4 : s->pc;
+	} else {
+		if (!get_varint(r->file, &value)) {
+			return FALSE;
+		}
+		rec->pc = s->pc + unzigzag(value);
+	}
+	s->pc = rec->pc;
+	if (rec->kind == TRACE_RETIRE) {
+		if (!(tag & TAG_CACHED) && fread(&s->words[(rec->pc >> 2) & (TRACE_WORD_CACHE - 1)], 4, 1, r->file) != 1) {
+			return FALSE;
+		}
+		rec->word = s->words[(rec->pc >> 2) & (TRACE_WORD_CACHE - 1)];
+		rec->reg = 0;
+		rec->value = 0;
+		if (tag & TAG_RD) {
+			if ((c = getc(r->file)) == EOF || !get_varint(r->file, &rec->value)) {
+				return FALSE;
+			}
+			rec->reg = c;
+		}
+		return TRUE;
+	}
+	rec->reg = 1 << ((tag >> TAG_SIZE_SHIFT) & 3);
+	if (!get_varint(r->file, &value) || !get_varint(r->file, &rec->value)) {
+		return FALSE;
+	}
+	rec->word = s->address = s->address + unzigzag(value);
+	return TRUE;
+}
+
+static void *trace_writer(void *arg)
+{
+	trace_t *t = arg;
+	uint8_t *buf = malloc(TRACE_CHUNK * TRACE_PACKED_MAX), *out;
+	uint64_t head, tail = t->tail, n;
+	struct timespec idle = { 0, 1000000 };
+	int stop;
+
+	if (buf == NULL) {
+		printf("Error: Out of memory allocating trace buffer\n");
+		exit(-1);
+	}
+	for (;;) {
+		/* stop is read first so the records appended before it are all seen */
+		stop = __atomic_load_n(&t->stop, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			if (stop) {
+				break;
+			}
+			nanosleep(&idle, NULL);
+			continue;
+		}
+		if (head - tail > TRACE_CHUNK) {
+			head = tail + TRACE_CHUNK;
+		}
+		if (t->packed) {
+			for (out = buf; tail < head; tail++) {
+				out = trace_pack(&t->state, &t->ring[tail & (TRACE_RING_SIZE - 1)], out);
+			}
+			fwrite(buf, 1, out - buf, t->file);
+		} else {
+			while (tail < head) {
+				n = TRACE_RING_SIZE - (tail & (TRACE_RING_SIZE - 1));
+				n = n < head - tail ? n : head - tail;
+				fwrite(&t->ring[tail & (TRACE_RING_SIZE - 1)], sizeof(trace_rec_t), n, t->file);
+				tail += n;
+			}
+		}
+		__atomic_store_n(&t->tail, tail, __ATOMIC_RELEASE);
+	}
+	free(buf);
+	return NULL;
+}
+
+/* point every hart at t (or at nothing) */
+static void trace_attach(trace_t *t)
+{
+	riscv_sim_t *self = SIM;
+	uint32_t i;
+
+	for (i = 0; i < NUM_HARTS; i++) {
+		SIM = HARTS[i];
+		TRACE = t;
+	}
+	SIM = self;
+}
+
+/* start recording into path, replacing any trace already running; FALSE if it can't be created */
+int trace_start(const char *path, int packed)
+{
+	trace_t *t;
+	uint32_t flags = packed ? TRACE_PACKED : 0;
+
+	trace_stop();
+	t = calloc(1, sizeof(trace_t));
+	if (t == NULL || (t->ring = malloc(TRACE_RING_SIZE * sizeof(trace_rec_t))) == NULL) {
+		printf("Error: Out of memory allocating trace buffer\n");
+		exit(-1);
+	}
+	if ((t->file = fopen(path, "wb")) == NULL) {
+		printf("Error: Can't open trace file %s\n", path);
+		free(t->ring);
+		free(t);
+		return FALSE;
+	}
+	fwrite(TRACE_MAGIC, 1, 8, t->file);
+	fwrite(&flags, 4, 1, t->file);
+	t->packed = packed;
+	if (pthread_create(&t->writer, NULL, trace_writer, t) != 0) {
+		printf("Error: Can't start the trace writer\n");
+		exit(-1);
+	}
+	trace_attach(t);
+	return TRUE;
+}
+
+/* write out what is left and close the file */
+void trace_stop()
+{
+	trace_t *t = TRACE;
+
+	if (t == NULL) {
+		return;
+	}
+	__atomic_store_n(&t->stop, TRUE, __ATOMIC_RELEASE);
+	pthread_join(t->writer, NULL);
+	fclose(t->file);
+	free(t->ring);
+	free(t);
+	trace_attach(NULL);
+}
+
+int trace_open(trace_reader_t *reader, const char *path)
+{
+	char magic[8];
+	uint32_t flags;
+
+	memset(reader, 0, sizeof(*reader));
+	if ((reader->file = fopen(path, "rb")) == NULL) {
+		printf("Error: Can't open trace file %s\n", path);
+		return FALSE;
+	}
+	if (fread(magic, 1, 8, reader->file) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0 ||
+			fread(&flags, 4, 1, reader->file) != 1) {
+		printf("Error: %s is not a trace file\n", path);
+		fclose(reader->file);
+		return FALSE;
+	}
+	reader->packed = flags & TRACE_PACKED;
+	return TRUE;
+}
+
+/* the next record; FALSE at the end of the trace */
+int trace_next(trace_reader_t *reader, trace_rec_t *rec)
+{
+	if (reader->packed) {
+		return trace_unpack(reader, rec);
+	}
+	return fread(rec, sizeof(*rec), 1, reader->file) == 1;
+}
+
+/* cycle(), recording the instruction and the loads and stores it made */
+void trace_cycle()
+{
+	decoded_inst_t scratch;
+	uint32_t pc = CURRENT_STATE.PC, instruction = fetch_32(pc);
+	decoded_inst_t *d = decode_lookup(pc, &scratch);
+	uint8_t rd;
+
+	/* taken before the instruction can overwrite itself */
+	if (d->handler == exec_undecoded) {
+		decode_instruction(instruction, d);
+	}
+	rd = op_writes_rd(d->op) ? d->rd : 0;
+	cycle();
+	if (RETIRE.trapped) {
+		return;
+	}
+
+	trace_put(TRACE_RETIRE, rd, pc, instruction, CURRENT_STATE.REGS[rd]);
+	if (RETIRE.access & RETIRE_LOAD) {
+		trace_put(TRACE_LOAD, RETIRE.size, pc, RETIRE.address, RETIRE.loaded);
+	}
+	if (RETIRE.access & RETIRE_STORE) {
+		trace_put(TRACE_STORE, RETIRE.size, pc, RETIRE.address, RETIRE.stored);
+	}
+}
+
+/************************************************************/
+/* decode and execute instruction                                                                     */ 
+/************************************************************/
+void handle_instruction()
+{
+	/* execute one instruction at a time, updating CURRENT_STATE in place */
+	decoded_inst_t scratch;
+	decoded_inst_t *d = decode_lookup(CURRENT_STATE.PC, &scratch);
+	bool mispredict = false;
+
+	if (d->handler == exec_undecoded) {
+		/* the observers below look at d->op before the handler would re-decode it */
+		decode_instruction(fetch_32(CURRENT_STATE.PC), d);
+	}
+	RETIRE.pc = CURRENT_STATE.PC;
+	RETIRE.next_pc = CURRENT_STATE.PC + 4;
+	if (CACHE_SIM) {
+		cache_access(&L1I, RETIRE.pc, false);
+		if ((d->op >= OP_LB && d->op <= OP_SW) || op_is_atomic(d->op)) {
+			cache_access(&L1D, CURRENT_STATE.REGS[d->rs1] + d->imm, d->op >= OP_SB && d->op != OP_LR_W);
+		}
+	}
+	if (RETIRE_HOOK != NULL) {
+		RETIRE.instruction = fetch_32(RETIRE.pc);
+		RETIRE.rd = op_writes_rd(d->op) ? d->rd : 0;
+		RETIRE.before = CURRENT_STATE.REGS[RETIRE.rd];
+	}
+	RETIRE.access = 0;
+	RETIRE.trapped = FALSE;
+	d->handler(d);
+	if (RETIRE.trapped) {
+		/* nothing retired, so nothing below gets to see it */
+		return;
+	}
+	CURRENT_STATE.REGS[0] = 0;
+	CURRENT_STATE.PC = RETIRE.next_pc;
+	if (PROFILING) {
+		profile_count(d->op);
+	}
+	if (PREDICTOR != PRED_OFF && op_is_branch(d->op)) {
+		mispredict = predict_branch();
+	}
+	if (TIMING) {
+		pipeline_retire(d, mispredict);
+	}
+	if (RETIRE_HOOK != NULL) {
+		RETIRE.after = CURRENT_STATE.REGS[RETIRE.rd];
+	}
+}
+
+
+/************************************************************/
+/* Initialize Memory                                                                                                    */ 
+/************************************************************/
+/* everything but memory, for the first hart and the ones harts_config() adds */
+static void init_hart() {
+	tlb_clear(PAGE_EPOCH);
+	BREAK_SKIP_PC = BREAK_NONE;
+	CURRENT_STATE.PC = MEM_TEXT_BEGIN;
+	CURRENT_STATE.REGS[2] = MEM_STACK_BEGIN;
+	PIPE_FORWARDING = TRUE;
+	PIPE_BRANCH_PENALTY = 2;
+	pipeline_clear();
+	cache_init();
+	PRED_TABLE_BITS = 12;
+	BTB_BITS = 9;
+	ENGINE = JIT_AVAILABLE ? ENGINE_JIT : ENGINE_BLOCK;
+	CONSOLE_OUT = stdout;
+	CONSOLE_IN = stdin;
+	QUIET = TRUE;
+	RUN_FLAG = TRUE;
+}
+
+void initialize() { 
+	init_memory();
+	HEAP_BREAK = MEM_HEAP_BEGIN;
+	HARTS[0] = SIM;
+	NUM_HARTS = 1;
+	HART_QUANTUM = HART_QUANTUM_LOCKSTEP;
+	init_hart();
+}
+
+/************************************************************/
+/* Print the program loaded into memory (in RISCV assembly format)    */ 
+/************************************************************/
+void print_program(){
+	if (PROGRAM_SIZE > 0) {
+		disasm(MEM_TEXT_BEGIN, MEM_TEXT_BEGIN + PROGRAM_SIZE * 4 - 4, stdout);
+	}
+}
+
+/************************************************************/
+/* Print the instruction at given memory address (in RISCV assembly format)    */
+/************************************************************/
+void print_instruction(uint32_t addr){
+	print_word(addr, mem_read_32(addr));
+}
+
+/************************************************************/
+/* Disassemble the words in [start..stop] to out, a line each with the address and the */
+/* word. Pages are read directly, a page at a time, and the text is written out in     */
+/* large chunks; untouched memory and addresses outside every region read as zero.     */
+/************************************************************/
+#define DISASM_CHUNK (1u << 16)
+
+void disasm(uint32_t start, uint32_t stop, FILE *out)
+{
+	char *buf, *p;
+	uint64_t address = start & ~3u, end = (uint64_t)stop + 1, page_end;
+	uint8_t *page;
+	uint32_t word;
+	decoded_inst_t d;
+
+	if ((buf = malloc(DISASM_CHUNK + 2 * DISASM_LINE_MAX)) == NULL) {
+		printf("Error: Out of memory disassembling\n");
+		exit(-1);
+	}
+	p = buf;
+	while (address < end) {
+		page = find_region(address) != NULL ? page_lookup(address, false) : NULL;
+		page_end = (address | PAGE_MASK) + 1;
+		for (; address < end && address < page_end; address += 4) {
+			word = 0;
+			if (page != NULL) {
+				memcpy(&word, page + (address & PAGE_MASK), 4);
+			}
+			decode_instruction(word, &d);
+			p = put_str(p, "0x");
+			p = put_hex(p, address, 8);
+			*p++ = ':';
+			*p++ = '\t';
+			p = put_hex(p, word, 8);
+			*p++ = '\t';
+			p += disasm_decoded(p, address, &d);
+			if (p - buf >= DISASM_CHUNK) {
+				fwrite(buf, 1, p - buf, out);
+				p = buf;
+			}
+		}
+	}
+	fwrite(buf, 1, p - buf, out);
+	free(buf);
+}
+
+/* disassemble one instruction word as the print commands do */
+void print_word(uint32_t pc, uint32_t instruction)
+{
+	decoded_inst_t d;
+
+	decode_instruction(instruction, &d);
+	print_decoded(pc, &d);
+}
+
+/************************************************************/
+/* Library interface (riscv_sim.h). Each entry point makes sim the calling thread's   */
+/* current simulator, then works through the same code the REPL uses.                    */
+/************************************************************/
+riscv_sim_t *riscv_sim_create(void)
+{
+	riscv_sim_t *sim = calloc(1, sizeof(riscv_sim_t));
+	if (sim == NULL) {
+		return NULL;
+	}
+	SIM = sim;
 	initialize();
-	load_program();
-	help();
-	while (1){
-		handle_command();
+	return sim;
+}
+
+/* everything the current hart allocated for itself */
+static void hart_free()
+{
+	cache_t *levels[3];
+	uint32_t i;
+
+	flush_blocks();
+	if (JIT_BUFFER != NULL) {
+		munmap(JIT_BUFFER, JIT_BUFFER_SIZE);
 	}
-	return 0;
+	free(DECODE_CACHE);
+	free(THREADED_CODE);
+	free(TEXT_DIRTY);
+	free(CONSOLE_BUF);
+	free(PROFILE_HITS);
+	free(PROFILE_TAKEN);
+	free(BIMODAL_TABLE);
+	free(GSHARE_TABLE);
+	free(CHOOSER_TABLE);
+	free(BTB_TAG);
+	free(BTB_TARGET);
+	free(PRED_BRANCHES);
+	free(PRED_MISSES);
+	levels[0] = &L1I;
+	levels[1] = &L1D;
+	levels[2] = &L2;
+	for (i = 0; i < 3; i++) {
+		free(levels[i]->tags);
+		free(levels[i]->valid);
+		free(levels[i]->dirty);
+		free(levels[i]->used);
+	}
+}
+
+void riscv_sim_destroy(riscv_sim_t *sim)
+{
+	snapshot_t *snap;
+
+	if (sim == NULL) {
+		return;
+	}
+	SIM = sim;
+	console_flush();
+	trace_stop();
+	record_stop();
+	watch_clear();
+	free(CHECKPOINTS);
+	free(INPUT_LOG);
+	while (NUM_HARTS > 1) {
+		hart_destroy(HARTS[--NUM_HARTS]);
+	}
+	while (SNAPSHOTS != NULL) {
+		snap = SNAPSHOTS;
+		SNAPSHOTS = snap->next;
+		snapshot_free(snap);
+	}
+	if (BOOT_SNAPSHOT != NULL) {
+		snapshot_free(BOOT_SNAPSHOT);
+	}
+	free_memory();
+	free(DIRTY_PAGES);
+	pthread_mutex_destroy(&MEMORY_LOCK);
+	hart_free();
+	free(sim->MACHINE);
+	free(sim);
+	SIM = NULL;
+}
+
+int riscv_sim_load(riscv_sim_t *sim, const char *path)
+{
+	char previous[sizeof(prog_file)];
+	uint32_t harts;
+	int loaded;
+
+	SIM = sim;
+	if (strlen(path) >= sizeof(prog_file)) {
+		printf("Error: Program file name %s is too long\n", path);
+		return -1;
+	}
+	/* a program that fails to load leaves memory alone, so the old one stays as it was */
+	strcpy(previous, prog_file);
+	strcpy(prog_file, path);
+	loaded = load_program();
+	if (loaded < 0) {
+		strcpy(prog_file, previous);
+		return -1;
+	}
+	record_stop();
+	/* the other harts are started again on the new program */
+	harts = NUM_HARTS;
+	while (NUM_HARTS > 1) {
+		hart_destroy(HARTS[--NUM_HARTS]);
+	}
+	CURRENT_STATE.PC = PROGRAM_ENTRY;
+	while (NUM_HARTS < harts) {
+		HARTS[NUM_HARTS] = hart_create(NUM_HARTS);
+		NUM_HARTS++;
+	}
+	/* what riscv_sim_reset() returns to */
+	if (BOOT_SNAPSHOT != NULL) {
+		snapshot_free(BOOT_SNAPSHOT);
+	}
+	BOOT_SNAPSHOT = snapshot_take(NULL);
+	return loaded;
+}
+
+int riscv_sim_set_engine(riscv_sim_t *sim, const char *name)
+{
+	SIM = sim;
+	if (strcmp(name, "interp") == 0) {
+		ENGINE = ENGINE_INTERP;
+	} else if (strcmp(name, "threaded") == 0) {
+		ENGINE = ENGINE_THREADED;
+	} else if (strcmp(name, "block") == 0) {
+		ENGINE = ENGINE_BLOCK;
+	} else if (strcmp(name, "jit") == 0 && JIT_AVAILABLE) {
+		ENGINE = ENGINE_JIT;
+	} else {
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void riscv_sim_set_output(riscv_sim_t *sim, FILE *out)
+{
+	SIM = sim;
+	console_flush();
+	CONSOLE_OUT = out;
+}
+
+void riscv_sim_set_input(riscv_sim_t *sim, FILE *in)
+{
+	SIM = sim;
+	CONSOLE_IN = in;
+}
+
+uint32_t riscv_sim_step(riscv_sim_t *sim, uint32_t n)
+{
+	uint32_t left;
+
+	SIM = sim;
+	left = execute(n);
+	console_flush();
+	return n - left;
+}
+
+int32_t riscv_sim_run(riscv_sim_t *sim)
+{
+	SIM = sim;
+	while (harts_running()) {
+		execute(UINT32_MAX);
+	}
+	console_flush();
+	return EXIT_CODE;
+}
+
+void riscv_sim_reset(riscv_sim_t *sim)
+{
+	SIM = sim;
+	reset();
+}
+
+int riscv_sim_running(riscv_sim_t *sim)
+{
+	SIM = sim;
+	return harts_running();
+}
+
+int riscv_sim_trace(riscv_sim_t *sim, const char *path, int packed)
+{
+	SIM = sim;
+	if (path == NULL) {
+		trace_stop();
+		return TRUE;
+	}
+	return trace_start(path, packed);
+}
+
+int riscv_sim_set_harts(riscv_sim_t *sim, uint32_t count, int free_running)
+{
+	char spec[32];
+
+	SIM = sim;
+	snprintf(spec, sizeof(spec), "%u:%s", count, free_running ? "free" : "lockstep");
+	return harts_config(spec);
+}
+
+uint32_t riscv_sim_disasm(uint32_t pc, uint32_t instruction, char *buf)
+{
+	decoded_inst_t d;
+
+	decode_instruction(instruction, &d);
+	return disasm_decoded(buf, pc, &d);
+}
+
+int32_t riscv_sim_exit_code(riscv_sim_t *sim)
+{
+	SIM = sim;
+	return EXIT_CODE;
+}
+
+uint32_t riscv_sim_instructions(riscv_sim_t *sim)
+{
+	SIM = sim;
+	return INSTRUCTION_COUNT;
+}
+
+uint32_t riscv_sim_read_pc(riscv_sim_t *sim)
+{
+	SIM = sim;
+	return CURRENT_STATE.PC;
+}
+
+void riscv_sim_write_pc(riscv_sim_t *sim, uint32_t pc)
+{
+	SIM = sim;
+	CURRENT_STATE.PC = pc;
+}
+
+uint32_t riscv_sim_read_reg(riscv_sim_t *sim, uint32_t reg)
+{
+	SIM = sim;
+	return reg < RISCV_REGS ? CURRENT_STATE.REGS[reg] : 0;
+}
+
+void riscv_sim_write_reg(riscv_sim_t *sim, uint32_t reg, uint32_t value)
+{
+	SIM = sim;
+	if (reg > 0 && reg < RISCV_REGS) {
+		CURRENT_STATE.REGS[reg] = value;
+	}
+}
+
+void riscv_sim_read_mem(riscv_sim_t *sim, uint32_t address, void *buf, uint32_t len)
+{
+	uint8_t *dst = buf;
+	uint32_t i;
+
+	SIM = sim;
+	for (i = 0; i < len; i++) {
+		dst[i] = mem_read_8(address + i);
+	}
+}
+
+void riscv_sim_write_mem(riscv_sim_t *sim, uint32_t address, const void *buf, uint32_t len)
+{
+	SIM = sim;
+	mem_write_block(address, buf, len);
 }
@@ -1,82 +1,644 @@
-#include <stdint.h>
-
-#define FALSE 0
-#define TRUE  1
-
-/******************************************************************************/
-/* RISCV memory layout                                                                                                                                      */
-/******************************************************************************/
-#define MEM_TEXT_BEGIN  0x00400000
-#define MEM_TEXT_END      0x0FFFFFFF
-/*Memory address 0x10000000 to 0x1000FFFF access by $gp*/
-#define MEM_DATA_BEGIN  0x10010000
-#define MEM_DATA_END   0x7FFFFFFF
-
-#define MEM_KTEXT_BEGIN 0x80000000
-#define MEM_KTEXT_END  0x8FFFFFFF
-
-#define MEM_KDATA_BEGIN 0x90000000
-#define MEM_KDATA_END  0xFFFEFFFF
-
-/*stack and data segments occupy the same memory space. Stack grows backward (from higher address to lower address) */
-#define MEM_STACK_BEGIN 0x7FFFFFFF
-#define MEM_STACK_END  0x10010000
-
-typedef struct {
-	uint32_t begin, end;
-	uint8_t *mem;
-} mem_region_t;
-
-/* memory will be dynamically allocated at initialization */
-mem_region_t MEM_REGIONS[] = {
-	{ MEM_TEXT_BEGIN, MEM_TEXT_END, NULL },
-	{ MEM_DATA_BEGIN, MEM_DATA_END, NULL },
-	{ MEM_KDATA_BEGIN, MEM_KDATA_END, NULL },
-	{ MEM_KTEXT_BEGIN, MEM_KTEXT_END, NULL }
-};
-
-#define NUM_MEM_REGION 4
-#define RISCV_REGS 32
-
-typedef struct CPU_State_Struct {
-
-  uint32_t PC;		                   /* program counter */
-  uint32_t REGS[RISCV_REGS]; /* register file. */
-  uint32_t HI, LO;                          /* special regs for mult/div. */
-} CPU_State;
-
-
-/***************************************************************/
-/* CPU State info.                                                                                                               */
-/***************************************************************/
-
-CPU_State CURRENT_STATE, NEXT_STATE;
-int RUN_FLAG;	/* run flag*/
-uint32_t INSTRUCTION_COUNT;
-uint32_t PROGRAM_SIZE; /*in words*/
-
-char prog_file[32];
-
-
-/***************************************************************/
-/* Function Declerations.                                                                                                */
-/***************************************************************/
-void help();
-uint32_t mem_read_32(uint32_t address);
-void mem_write_32(uint32_t address, uint32_t value);
-void cycle();
-void run(int num_cycles);
-void runAll();
-void mdump(uint32_t start, uint32_t stop) ;
-void rdump();
-void handle_command();
-void reset();
-void init_memory();
-void load_program();
-void handle_instruction(); /*IMPLEMENT THIS*/
-void initialize();
-void print_program(); /*IMPLEMENT THIS*/
-void print_instruction(uint32_t);
-
-//void R_Print(rd,f3,rs1,rs2,f7);
-//void 
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "riscv_sim.h"
+
+#define FALSE 0
+#define TRUE  1
+
+/******************************************************************************/
+/* RISCV memory layout                                                                                                                                      */
+/******************************************************************************/
+#define MEM_TEXT_BEGIN  0x00400000
+#define MEM_TEXT_END      0x0FFFFFFF
+/*Memory address 0x10000000 to 0x1000FFFF access by $gp*/
+#define MEM_DATA_BEGIN  0x10010000
+#define MEM_DATA_END   0x7FFFFFFF
+
+#define MEM_KTEXT_BEGIN 0x80000000
+#define MEM_KTEXT_END  0x8FFFFFFF
+
+#define MEM_KDATA_BEGIN 0x90000000
+#define MEM_KDATA_END  0xFFFEFFFF
+
+/*sbrk hands out memory upwards from here*/
+#define MEM_HEAP_BEGIN 0x10040000
+
+/*stack and data segments occupy the same memory space. Stack grows backward (from higher address to lower address) */
+#define MEM_STACK_BEGIN 0x7FFFFFFF
+#define MEM_STACK_END  0x10010000
+
+typedef struct {
+	uint32_t begin, end;
+} mem_region_t;
+
+/* regions only bound the legal addresses; backing pages are allocated on first write. */
+/* They begin and end on page boundaries; call tlb_flush() after changing one.         */
+#define NUM_MEM_REGION 4
+
+extern mem_region_t MEM_REGIONS[NUM_MEM_REGION];
+
+/******************************************************************************/
+/* Guest page table: 32-bit address = | L1 index (10) | L2 index (10) | offset (12) |      */
+/******************************************************************************/
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1u << PAGE_SHIFT)
+#define PAGE_MASK (PAGE_SIZE - 1)
+#define TEXT_PAGE_SHIFT (PAGE_SHIFT - 2)	/* decode cache entries per page, as a shift */
+#define PT_L2_BITS 10
+#define PT_L1_BITS (32 - PAGE_SHIFT - PT_L2_BITS)
+#define PT_L1_ENTRIES (1u << PT_L1_BITS)
+#define PT_L2_ENTRIES (1u << PT_L2_BITS)
+
+#define PT_L1_INDEX(addr) ((addr) >> (PAGE_SHIFT + PT_L2_BITS))
+#define PT_L2_INDEX(addr) (((addr) >> PAGE_SHIFT) & (PT_L2_ENTRIES - 1))
+
+/* every page carries a reference count after its PAGE_SIZE bytes: the page table and
+   each snapshot holding it count once, and a write to a page with more than one
+   holder copies it first */
+#define PAGE_REFS(page) (*(uint32_t *)((page) + PAGE_SIZE))
+
+/* software TLB: a direct-mapped cache of page address -> backing page, per hart */
+#define TLB_BITS 8
+#define TLB_ENTRIES (1u << TLB_BITS)
+#define TLB_INVALID 1u		/* never a page address */
+
+typedef struct {
+	uint32_t tag;		/* guest page address, or TLB_INVALID */
+	int writable;		/* the page is private, so stores may go straight to it */
+	uint8_t *page;
+} tlb_entry_t;
+
+#define RISCV_REGS 32
+
+/* ABI registers used by the ecall interface */
+#define REG_A0 10
+#define REG_A1 11
+#define REG_A7 17
+
+typedef struct CPU_State_Struct {
+
+  uint32_t PC;		                   /* program counter */
+  uint32_t REGS[RISCV_REGS]; /* register file. */
+  uint32_t HI, LO;                          /* special regs for mult/div. */
+} CPU_State;
+
+/* in-order IF/ID/EX/MEM/WB timing model, fed one retired instruction at a time */
+enum { STAGE_IF, STAGE_ID, STAGE_EX, STAGE_MEM, STAGE_WB, NUM_STAGES };
+
+typedef struct {
+	int64_t stage[NUM_STAGES];			/* latches: cycle the last instruction entered each stage */
+	int64_t reg_ready[RISCV_REGS];		/* first cycle a consumer of each register can enter EX */
+	uint8_t reg_load[RISCV_REGS];		/* that register is waiting on a load */
+	int64_t fetch_ready;				/* earliest fetch after a taken branch or jump */
+	uint64_t instructions;
+	uint64_t load_use_stalls;			/* EX stalls behind a load */
+	uint64_t data_stalls;				/* other EX stalls on a register */
+	uint64_t flush_cycles;				/* fetch slots lost to taken branches and jumps */
+	uint64_t branches, taken;
+} pipeline_t;
+
+/* a saved machine: CPU state plus a shared reference to every page that existed */
+#define SNAPSHOT_NAME_LEN 32
+
+typedef struct snapshot {
+	char name[SNAPSHOT_NAME_LEN];
+	CPU_State state;
+	uint32_t instruction_count, heap_break;
+	int run_flag;
+	int32_t exit_code;
+	pipeline_t pipeline;
+	uint32_t num_harts;			/* harts after the first, saved in harts[] */
+	struct hart_state *harts;
+	uint32_t num_pages;
+	uint32_t *page_numbers;		/* ascending address >> PAGE_SHIFT */
+	uint8_t **pages;
+	uint32_t input_pos;			/* record/replay checkpoints: how much of INPUT_LOG was read */
+	struct snapshot *next;
+} snapshot_t;
+
+/* record/replay: checkpoints kept before the interval doubles and half are dropped */
+#define RECORD_MAX_CHECKPOINTS 256
+
+
+/* the part of a snapshot saved for each hart after the first */
+typedef struct hart_state {
+	CPU_State state;
+	uint32_t instruction_count;
+	int run_flag;
+} hart_state_t;
+
+/* program output is collected here and written out on flush */
+#define CONSOLE_BUF_SIZE (1 << 20)
+
+/* how load_program() reads prog_file, chosen with -f */
+typedef enum {
+	FORMAT_AUTO,	/* ELF by magic number, flat binary by .bin suffix, hex otherwise */
+	FORMAT_HEX,		/* one hex word per line */
+	FORMAT_BINARY,	/* raw little-endian image */
+	FORMAT_ELF		/* ELF32 RISC-V executable */
+} program_format_t;
+
+
+#ifndef EM_RISCV
+#define EM_RISCV 243
+#endif
+
+#define RETIRE_LOAD 1
+#define RETIRE_STORE 2
+
+/* what the last instruction did; instruction/rd/before/after are only filled while RETIRE_HOOK is set, */
+/* the memory fields only by the interpreter                                                           */
+typedef struct {
+	uint32_t pc;			/* address of the instruction */
+	uint32_t next_pc;		/* where execution continues */
+	uint32_t instruction;
+	uint8_t rd;				/* destination register, 0 if none */
+	uint32_t before, after;	/* rd around the instruction */
+	uint8_t access;			/* RETIRE_LOAD | RETIRE_STORE (both for an AMO) */
+	uint8_t size;			/* bytes accessed */
+	uint32_t address;
+	uint32_t loaded, stored;
+	uint8_t trapped;		/* TRUE if it stopped without retiring (ebreak under a debugger) */
+} retire_t;
+
+/* binary execution trace: a header, then one record per retired instruction followed */
+/* by one per load or store it made, raw or packed (TRACE_PACKED)                        */
+#define TRACE_MAGIC "MUTRACE1"
+#define TRACE_PACKED 1				/* header flag */
+#define TRACE_RING_SIZE (1 << 20)	/* records between the simulation and the writer thread */
+#define TRACE_WORD_CACHE 4096		/* instruction words the packed format remembers by PC */
+
+typedef enum { TRACE_RETIRE, TRACE_LOAD, TRACE_STORE } trace_kind_t;
+
+typedef struct {
+	uint32_t pc;
+	uint32_t word;			/* the instruction, or the address loaded or stored */
+	uint32_t value;			/* written to rd, loaded or stored */
+	uint8_t kind;			/* trace_kind_t */
+	uint8_t reg;			/* rd (0 if none) for TRACE_RETIRE, bytes accessed otherwise */
+	uint16_t hart;
+} trace_rec_t;
+
+/* what the packed encoding carries from one record to the next */
+typedef struct {
+	uint32_t pc;
+	uint16_t hart;
+	uint32_t address;		/* of the last load or store */
+	uint32_t words[TRACE_WORD_CACHE];
+} trace_state_t;
+
+/* a trace file being read back */
+typedef struct {
+	FILE *file;
+	int packed;
+	trace_state_t state;
+} trace_reader_t;
+
+typedef struct trace trace_t;
+
+
+/***************************************************************/
+/* Predecoded instructions.                                                                                    */
+/***************************************************************/
+/* one per mnemonic; unknown opcodes decode to OP_NOP, malformed known ones to OP_INVALID */
+enum {
+	OP_INVALID, OP_NOP,
+	OP_ADD, OP_SUB, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_SRA, OP_OR, OP_AND,
+	OP_ADDI, OP_SLTI, OP_SLTIU, OP_XORI, OP_ORI, OP_ANDI, OP_SLLI, OP_SRLI, OP_SRAI,
+	OP_LB, OP_LH, OP_LW, OP_LBU, OP_LHU,
+	OP_SB, OP_SH, OP_SW,
+	OP_BEQ, OP_BNE, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU,
+	OP_LUI, OP_AUIPC, OP_JAL, OP_JALR,
+	OP_ECALL, OP_EBREAK,
+	OP_LR_W, OP_SC_W, OP_AMOSWAP_W, OP_AMOADD_W, OP_AMOXOR_W, OP_AMOAND_W, OP_AMOOR_W,
+	OP_AMOMIN_W, OP_AMOMAX_W, OP_AMOMINU_W, OP_AMOMAXU_W,
+	OP_MHARTID,		/* csrr rd, mhartid */
+	NUM_OPS
+};
+
+struct decoded_inst;
+typedef void (*inst_handler_t)(struct decoded_inst *);
+
+typedef struct decoded_inst {
+	inst_handler_t handler;	/* executes the instruction */
+	uint8_t op;				/* OP_* */
+	uint8_t rd, rs1, rs2;
+	int32_t imm;			/* sign-extended (shift amount for shifts) */
+} decoded_inst_t;
+
+#define OP_NAME_SIZE 12		/* longest mnemonic (amomaxu.w) and its NUL, rounded up */
+#define DISASM_LINE_MAX RISCV_SIM_DISASM_MAX	/* longest line disasm_decoded() writes, with its NUL */
+
+/* direct-threaded form of the decode cache, built on first use by the threaded engine */
+typedef struct threaded_inst {
+	const void *label;				/* computed-goto target for this instruction */
+	struct threaded_inst *target;	/* taken branch/jal successor, NULL if outside the text */
+	uint8_t op;
+	uint8_t rd, rs1, rs2;
+	int32_t imm;
+} threaded_inst_t;
+
+/* JIT-compiled block: takes CURRENT_STATE.REGS, returns a JIT_EXIT_* code */
+typedef uint32_t (*native_block_t)(uint32_t *regs);
+
+/* translated basic block: straight-line ops ending at a branch or jump */
+typedef struct block {
+	uint32_t pc;			/* guest address of the first instruction */
+	uint32_t count;			/* instructions in the block */
+	uint32_t heat;			/* times entered, until it is JIT-compiled */
+	native_block_t native;	/* compiled code, NULL while interpreted */
+	struct block *next[2];	/* chained successors: [0] fall-through, [1] taken */
+	threaded_inst_t ops[];	/* count ops plus a fall-through exit */
+} block_t;
+
+/* branch predictors for B-type instructions, chosen with the predictor command or -B */
+typedef enum {
+	PRED_OFF,
+	PRED_STATIC,		/* always not taken */
+	PRED_BIMODAL,		/* 2-bit counter per PC */
+	PRED_GSHARE,		/* 2-bit counter per PC xor global history */
+	PRED_TOURNAMENT		/* per-PC chooser between bimodal and gshare */
+} predictor_t;
+
+#define PRED_NAMES "off|static|bimodal|gshare|tournament"
+
+/* set-associative cache; tag state is kept as parallel arrays of sets * assoc entries */
+enum { CACHE_LRU, CACHE_RANDOM };
+
+typedef struct cache {
+	const char *name;
+	uint32_t size, assoc, line;		/* bytes, ways, bytes */
+	uint32_t line_shift, set_mask;
+	int replace;					/* CACHE_LRU or CACHE_RANDOM */
+	int write_back;					/* write-back/write-allocate, else write-through/no-allocate */
+	uint32_t *tags;					/* line address held by each way */
+	uint8_t *valid, *dirty;
+	uint64_t *used;					/* LRU stamp of each way */
+	uint64_t clock;
+	uint32_t last_way;				/* way of the last hit or fill */
+	struct cache *next;				/* next level, NULL for memory */
+	uint64_t reads, writes, read_misses, write_misses, evictions, writebacks;
+} cache_t;
+
+/***************************************************************/
+/* Execution engine, selected with -e at startup.                                                   */
+/* Defaults to the JIT where the host supports it; any other engine turns it off.        */
+/***************************************************************/
+typedef enum {
+	ENGINE_INTERP,		/* cycle() per instruction: the reference engine */
+	ENGINE_THREADED,	/* direct-threaded code over the decode cache */
+	ENGINE_BLOCK,		/* chained basic blocks */
+	ENGINE_JIT			/* basic blocks, hot ones compiled to x86-64 */
+} engine_t;
+
+#if defined(__x86_64__)
+#define JIT_AVAILABLE 1
+#define ENGINE_NAMES "interp|threaded|block|jit"
+#else
+#define JIT_AVAILABLE 0
+#define ENGINE_NAMES "interp|threaded|block"
+#endif
+
+/***************************************************************/
+/* Harts. Every hart is a riscv_sim_t of its own; the harts of one machine share a        */
+/* machine_t holding guest memory and everything else that is not per-core.             */
+/***************************************************************/
+#define MAX_HARTS 64
+#define HART_STACK_SIZE 0x100000	/* hart n starts with sp = MEM_STACK_BEGIN - n * HART_STACK_SIZE */
+
+typedef enum {
+	HARTS_LOCKSTEP,		/* round robin on the calling thread, HART_QUANTUM instructions each: deterministic */
+	HARTS_FREE			/* one host thread per hart */
+} hart_mode_t;
+
+/* watchpoints and breakpoints */
+#define MAX_WATCHES 16
+#define MAX_BREAKPOINTS 16
+#define WATCH_SIZE 4		/* a watchpoint covers the word at its address */
+#define WATCH_READ 1
+#define WATCH_WRITE 2
+#define BREAK_NONE 1u		/* never an instruction address */
+#define EBREAK_INSTRUCTION 0x00100073	/* what a debugger patches over an instruction to break there */
+
+typedef struct {
+	uint32_t address;
+	int kind;			/* WATCH_READ | WATCH_WRITE */
+} watch_t;
+
+typedef enum {
+	STOP_NONE,
+	STOP_BREAK,
+	STOP_READ,
+	STOP_WRITE
+} stop_kind_t;
+
+/* why execute() returned early */
+typedef struct {
+	stop_kind_t kind;
+	uint32_t hart;
+	uint32_t pc;			/* the breakpoint, or the instruction that made the access */
+	uint32_t address;		/* the watched address accessed */
+} debug_stop_t;
+
+typedef struct machine {
+	/* guest memory: L1 entries point to a table of L2_ENTRIES page pointers; NULL means never touched */
+	uint8_t **PAGE_TABLE[PT_L1_ENTRIES];
+	uint32_t PAGES_ALLOCATED;
+	pthread_mutex_t MEMORY_LOCK;	/* held to allocate or copy a page while harts run on threads */
+	uint32_t PAGE_EPOCH;		/* bumped when a page is replaced or becomes shared; every TLB filled before is stale */
+
+	/* copy-on-write bookkeeping for snapshots */
+	snapshot_t *SNAPSHOT_BASE;	/* last snapshot taken or restored; DIRTY_PAGES is relative to it */
+	uint32_t *DIRTY_PAGES;		/* page numbers made private since SNAPSHOT_BASE */
+	uint32_t NUM_DIRTY, DIRTY_CAPACITY;
+
+	uint32_t HEAP_BREAK; /*current sbrk break*/
+	int32_t EXIT_CODE;		/* guest exit status from the exit syscalls */
+
+	struct riscv_sim *HARTS[MAX_HARTS];	/* HARTS[0] is the riscv_sim_t the machine was created with */
+	uint32_t NUM_HARTS;
+	hart_mode_t HART_MODE;
+	uint32_t HART_QUANTUM;		/* instructions a hart runs before the next one (lockstep) or before checking for an exit (free) */
+
+	/* watchpoints and breakpoints; while any is set the harts run in the interpreter */
+	int DEBUGGING;
+	uint8_t *WATCH_PAGES;		/* a bit per guest page holding a watched byte, NULL without watchpoints; those pages stay out of the TLBs */
+	watch_t WATCHES[MAX_WATCHES];
+	uint32_t NUM_WATCHES;
+	uint32_t BREAKPOINTS[MAX_BREAKPOINTS];
+	uint32_t NUM_BREAKPOINTS;
+	debug_stop_t DEBUG_STOP;
+	int EBREAK_TRAPS;		/* ebreak stops the run with STOP_BREAK (a debugger is attached); otherwise it is a nop */
+} machine_t;
+
+#define HART_QUANTUM_LOCKSTEP 1
+#define HART_QUANTUM_FREE 10000
+
+/***************************************************************/
+/* Simulator state. Everything one guest machine owns lives in a riscv_sim_t so that   */
+/* any number of them can run in one process. The simulator works on the one SIM points */
+/* to in the calling thread; the riscv_sim_* entry points select it.                     */
+/***************************************************************/
+struct riscv_sim {
+	machine_t *MACHINE;		/* memory and harts, shared with the other harts */
+	uint32_t HART_ID;
+
+	/* LR/SC reservation */
+	int RESERVED;
+	uint32_t RESERVATION;		/* address of the last lr.w */
+	uint32_t RESERVED_VALUE;	/* what it read; sc.w succeeds while memory still holds it */
+
+	/* software TLB in front of the regions and page table */
+	tlb_entry_t TLB[TLB_ENTRIES];
+	uint32_t TLB_EPOCH;			/* PAGE_EPOCH when the entries were filled */
+	uint64_t TLB_HITS, TLB_MISSES;
+
+	/* debugging */
+	int WATCH_ARMED;			/* set while an instruction runs, so only its own accesses hit watchpoints */
+	uint32_t BREAK_SKIP_PC;		/* breakpoint stopped at, passed on resuming; BREAK_NONE otherwise */
+
+	/* snapshots */
+	snapshot_t *SNAPSHOTS;		/* named snapshots, newest first */
+	snapshot_t *BOOT_SNAPSHOT;	/* the post-load image reset() returns to */
+
+	/* record/replay (single hart) */
+	uint32_t RECORD_INTERVAL;	/* instructions between checkpoints; 0 when not recording */
+	snapshot_t **CHECKPOINTS;	/* RECORD_MAX_CHECKPOINTS slots, oldest first */
+	uint32_t NUM_CHECKPOINTS;
+	uint32_t RECORD_HORIZON;	/* furthest instruction count reached; output before it was already printed */
+	uint8_t *INPUT_LOG;			/* what the read syscalls returned, in order */
+	uint32_t INPUT_LEN, INPUT_CAPACITY;
+	uint32_t INPUT_POS;			/* next INPUT_LOG byte to replay; INPUT_LEN when reading live */
+
+	/* CPU state info */
+	CPU_State CURRENT_STATE;	/* architectural state, updated in place */
+	int RUN_FLAG;	/* run flag*/
+	uint32_t INSTRUCTION_COUNT;
+	uint32_t PROGRAM_SIZE; /*in words*/
+	uint32_t PROGRAM_ENTRY; /*initial PC*/
+
+	/* program output is collected here and written out on flush */
+	char *CONSOLE_BUF;		/* CONSOLE_BUF_SIZE bytes, allocated on first output */
+	uint32_t CONSOLE_LEN;
+	FILE *CONSOLE_OUT;		/* stdout unless riscv_sim_set_output() says otherwise */
+	FILE *CONSOLE_IN;		/* what the read syscalls read: stdin unless riscv_sim_set_input() says otherwise */
+
+	char prog_file[256];
+	program_format_t PROGRAM_FORMAT;
+	int QUIET;	/* no per-word load logging */
+
+	retire_t RETIRE;
+	void (*RETIRE_HOOK)(const retire_t *);	/* called by cycle() after every instruction; forces the interpreter */
+	trace_t *TRACE;			/* binary trace being recorded, shared by every hart; forces the interpreter */
+
+	/* execution engines */
+	engine_t ENGINE;
+	decoded_inst_t *DECODE_CACHE;	/* indexed by (PC - MEM_TEXT_BEGIN) / 4 */
+	uint32_t DECODE_CACHE_SIZE;	/* in words */
+	threaded_inst_t *THREADED_CODE;
+	block_t **BLOCK_MAP;	/* block starting at each text word, indexed like DECODE_CACHE */
+	int BLOCKS_STALE;		/* a store hit the text; flush before the next lookup */
+	uint8_t *TEXT_DIRTY;	/* a bit per text page another hart stored to, cleared by text_sync() */
+	int TEXT_PENDING;		/* some bit of TEXT_DIRTY may be set */
+	uint8_t *JIT_BUFFER;	/* compiled blocks, mapped on first use */
+	uint32_t JIT_USED;
+
+	/* profiler: per-PC counters indexed like DECODE_CACHE, per-mnemonic counters by OP_* */
+	int PROFILING;				/* forces the interpreter while set */
+	uint64_t *PROFILE_HITS;		/* times each text word retired */
+	uint64_t *PROFILE_TAKEN;	/* times each text word did not fall through */
+	uint32_t PROFILE_SIZE;		/* in words */
+	uint64_t OP_HITS[NUM_OPS], OP_TAKEN[NUM_OPS];	/* only for instructions outside the text */
+
+	/* branch predictor, chosen with the predictor command or -B */
+	predictor_t PREDICTOR;
+	uint32_t PRED_TABLE_BITS;	/* log2 of the counter, history and chooser table sizes */
+	uint32_t BTB_BITS;			/* log2 of the direct-mapped branch target buffer size */
+	uint8_t *BIMODAL_TABLE, *GSHARE_TABLE, *CHOOSER_TABLE;	/* 2-bit saturating counters */
+	uint32_t PRED_HISTORY;		/* global outcome history, newest in bit 0 */
+	uint32_t *BTB_TAG, *BTB_TARGET;	/* branch address (0 for empty) and its taken target */
+	uint64_t *PRED_BRANCHES, *PRED_MISSES;	/* per text word, indexed like DECODE_CACHE */
+	uint32_t PRED_SIZE;			/* in words */
+	uint64_t PRED_TOTAL, PRED_MISPREDICTS, PRED_BTB_MISSES;
+
+	/* caches */
+	cache_t L1I, L1D, L2;
+	int CACHE_SIM;				/* forces the interpreter while set */
+	uint32_t CACHE_RANDOM_STATE;	/* xorshift state for random replacement */
+
+	/* pipeline timing model, chosen with the pipeline command or -t */
+	pipeline_t PIPELINE;
+	int TIMING;					/* forces the interpreter while set */
+	int PIPE_FORWARDING;		/* EX/MEM and MEM/WB bypasses; without them consumers wait for WB */
+	uint32_t PIPE_BRANCH_PENALTY;	/* fetch cycles lost to a taken branch or jalr (resolved in EX) */
+};
+
+extern __thread riscv_sim_t *SIM;
+
+/* the simulator's code names its state as it did when the state was global */
+#define PAGE_TABLE (SIM->MACHINE->PAGE_TABLE)
+#define PAGES_ALLOCATED (SIM->MACHINE->PAGES_ALLOCATED)
+#define PAGE_EPOCH (SIM->MACHINE->PAGE_EPOCH)
+#define MEMORY_LOCK (SIM->MACHINE->MEMORY_LOCK)
+#define SNAPSHOT_BASE (SIM->MACHINE->SNAPSHOT_BASE)
+#define DIRTY_PAGES (SIM->MACHINE->DIRTY_PAGES)
+#define NUM_DIRTY (SIM->MACHINE->NUM_DIRTY)
+#define DIRTY_CAPACITY (SIM->MACHINE->DIRTY_CAPACITY)
+#define HEAP_BREAK (SIM->MACHINE->HEAP_BREAK)
+#define EXIT_CODE (SIM->MACHINE->EXIT_CODE)
+#define HARTS (SIM->MACHINE->HARTS)
+#define NUM_HARTS (SIM->MACHINE->NUM_HARTS)
+#define HART_MODE (SIM->MACHINE->HART_MODE)
+#define HART_QUANTUM (SIM->MACHINE->HART_QUANTUM)
+#define HART_ID (SIM->HART_ID)
+#define RESERVED (SIM->RESERVED)
+#define RESERVATION (SIM->RESERVATION)
+#define RESERVED_VALUE (SIM->RESERVED_VALUE)
+#define TLB (SIM->TLB)
+#define TLB_EPOCH (SIM->TLB_EPOCH)
+#define TLB_HITS (SIM->TLB_HITS)
+#define TLB_MISSES (SIM->TLB_MISSES)
+#define WATCH_ARMED (SIM->WATCH_ARMED)
+#define BREAK_SKIP_PC (SIM->BREAK_SKIP_PC)
+#define DEBUGGING (SIM->MACHINE->DEBUGGING)
+#define WATCH_PAGES (SIM->MACHINE->WATCH_PAGES)
+#define WATCHES (SIM->MACHINE->WATCHES)
+#define NUM_WATCHES (SIM->MACHINE->NUM_WATCHES)
+#define BREAKPOINTS (SIM->MACHINE->BREAKPOINTS)
+#define NUM_BREAKPOINTS (SIM->MACHINE->NUM_BREAKPOINTS)
+#define DEBUG_STOP (SIM->MACHINE->DEBUG_STOP)
+#define EBREAK_TRAPS (SIM->MACHINE->EBREAK_TRAPS)
+#define SNAPSHOTS (SIM->SNAPSHOTS)
+#define BOOT_SNAPSHOT (SIM->BOOT_SNAPSHOT)
+#define CURRENT_STATE (SIM->CURRENT_STATE)
+#define RUN_FLAG (SIM->RUN_FLAG)
+#define INSTRUCTION_COUNT (SIM->INSTRUCTION_COUNT)
+#define PROGRAM_SIZE (SIM->PROGRAM_SIZE)
+#define PROGRAM_ENTRY (SIM->PROGRAM_ENTRY)
+#define CONSOLE_BUF (SIM->CONSOLE_BUF)
+#define CONSOLE_LEN (SIM->CONSOLE_LEN)
+#define CONSOLE_OUT (SIM->CONSOLE_OUT)
+#define CONSOLE_IN (SIM->CONSOLE_IN)
+#define prog_file (SIM->prog_file)
+#define PROGRAM_FORMAT (SIM->PROGRAM_FORMAT)
+#define QUIET (SIM->QUIET)
+#define RETIRE (SIM->RETIRE)
+#define RETIRE_HOOK (SIM->RETIRE_HOOK)
+#define TRACE (SIM->TRACE)
+#define RECORD_INTERVAL (SIM->RECORD_INTERVAL)
+#define CHECKPOINTS (SIM->CHECKPOINTS)
+#define NUM_CHECKPOINTS (SIM->NUM_CHECKPOINTS)
+#define RECORD_HORIZON (SIM->RECORD_HORIZON)
+#define INPUT_LOG (SIM->INPUT_LOG)
+#define INPUT_LEN (SIM->INPUT_LEN)
+#define INPUT_CAPACITY (SIM->INPUT_CAPACITY)
+#define INPUT_POS (SIM->INPUT_POS)
+#define ENGINE (SIM->ENGINE)
+#define DECODE_CACHE (SIM->DECODE_CACHE)
+#define DECODE_CACHE_SIZE (SIM->DECODE_CACHE_SIZE)
+#define THREADED_CODE (SIM->THREADED_CODE)
+#define BLOCK_MAP (SIM->BLOCK_MAP)
+#define BLOCKS_STALE (SIM->BLOCKS_STALE)
+#define TEXT_DIRTY (SIM->TEXT_DIRTY)
+#define TEXT_PENDING (SIM->TEXT_PENDING)
+#define JIT_BUFFER (SIM->JIT_BUFFER)
+#define JIT_USED (SIM->JIT_USED)
+#define PROFILING (SIM->PROFILING)
+#define PROFILE_HITS (SIM->PROFILE_HITS)
+#define PROFILE_TAKEN (SIM->PROFILE_TAKEN)
+#define PROFILE_SIZE (SIM->PROFILE_SIZE)
+#define OP_HITS (SIM->OP_HITS)
+#define OP_TAKEN (SIM->OP_TAKEN)
+#define PREDICTOR (SIM->PREDICTOR)
+#define PRED_TABLE_BITS (SIM->PRED_TABLE_BITS)
+#define BTB_BITS (SIM->BTB_BITS)
+#define BIMODAL_TABLE (SIM->BIMODAL_TABLE)
+#define GSHARE_TABLE (SIM->GSHARE_TABLE)
+#define CHOOSER_TABLE (SIM->CHOOSER_TABLE)
+#define PRED_HISTORY (SIM->PRED_HISTORY)
+#define BTB_TAG (SIM->BTB_TAG)
+#define BTB_TARGET (SIM->BTB_TARGET)
+#define PRED_BRANCHES (SIM->PRED_BRANCHES)
+#define PRED_MISSES (SIM->PRED_MISSES)
+#define PRED_SIZE (SIM->PRED_SIZE)
+#define PRED_TOTAL (SIM->PRED_TOTAL)
+#define PRED_MISPREDICTS (SIM->PRED_MISPREDICTS)
+#define PRED_BTB_MISSES (SIM->PRED_BTB_MISSES)
+#define L1I (SIM->L1I)
+#define L1D (SIM->L1D)
+#define L2 (SIM->L2)
+#define CACHE_SIM (SIM->CACHE_SIM)
+#define CACHE_RANDOM_STATE (SIM->CACHE_RANDOM_STATE)
+#define PIPELINE (SIM->PIPELINE)
+#define TIMING (SIM->TIMING)
+#define PIPE_FORWARDING (SIM->PIPE_FORWARDING)
+#define PIPE_BRANCH_PENALTY (SIM->PIPE_BRANCH_PENALTY)
+
+
+/***************************************************************/
+/* Function Declerations.                                                                                                */
+/***************************************************************/
+uint32_t mem_read_8(uint32_t address);
+uint32_t mem_read_16(uint32_t address);
+uint32_t mem_read_32(uint32_t address);
+void mem_write_8(uint32_t address, uint32_t value);
+void mem_write_16(uint32_t address, uint32_t value);
+void mem_write_32(uint32_t address, uint32_t value);
+void tlb_flush();
+void cycle();
+void trace_cycle();
+uint32_t execute(uint32_t num_cycles);
+int harts_running();
+int harts_config(const char *arg);
+void reset();
+void init_memory();
+void free_memory();
+int load_program();
+void mem_write_block(uint32_t address, const uint8_t *src, uint32_t len);
+snapshot_t *snapshot_take(const char *name);
+int snapshot_restore(snapshot_t *snap);
+snapshot_t *snapshot_find(const char *name);
+int record_start(uint32_t interval);
+void record_stop();
+int record_seek(uint32_t count);
+int record_reverse();
+uint32_t record_first();
+int watch_add(uint32_t address, int kind);
+void watch_clear();
+int break_add(uint32_t pc);
+void break_clear();
+int gdb_serve(const char *where);
+void handle_instruction(); /*IMPLEMENT THIS*/
+void initialize();
+void print_program(); /*IMPLEMENT THIS*/
+void print_instruction(uint32_t);
+void print_word(uint32_t pc, uint32_t instruction);
+uint32_t disasm_decoded(char *buf, uint32_t pc, const decoded_inst_t *d);
+void disasm(uint32_t start, uint32_t stop, FILE *out);
+int trace_start(const char *path, int packed);
+void trace_stop();
+int trace_open(trace_reader_t *reader, const char *path);
+int trace_next(trace_reader_t *reader, trace_rec_t *rec);
+void SYSCALL(CPU_State *state);
+void console_flush();
+void decode_instruction(uint32_t instruction, decoded_inst_t *d);
+void build_decode_cache();
+void decode_invalidate(uint32_t address);
+uint32_t run_threaded(uint32_t budget);
+uint32_t run_blocks(uint32_t budget);
+void flush_blocks();
+void profile_clear();
+void pipeline_clear();
+int predictor_config(const char *arg);
+void predictor_clear();
+void predictor_report(uint32_t top);
+int cache_config(const char *arg);
+void cache_clear();
+void cache_stats();
+uint64_t pipeline_cycles();
+void profile_report(uint32_t top);
+
+//void R_Print(rd,f3,rs1,rs2,f7);
+//void 
@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "mu-riscv.h"
+
+/***************************************************************/
+/* Print a binary trace recorded with mu-riscv -T (or tracefile) as text: each retired */
+/* instruction in the print command's format, then what it wrote to rd and memory.     */
+/***************************************************************/
+int main(int argc, char *argv[]) {
+	trace_reader_t reader;
+	trace_rec_t rec;
+
+	if (argc != 2) {
+		printf("Usage: %s <trace file>\n", argv[0]);
+		exit(1);
+	}
+	if (!trace_open(&reader, argv[1])) {
+		exit(1);
+	}
+	while (trace_next(&reader, &rec)) {
+		switch (rec.kind) {
+			case TRACE_RETIRE:
+				if (rec.hart != 0) {
+					printf("[hart %u] ", rec.hart);
+				}
+				printf("0x%08x: ", rec.pc);
+				print_word(rec.pc, rec.word);
+				if (rec.reg != 0) {
+					printf("\tx%u <- 0x%08x\n", rec.reg, rec.value);
+				}
+				break;
+			case TRACE_LOAD:
+				printf("\tload  0x%08x [%u] -> 0x%08x\n", rec.word, rec.reg, rec.value);
+				break;
+			case TRACE_STORE:
+				printf("\tstore 0x%08x [%u] <- 0x%08x\n", rec.word, rec.reg, rec.value);
+				break;
+		}
+	}
+	fclose(reader.file);
+	return 0;
+}
@@ -0,0 +1,1029 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "mu-riscv.h"
+
+/* the command-line front end; the simulator itself is libmu-riscv.a (riscv_sim.h) */
+
+/* non-interactive runs (-r, -n, -c): no banner, prompt or chatter, results as JSON */
+#define MAX_JSON_RANGES 16
+
+static int BATCH;				/* set by -r, -n, -c or -j */
+static FILE *COMMAND_IN;		/* where handle_command() reads from: stdin or the -c script */
+static FILE *JSON_OUT;			/* -j: final state is written here as JSON, NULL for none */
+static uint32_t JSON_RANGES[MAX_JSON_RANGES][2];	/* -m start:stop memory ranges for the JSON */
+static uint32_t NUM_JSON_RANGES;
+
+/* --batch: every program in a directory or list file, run on a pool of worker threads */
+typedef struct {
+	char **programs;
+	uint32_t count;
+	uint32_t next;			/* next program to hand out; taken with an atomic add */
+	char **results;			/* the JSON line for each program, in program order */
+	size_t *result_lens;
+	long limit;				/* -n: instructions per program, -1 to run to completion */
+	engine_t engine;		/* settings copied from the command line into every worker's machine */
+	program_format_t format;
+	int profiling, timing;
+	const char *predictor_spec;
+	const char *harts_spec;
+	const char **cache_specs;
+	int num_cache_specs;
+	FILE *console_in, *console_out;	/* guest input reads as end of file, output is discarded */
+	int failed;				/* programs that could not be loaded */
+} batch_job_t;
+
+void help();
+void run(int num_cycles);
+void runAll();
+void mdump(uint32_t start_addr, uint32_t end_addr);
+void rdump();
+void write_json(FILE *out);
+void finish();
+void handle_command();
+void usage(const char *prog);
+int run_batch(batch_job_t *job, const char *path, int workers);
+
+/***************************************************************/
+/* Print out a list of commands available                                                                  */
+/***************************************************************/
+void help() {        
+	printf("------------------------------------------------------------------\n\n");
+	printf("\t**********MU-RISCV Help MENU**********\n\n");
+	printf("sim\t-- simulate program to completion \n");
+	printf("run <n>\t-- simulate program for <n> instructions\n");
+	printf("rdump\t-- dump register values\n");
+	printf("reset\t-- clears all registers/memory and re-loads the program\n");
+	printf("snapshot <name>\t-- save registers and memory as <name>\n");
+	printf("restore <name>\t-- return to the snapshot <name>\n");
+	printf("record <n>|off\t-- checkpoint every <n> instructions and log input, so execution can go backwards\n");
+	printf("rstep <n>\t-- go back <n> instructions in the recording\n");
+	printf("rcontinue\t-- go back to the last watchpoint or breakpoint hit, or to the start of the recording\n");
+	printf("watch <addr> [r|w|rw]\t-- stop after an instruction reads or writes the word at <addr> (default w)\n");
+	printf("watch off\t-- remove every watchpoint\n");
+	printf("break <pc>\t-- stop before the instruction at <pc>\n");
+	printf("break off\t-- remove every breakpoint\n");
+	printf("input <reg> <val>\t-- set GPR <reg> to <val>\n");
+	printf("mdump <start> <stop>\t-- dump memory from <start> to <stop> address\n");
+	printf("high <val>\t-- set the HI register to <val>\n");
+	printf("harts <n>[:lockstep|:free][:<quantum>]\t-- run <n> harts over one memory, taking turns or on their own threads\n");
+	printf("low <val>\t-- set the LO register to <val>\n");
+	printf("print\t-- print the program loaded into memory\n");
+	printf("disasm <start> <stop> [file]\t-- disassemble memory from <start> to <stop> address, to <file> if given\n");
+	printf("cache on|off|clear\t-- simulate the L1I/L1D/L2 caches on every fetch, load and store\n");
+	printf("cache <level>=<size>:<ways>:<line>[:lru|random][:wb|wt]\t-- reshape l1i, l1d or l2\n");
+	printf("cachestats\t-- show cache hits, misses and evictions, and the TLB hit rate\n");
+	printf("pipeline on|off\t-- count cycles on the 5-stage pipeline model (shown by rdump)\n");
+	printf("pipeline forward|stall\t-- resolve data hazards by forwarding or by stalling until WB\n");
+	printf("pipeline <n>\t-- cycles flushed by a taken branch or jalr (default 2)\n");
+	printf("predictor <kind>[:<bits>[:<btb bits>]]\t-- predict branches with %s\n", PRED_NAMES);
+	printf("predictor <n>\t-- show prediction accuracy and the <n> most mispredicted branches\n");
+	printf("profile on|off|clear\t-- start, stop or zero the per-PC and per-mnemonic profile\n");
+	printf("profile <n>\t-- show the <n> hottest instructions and the instruction mix\n");
+	printf("trace\t-- toggle printing of every retired instruction\n");
+	printf("tracefile raw|packed <file>\t-- record every instruction, load and store to <file> (see mu-trace)\n");
+	printf("tracefile off\t-- finish writing the trace file\n");
+	printf("flush\t-- write out buffered program output\n");
+	printf("?\t-- display help menu\n");
+	printf("quit\t-- exit the simulator\n\n");
+	printf("------------------------------------------------------------------\n\n");
+}
+
+
+/***************************************************************/
+/* Retire hook used by the trace command                                                          */
+/***************************************************************/
+static void print_retire(const retire_t *r)
+{
+	printf("0x%08x: 0x%08x", r->pc, r->instruction);
+	if (r->rd != 0) {
+		printf("\tx%u: 0x%08x -> 0x%08x", r->rd, r->before, r->after);
+	}
+	if (r->next_pc != r->pc + 4) {
+		printf("\tpc -> 0x%08x", r->next_pc);
+	}
+	printf("\n");
+}
+
+
+/***************************************************************/
+/* Say which watchpoint or breakpoint stopped the last run, if one did                      */
+/***************************************************************/
+static void report_stop() {
+	switch (DEBUG_STOP.kind) {
+		case STOP_BREAK:
+			printf("Breakpoint at 0x%08x (hart %u).\n", DEBUG_STOP.pc, DEBUG_STOP.hart);
+			break;
+		case STOP_READ:
+		case STOP_WRITE:
+			printf("Watchpoint: %s 0x%08x by the instruction at 0x%08x (hart %u).\n",
+				DEBUG_STOP.kind == STOP_READ ? "read of" : "write to", DEBUG_STOP.address, DEBUG_STOP.pc, DEBUG_STOP.hart);
+			break;
+		default:
+			break;
+	}
+}
+
+/***************************************************************/
+/* Simulate RISCV for n cycles                                                                                       */
+/***************************************************************/
+void run(int num_cycles) {                                      
+	
+	if (!harts_running()) {
+		if (!BATCH) printf("Simulation Stopped\n\n");
+		return;
+	}
+
+	if (!BATCH) printf("Running simulator for %d cycles...\n\n", num_cycles);
+	if (num_cycles > 0 && execute(num_cycles) > 0) {
+		console_flush();
+		report_stop();
+		if (!BATCH) printf("Simulation Stopped.\n\n");
+	}
+	console_flush();
+}
+
+/**************************************************************rdump*/
+/* simulate to completion                                                                                               */
+/***************************************************************/
+void runAll() {                                                     
+	if (!harts_running()) {
+		if (!BATCH) printf("Simulation Stopped.\n\n");
+		return;
+	}
+
+	if (!BATCH) printf("Simulation Started...\n\n");
+	while (harts_running()){
+		execute(UINT32_MAX);
+		if (DEBUG_STOP.kind != STOP_NONE) {
+			console_flush();
+			report_stop();
+			if (!BATCH) printf("Simulation Stopped.\n\n");
+			return;
+		}
+	}
+	console_flush();
+	if (!BATCH) printf("Simulation Finished.\n\n");
+}
+
+/***************************************************************/ 
+/* Dump a word-aligned region of memory to the terminal                              */
+/***************************************************************/
+void mdump(uint32_t start, uint32_t stop) {          
+	uint32_t address;
+
+	printf("-------------------------------------------------------------\n");
+	printf("Memory content [0x%08x..0x%08x] :\n", start, stop);
+	printf("-------------------------------------------------------------\n");
+	printf("\t[Address in Hex (Dec) ]\t[Value]\n");
+	for (address = start; address <= stop; address += 4){
+		printf("\t0x%08x (%d) :\t0x%08x\n", address, address, mem_read_32(address));
+	}
+	printf("\n");
+}
+
+/***************************************************************/
+/* Dump current values of registers to the teminal                                              */   
+/***************************************************************/
+void rdump() {                               
+	int i; 
+	printf("-------------------------------------\n");
+	printf("Dumping Register Content\n");
+	printf("-------------------------------------\n");
+	printf("# Instructions Executed\t: %u\n", INSTRUCTION_COUNT);
+	if (TIMING || PIPELINE.instructions > 0) {
+		printf("# Cycles (pipeline)\t: %llu\n", (unsigned long long)pipeline_cycles());
+		printf("CPI\t\t\t: %.3f\n", PIPELINE.instructions ? (double)pipeline_cycles() / PIPELINE.instructions : 0.0);
+		printf("Load-use stalls\t\t: %llu\n", (unsigned long long)PIPELINE.load_use_stalls);
+		printf("Data stalls\t\t: %llu\n", (unsigned long long)PIPELINE.data_stalls);
+		printf("Flush cycles\t\t: %llu (%llu of %llu branches taken)\n", (unsigned long long)PIPELINE.flush_cycles,
+			(unsigned long long)PIPELINE.taken, (unsigned long long)PIPELINE.branches);
+	}
+	printf("PC\t: 0x%08x\n", CURRENT_STATE.PC);
+	if (NUM_HARTS > 1) {
+		printf("-------------------------------------\n");
+		printf("[Hart]\t[PC]\t\t[Instructions]\n");
+		for (i = 0; i < NUM_HARTS; i++) {
+			SIM = HARTS[i];
+			printf("%d\t0x%08x\t%u%s\n", i, CURRENT_STATE.PC, INSTRUCTION_COUNT, RUN_FLAG ? "" : " (halted)");
+		}
+		SIM = HARTS[0];
+	}
+	printf("-------------------------------------\n");
+	printf("[Register]\t[Value]\n");
+	printf("-------------------------------------\n");
+	for (i = 0; i < RISCV_REGS; i++){
+		printf("[R%d]\t: 0x%08x\n", i, CURRENT_STATE.REGS[i]);
+	}
+	printf("-------------------------------------\n");
+	printf("[HI]\t: 0x%08x\n", CURRENT_STATE.HI);
+	printf("[LO]\t: 0x%08x\n", CURRENT_STATE.LO);
+	printf("-------------------------------------\n");
+}
+
+/***************************************************************/
+/* Write the final machine state as one JSON object                                              */
+/***************************************************************/
+static void json_string(FILE *out, const char *str)
+{
+	fputc('"', out);
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\') {
+			fprintf(out, "\\%c", *str);
+		} else if ((unsigned char)*str < 0x20) {
+			fprintf(out, "\\u%04x", *str);
+		} else {
+			fputc(*str, out);
+		}
+	}
+	fputc('"', out);
+}
+
+void write_json(FILE *out) {
+	uint32_t i, address;
+
+	fprintf(out, "{\"program\": ");
+	json_string(out, prog_file);
+	fprintf(out, ", \"status\": \"%s\", \"exit_code\": %d", harts_running() ? "running" : "halted", EXIT_CODE);
+	fprintf(out, ", \"instructions\": %u, \"pc\": %u", INSTRUCTION_COUNT, CURRENT_STATE.PC);
+	if (NUM_HARTS > 1) {
+		fprintf(out, ", \"harts\": [");
+		for (i = 0; i < NUM_HARTS; i++) {
+			SIM = HARTS[i];
+			fprintf(out, "%s{\"pc\": %u, \"instructions\": %u, \"running\": %s}", i ? ", " : "",
+				CURRENT_STATE.PC, INSTRUCTION_COUNT, RUN_FLAG ? "true" : "false");
+		}
+		SIM = HARTS[0];
+		fprintf(out, "]");
+	}
+	if (TIMING || PIPELINE.instructions > 0) {
+		fprintf(out, ", \"pipeline\": {\"cycles\": %llu, \"load_use_stalls\": %llu, \"data_stalls\": %llu, \"flush_cycles\": %llu}",
+			(unsigned long long)pipeline_cycles(), (unsigned long long)PIPELINE.load_use_stalls,
+			(unsigned long long)PIPELINE.data_stalls, (unsigned long long)PIPELINE.flush_cycles);
+	}
+	fprintf(out, ", \"regs\": [");
+	for (i = 0; i < RISCV_REGS; i++) {
+		fprintf(out, "%s%u", i ? ", " : "", CURRENT_STATE.REGS[i]);
+	}
+	fprintf(out, "], \"hi\": %u, \"lo\": %u, \"memory\": [", CURRENT_STATE.HI, CURRENT_STATE.LO);
+	for (i = 0; i < NUM_JSON_RANGES; i++) {
+		fprintf(out, "%s{\"start\": %u, \"words\": [", i ? ", " : "", JSON_RANGES[i][0]);
+		for (address = JSON_RANGES[i][0]; address <= JSON_RANGES[i][1]; address += 4) {
+			fprintf(out, "%s%u", address != JSON_RANGES[i][0] ? ", " : "", mem_read_32(address));
+			if (address > UINT32_MAX - 4) break;
+		}
+		fprintf(out, "]}");
+	}
+	fprintf(out, "]}\n");
+}
+
+/***************************************************************/
+/* End a batch run: write the JSON and exit with the guest's status          */
+/***************************************************************/
+void finish() {
+	console_flush();
+	if (JSON_OUT != NULL) {
+		write_json(JSON_OUT);
+		fflush(JSON_OUT);
+		if (JSON_OUT != stdout) {
+			fclose(JSON_OUT);
+		}
+	}
+	exit(EXIT_CODE);
+}
+
+/***************************************************************/
+/* Read a command from standard input.                                                               */  
+/***************************************************************/
+void handle_command() {                         
+	char buffer[20];
+	char name[SNAPSHOT_NAME_LEN];
+	char spec[64];
+	char path[256];
+	char line[128];
+	uint32_t start, stop, cycles;
+	uint32_t register_no;
+	int register_value;
+	int hi_reg_value, lo_reg_value;
+	FILE *out;
+
+	if (!BATCH) printf("MU-RISCV SIM:> ");
+
+	if (fscanf(COMMAND_IN, "%19s", buffer) == EOF){
+		if (BATCH) finish();
+		exit(0);
+	}
+
+	switch(buffer[0]) {
+		case 'S':
+		case 's':
+			if (buffer[1] == 'n' || buffer[1] == 'N') {
+				if (fscanf(COMMAND_IN, "%31s", name) != 1) {
+					break;
+				}
+				snapshot_take(name);
+				if (!BATCH) printf("Snapshot %s taken.\n", name);
+				break;
+			}
+			runAll(); 
+			break;
+		case 'M':
+		case 'm':
+			if (fscanf(COMMAND_IN, "%x %x", &start, &stop) != 2){
+				break;
+			}
+			mdump(start, stop);
+			break;
+		case 'D':
+		case 'd':
+			if (fgets(line, sizeof(line), COMMAND_IN) == NULL) {
+				break;
+			}
+			path[0] = '\0';
+			if (sscanf(line, "%x %x %255s", &start, &stop, path) < 2) {
+				printf("Expected disasm <start> <stop> [file].\n");
+			} else if (path[0] == '\0') {
+				disasm(start, stop, stdout);
+			} else if ((out = fopen(path, "w")) == NULL) {
+				printf("Can't open %s.\n", path);
+			} else {
+				disasm(start, stop, out);
+				fclose(out);
+			}
+			break;
+		case '?':
+			help();
+			break;
+		case 'Q':
+		case 'q':
+			if (BATCH) finish();
+			printf("**************************\n");
+			printf("Exiting MU-RISCV! Good Bye...\n");
+			printf("**************************\n");
+			exit(0);
+		case 'R':
+		case 'r':
+			if (buffer[1] == 'd' || buffer[1] == 'D'){
+				rdump();
+			}else if((buffer[1] == 'e' || buffer[1] == 'E') && (buffer[2] == 'c' || buffer[2] == 'C')){
+				if (fscanf(COMMAND_IN, "%19s", buffer) != 1) {
+					break;
+				}
+				if (strcmp(buffer, "off") == 0) {
+					record_stop();
+				} else if (!record_start(strtoul(buffer, NULL, 0))) {
+					printf("Can't record with an interval of %s%s.\n", buffer, NUM_HARTS > 1 ? " and more than one hart" : "");
+				}
+			}else if(buffer[1] == 's' || buffer[1] == 'S'){
+				if (fscanf(COMMAND_IN, "%u", &cycles) != 1) {
+					break;
+				}
+				/* no further back than the first checkpoint */
+				cycles = cycles < INSTRUCTION_COUNT - record_first() ? INSTRUCTION_COUNT - cycles : record_first();
+				if (!record_seek(cycles)) {
+					printf("Not recording (see record).\n");
+				}
+			}else if(buffer[1] == 'c' || buffer[1] == 'C'){
+				if (!record_reverse()) {
+					printf("Not recording (see record).\n");
+				}
+				report_stop();
+			}else if((buffer[1] == 'e' || buffer[1] == 'E') && (buffer[2] == 's' || buffer[2] == 'S') && (buffer[3] == 't' || buffer[3] == 'T')){
+				if (fscanf(COMMAND_IN, "%31s", name) != 1) {
+					break;
+				}
+				if (!snapshot_restore(snapshot_find(name))) {
+					printf("No snapshot named %s.\n", name);
+				} else if (RECORD_INTERVAL) {
+					record_start(RECORD_INTERVAL);
+				}
+			}else if(buffer[1] == 'e' || buffer[1] == 'E'){
+				reset();
+			}
+			else {
+				if (fscanf(COMMAND_IN, "%d", &cycles) != 1) {
+					break;
+				}
+				run(cycles);
+			}
+			break;
+		case 'I':
+		case 'i':
+			if (fscanf(COMMAND_IN, "%u %i", &register_no, &register_value) != 2){
+				break;
+			}
+			CURRENT_STATE.REGS[register_no] = register_value;
+			if (RECORD_INTERVAL) {
+				record_start(RECORD_INTERVAL);
+			}
+			break;
+		case 'H':
+		case 'h':
+			if (buffer[1] == 'a' || buffer[1] == 'A') {
+				if (fscanf(COMMAND_IN, "%63s", spec) != 1) {
+					break;
+				}
+				if (!harts_config(spec)) {
+					printf("Bad hart setting %s (expected <n>[:lockstep|:free][:<quantum>]).\n", spec);
+				}
+				break;
+			}
+			if (fscanf(COMMAND_IN, "%i", &hi_reg_value) != 1){
+				break;
+			}
+			CURRENT_STATE.HI = hi_reg_value; 
+			if (RECORD_INTERVAL) {
+				record_start(RECORD_INTERVAL);
+			}
+			break;
+		case 'L':
+		case 'l':
+			if (fscanf(COMMAND_IN, "%i", &lo_reg_value) != 1){
+				break;
+			}
+			CURRENT_STATE.LO = lo_reg_value;
+			if (RECORD_INTERVAL) {
+				record_start(RECORD_INTERVAL);
+			}
+			break;
+		case 'C':
+		case 'c':
+			if (strcasecmp(buffer, "cachestats") == 0) {
+				cache_stats();
+				break;
+			}
+			if (fscanf(COMMAND_IN, "%63s", spec) != 1) {
+				break;
+			}
+			if (!cache_config(spec)) {
+				printf("Bad cache setting %s.\n", spec);
+			}
+			break;
+		case 'P':
+		case 'p':
+			if (buffer[1] == 'i' || buffer[1] == 'I') {
+				if (fscanf(COMMAND_IN, "%19s", buffer) != 1) {
+					break;
+				}
+				if (strcmp(buffer, "on") == 0) {
+					TIMING = TRUE;
+				} else if (strcmp(buffer, "off") == 0) {
+					TIMING = FALSE;
+				} else if (strcmp(buffer, "forward") == 0) {
+					PIPE_FORWARDING = TRUE;
+				} else if (strcmp(buffer, "stall") == 0) {
+					PIPE_FORWARDING = FALSE;
+				} else {
+					PIPE_BRANCH_PENALTY = strtoul(buffer, NULL, 0);
+				}
+				break;
+			}
+			if (strcasecmp(buffer, "predictor") == 0) {
+				if (fscanf(COMMAND_IN, "%63s", spec) != 1) {
+					break;
+				}
+				if (spec[0] >= '0' && spec[0] <= '9') {
+					predictor_report(strtoul(spec, NULL, 0));
+				} else if (!predictor_config(spec)) {
+					printf("Bad predictor setting %s.\n", spec);
+				}
+				break;
+			}
+			if (strcasecmp(buffer, "profile") == 0) {
+				if (fscanf(COMMAND_IN, "%19s", buffer) != 1) {
+					break;
+				}
+				if (strcmp(buffer, "on") == 0) {
+					if (PROFILE_HITS == NULL) {
+						profile_clear();
+					}
+					PROFILING = TRUE;
+				} else if (strcmp(buffer, "off") == 0) {
+					PROFILING = FALSE;
+				} else if (strcmp(buffer, "clear") == 0) {
+					profile_clear();
+				} else {
+					profile_report(strtoul(buffer, NULL, 0));
+				}
+				break;
+			}
+			print_program(); 
+			break;
+		case 'F':
+		case 'f':
+			console_flush();
+			break;
+		case 'W':
+		case 'w':
+			if (fgets(line, sizeof(line), COMMAND_IN) == NULL) {
+				break;
+			}
+			if (sscanf(line, "%63s", spec) == 1 && strcmp(spec, "off") == 0) {
+				watch_clear();
+				break;
+			}
+			spec[0] = '\0';
+			if (sscanf(line, "%x %63s", &start, spec) < 1) {
+				printf("Expected watch <addr> [r|w|rw] or watch off.\n");
+			} else if (strcmp(spec, "r") != 0 && strcmp(spec, "w") != 0 && strcmp(spec, "rw") != 0 && spec[0] != '\0') {
+				printf("Bad watch kind %s (expected r, w or rw).\n", spec);
+			} else if (!watch_add(start, (spec[0] == 'r' ? WATCH_READ : 0) | (spec[0] != 'r' || spec[1] == 'w' ? WATCH_WRITE : 0))) {
+				printf("At most %d watchpoints.\n", MAX_WATCHES);
+			}
+			break;
+		case 'B':
+		case 'b':
+			if (fscanf(COMMAND_IN, "%63s", spec) != 1) {
+				break;
+			}
+			if (strcmp(spec, "off") == 0) {
+				break_clear();
+			} else if (!break_add(strtoul(spec, NULL, 16))) {
+				printf("At most %d breakpoints.\n", MAX_BREAKPOINTS);
+			}
+			break;
+		case 'T':
+		case 't':
+			if (strcasecmp(buffer, "tracefile") == 0) {
+				if (fscanf(COMMAND_IN, "%63s", spec) != 1) {
+					break;
+				}
+				if (strcmp(spec, "off") == 0) {
+					trace_stop();
+				} else if ((strcmp(spec, "raw") == 0 || strcmp(spec, "packed") == 0) &&
+						fscanf(COMMAND_IN, "%255s", path) == 1) {
+					trace_start(path, spec[0] == 'p');
+				} else {
+					printf("Expected tracefile raw|packed <file> or tracefile off.\n");
+				}
+				break;
+			}
+			RETIRE_HOOK = (RETIRE_HOOK == NULL) ? print_retire : NULL;
+			printf("Instruction trace %s.\n", RETIRE_HOOK ? "on" : "off");
+			break;
+		default:
+			printf("Invalid Command.\n");
+			break;
+	}
+}
+
+
+/***************************************************************/
+/* Batch runner: the programs named by a directory or list file are handed out to       */
+/* worker threads, each simulating one program at a time on its own machine.           */
+/***************************************************************/
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void add_program(batch_job_t *job, uint32_t *capacity, const char *dir, const char *name)
+{
+	char *path;
+
+	if (job->count == *capacity) {
+		*capacity = *capacity ? *capacity * 2 : 64;
+		job->programs = realloc(job->programs, *capacity * sizeof(char *));
+	}
+	path = malloc(strlen(dir) + strlen(name) + 2);
+	sprintf(path, "%s%s%s", dir, *dir && dir[strlen(dir) - 1] != '/' ? "/" : "", name);
+	job->programs[job->count++] = path;
+}
+
+/* every regular, non-hidden file in a directory (by name), or every line of a list file */
+static int find_programs(batch_job_t *job, const char *path)
+{
+	struct stat st;
+	struct dirent *entry;
+	DIR *dir;
+	FILE *list;
+	char line[1024];
+	uint32_t capacity = 0;
+	size_t len;
+
+	if (stat(path, &st) != 0) {
+		printf("Error: Can't open batch %s\n", path);
+		return FALSE;
+	}
+	if (S_ISDIR(st.st_mode)) {
+		if ((dir = opendir(path)) == NULL) {
+			printf("Error: Can't open batch directory %s\n", path);
+			return FALSE;
+		}
+		while ((entry = readdir(dir)) != NULL) {
+			if (entry->d_name[0] != '.') {
+				add_program(job, &capacity, path, entry->d_name);
+				if (stat(job->programs[job->count - 1], &st) != 0 || !S_ISREG(st.st_mode)) {
+					free(job->programs[--job->count]);
+				}
+			}
+		}
+		closedir(dir);
+		qsort(job->programs, job->count, sizeof(char *), compare_names);
+		return TRUE;
+	}
+	if ((list = fopen(path, "r")) == NULL) {
+		printf("Error: Can't open batch list %s\n", path);
+		return FALSE;
+	}
+	while (fgets(line, sizeof(line), list) != NULL) {
+		len = strcspn(line, "\r\n");
+		line[len] = '\0';
+		if (len > 0 && line[0] != '#') {
+			add_program(job, &capacity, "", line);
+		}
+	}
+	fclose(list);
+	return TRUE;
+}
+
+static void batch_program(batch_job_t *job, uint32_t index)
+{
+	riscv_sim_t *sim;
+	FILE *out;
+	int i;
+
+	out = open_memstream(&job->results[index], &job->result_lens[index]);
+	if ((sim = riscv_sim_create()) == NULL) {
+		fprintf(out, "{\"program\": ");
+		json_string(out, job->programs[index]);
+		fprintf(out, ", \"status\": \"error\"}\n");
+		fclose(out);
+		__atomic_add_fetch(&job->failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	ENGINE = job->engine;
+	PROGRAM_FORMAT = job->format;
+	TIMING = job->timing;
+	CONSOLE_IN = job->console_in;
+	CONSOLE_OUT = job->console_out;
+	for (i = 0; i < job->num_cache_specs; i++) {
+		cache_config(job->cache_specs[i]);
+		CACHE_SIM = CACHE_SIM || strcmp(job->cache_specs[i], "off") != 0;
+	}
+	if (riscv_sim_load(sim, job->programs[index]) < 0) {
+		fprintf(out, "{\"program\": ");
+		json_string(out, job->programs[index]);
+		fprintf(out, ", \"status\": \"error\"}\n");
+		__atomic_add_fetch(&job->failed, 1, __ATOMIC_RELAXED);
+	} else {
+		if (job->predictor_spec != NULL) {
+			predictor_config(job->predictor_spec);
+		}
+		if (job->harts_spec != NULL) {
+			harts_config(job->harts_spec);
+		}
+		if (job->profiling) {
+			PROFILING = TRUE;
+			profile_clear();
+		}
+		if (job->limit >= 0) {
+			riscv_sim_step(sim, job->limit);
+		} else {
+			riscv_sim_run(sim);
+		}
+		write_json(out);
+	}
+	fclose(out);
+	riscv_sim_destroy(sim);
+}
+
+static void *batch_worker(void *arg)
+{
+	batch_job_t *job = arg;
+	uint32_t index;
+
+	while ((index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+		batch_program(job, index);
+	}
+	return NULL;
+}
+
+/* run every program, write one JSON line per program to JSON_OUT; FALSE if any failed to load */
+int run_batch(batch_job_t *job, const char *path, int workers)
+{
+	pthread_t *threads;
+	uint32_t i;
+	int started;
+
+	if (!find_programs(job, path)) {
+		return FALSE;
+	}
+	job->console_in = fopen("/dev/null", "r");
+	job->console_out = fopen("/dev/null", "w");
+	if (job->console_in == NULL || job->console_out == NULL) {
+		printf("Error: Can't open /dev/null\n");
+		return FALSE;
+	}
+	job->results = calloc(job->count, sizeof(char *));
+	job->result_lens = calloc(job->count, sizeof(size_t));
+	if (workers > (int)job->count) {
+		workers = job->count;
+	}
+	threads = malloc((workers > 0 ? workers : 1) * sizeof(pthread_t));
+	for (started = 0; started < workers; started++) {
+		if (pthread_create(&threads[started], NULL, batch_worker, job) != 0) {
+			break;
+		}
+	}
+	/* if no thread could be started the programs still run, one after another */
+	if (started == 0) {
+		batch_worker(job);
+	}
+	while (started > 0) {
+		pthread_join(threads[--started], NULL);
+	}
+	free(threads);
+
+	for (i = 0; i < job->count; i++) {
+		fwrite(job->results[i], 1, job->result_lens[i], JSON_OUT);
+		free(job->results[i]);
+		free(job->programs[i]);
+	}
+	fflush(JSON_OUT);
+	free(job->results);
+	free(job->result_lens);
+	free(job->programs);
+	fclose(job->console_in);
+	fclose(job->console_out);
+	return job->failed == 0;
+}
+
+/***************************************************************/
+/* Print command-line usage                                                                                 */
+/***************************************************************/
+void usage(const char *prog) {
+	printf("Usage: %s [options] <input program>\n", prog);
+	printf("       %s [options] --batch <dir>|<list>\n", prog);
+	printf("  -e %s\texecution engine (any but jit turns the JIT off)\n", ENGINE_NAMES);
+	printf("  -f hex|bin|elf\tprogram format (default: ELF by magic, .bin as flat binary, else hex)\n");
+	printf("  -p\t\tprofile from the first instruction (see the profile command)\n");
+	printf("  -q\t\tdo not log every word as it is loaded\n");
+	printf("  -t\t\trun the pipeline timing model from the first instruction\n");
+	printf("  -B <setting>\tbranch predictor as for the predictor command\n");
+	printf("  -C <setting>\tcache setting as for the cache command; any -C turns the caches on (repeatable)\n");
+	printf("  -H <n>[:lockstep|:free][:<quantum>]\trun <n> harts, as for the harts command\n");
+	printf("  -T <file>\trecord a binary trace of every instruction, load and store (read it with mu-trace)\n");
+	printf("  -Z\t\tpack the -T trace, typically to a quarter of its size\n");
+	printf("  -r\t\trun to completion without the prompt, then exit with the guest's exit code\n");
+	printf("  -n <n>\t\trun <n> instructions without the prompt, then exit\n");
+	printf("  -c <file>\trun the simulator commands in <file> instead of reading stdin\n");
+	printf("  -j <file>|-\twrite the final state as JSON to <file> or stdout (implies -r if nothing else runs)\n");
+	printf("  -m <start>:<stop>\tinclude memory [start..stop] in the JSON (repeatable)\n");
+	printf("  -b, --batch <dir>|<list>\trun every program in <dir> or named in <list> (one per line) in parallel,\n");
+	printf("\t\twriting one JSON line per program to -j (default stdout); guest input is empty and its output discarded\n");
+	printf("  -w <n>\t\tworker threads for -b (default: one per CPU)\n");
+	printf("  --gdb <port>|<socket>\twait for GDB on localhost:<port> or a unix socket instead of the prompt,\n");
+	printf("\t\texiting with the guest's exit code once it detaches\n\n");
+}
+
+/***************************************************************/
+/* main                                                                                                                                   */
+/***************************************************************/
+int main(int argc, char *argv[]) {                              
+	int opt;
+	int run_all = FALSE;
+	long run_count = -1;
+	const char *script = NULL, *json = NULL;
+	const char *cache_specs[8], *predictor_spec = NULL, *harts_spec = NULL;
+	int num_cache_specs = 0, quiet = FALSE, loaded, i;
+	const char *batch = NULL, *trace = NULL, *gdb = NULL;
+	int packed = FALSE;
+	long workers = sysconf(_SC_NPROCESSORS_ONLN);
+	batch_job_t job;
+	static const struct option long_options[] = {
+		{ "batch", required_argument, NULL, 'b' },
+		{ "gdb", required_argument, NULL, 'g' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	if (riscv_sim_create() == NULL) {
+		printf("Error: Out of memory\n");
+		exit(1);
+	}
+	atexit(console_flush);
+	atexit(trace_stop);
+	COMMAND_IN = stdin;
+	while ((opt = getopt_long(argc, argv, "b:e:f:pqrtn:c:j:m:w:B:C:H:T:Z", long_options, NULL)) != -1) {
+		switch (opt) {
+			case 'b':
+				batch = optarg;
+				break;
+			case 'g':
+				gdb = optarg;
+				break;
+			case 'w':
+				workers = strtol(optarg, NULL, 0);
+				if (workers < 1 || workers > 1024) {
+					printf("Error: Bad worker count %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'e':
+				if (!riscv_sim_set_engine(SIM, optarg)) {
+					printf("Error: Unknown engine %s (expected %s)\n", optarg, ENGINE_NAMES);
+					exit(1);
+				}
+				break;
+			case 'f':
+				if (strcmp(optarg, "hex") == 0) {
+					PROGRAM_FORMAT = FORMAT_HEX;
+				} else if (strcmp(optarg, "bin") == 0) {
+					PROGRAM_FORMAT = FORMAT_BINARY;
+				} else if (strcmp(optarg, "elf") == 0) {
+					PROGRAM_FORMAT = FORMAT_ELF;
+				} else {
+					printf("Error: Unknown program format %s (expected hex, bin or elf)\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'q':
+				quiet = TRUE;
+				break;
+			case 'p':
+				PROFILING = TRUE;
+				break;
+			case 't':
+				TIMING = TRUE;
+				break;
+			case 'B':
+				predictor_spec = optarg;
+				break;
+			case 'H':
+				harts_spec = optarg;
+				break;
+			case 'T':
+				trace = optarg;
+				break;
+			case 'Z':
+				packed = TRUE;
+				break;
+			case 'C':
+				if (num_cache_specs == 8) {
+					printf("Error: At most 8 cache settings\n");
+					exit(1);
+				}
+				cache_specs[num_cache_specs++] = optarg;
+				break;
+			case 'r':
+				run_all = TRUE;
+				break;
+			case 'n':
+				run_count = strtol(optarg, NULL, 0);
+				if (run_count < 0 || run_count > INT32_MAX) {
+					printf("Error: Bad instruction count %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'c':
+				script = optarg;
+				break;
+			case 'j':
+				json = optarg;
+				break;
+			case 'm':
+				if (NUM_JSON_RANGES == MAX_JSON_RANGES) {
+					printf("Error: At most %d memory ranges\n", MAX_JSON_RANGES);
+					exit(1);
+				}
+				if (sscanf(optarg, "%i:%i", &JSON_RANGES[NUM_JSON_RANGES][0], &JSON_RANGES[NUM_JSON_RANGES][1]) != 2) {
+					printf("Error: Bad memory range %s (expected start:stop)\n", optarg);
+					exit(1);
+				}
+				NUM_JSON_RANGES++;
+				break;
+			default:
+				usage(argv[0]);
+				exit(1);
+		}
+	}
+
+	if (batch != NULL) {
+		for (i = 0; i < num_cache_specs; i++) {
+			if (!cache_config(cache_specs[i])) {
+				printf("Error: Bad cache setting %s\n", cache_specs[i]);
+				exit(1);
+			}
+		}
+		if (predictor_spec != NULL && !predictor_config(predictor_spec)) {
+			printf("Error: Bad predictor setting %s (expected %s[:bits[:btb bits]])\n", predictor_spec, PRED_NAMES);
+			exit(1);
+		}
+		if (harts_spec != NULL && !harts_config(harts_spec)) {
+			printf("Error: Bad hart setting %s (expected <n>[:lockstep|:free][:<quantum>])\n", harts_spec);
+			exit(1);
+		}
+		JSON_OUT = json == NULL || strcmp(json, "-") == 0 ? stdout : fopen(json, "w");
+		if (JSON_OUT == NULL) {
+			printf("Error: Can't open JSON output %s\n", json);
+			exit(1);
+		}
+		memset(&job, 0, sizeof(job));
+		job.limit = run_count;
+		job.engine = ENGINE;
+		job.format = PROGRAM_FORMAT;
+		job.profiling = PROFILING;
+		job.timing = TIMING;
+		job.predictor_spec = predictor_spec;
+		job.harts_spec = harts_spec;
+		job.cache_specs = cache_specs;
+		job.num_cache_specs = num_cache_specs;
+		i = run_batch(&job, batch, workers);
+		if (JSON_OUT != stdout) {
+			fclose(JSON_OUT);
+		}
+		exit(i ? 0 : 1);
+	}
+
+	if (optind >= argc) {
+		printf("Error: You should provide input file.\n");
+		usage(argv[0]);
+		exit(1);
+	}
+
+	BATCH = run_all || run_count >= 0 || script != NULL || json != NULL;
+	QUIET = quiet || BATCH;
+	if (BATCH) {
+		if (script == NULL && run_count < 0) {
+			run_all = TRUE;
+		}
+	} else {
+		printf("\n**************************\n");
+		printf("Welcome to MU-RISCV SIM...\n");
+		printf("**************************\n\n");
+	}
+	if (script != NULL && (COMMAND_IN = fopen(script, "r")) == NULL) {
+		printf("Error: Can't open command script %s\n", script);
+		exit(1);
+	}
+	if (json != NULL) {
+		JSON_OUT = strcmp(json, "-") == 0 ? stdout : fopen(json, "w");
+		if (JSON_OUT == NULL) {
+			printf("Error: Can't open JSON output %s\n", json);
+			exit(1);
+		}
+	}
+
+	if (strlen(argv[optind]) >= sizeof(prog_file)) {
+		printf("Error: Program file name %s is too long\n", argv[optind]);
+		exit(1);
+	}
+	strcpy(prog_file, argv[optind]);
+	for (i = 0; i < num_cache_specs; i++) {
+		if (!cache_config(cache_specs[i])) {
+			printf("Error: Bad cache setting %s\n", cache_specs[i]);
+			exit(1);
+		}
+		CACHE_SIM = CACHE_SIM || strcmp(cache_specs[i], "off") != 0;
+	}
+	if ((loaded = load_program()) < 0) {
+		exit(1);
+	}
+	if (!BATCH) printf("Program loaded into memory.\n%d words written into memory.\n\n", (loaded + 3) / 4);
+	if (predictor_spec != NULL && !predictor_config(predictor_spec)) {
+		printf("Error: Bad predictor setting %s (expected %s[:bits[:btb bits]])\n", predictor_spec, PRED_NAMES);
+		exit(1);
+	}
+	CURRENT_STATE.PC = PROGRAM_ENTRY;
+	if (harts_spec != NULL && !harts_config(harts_spec)) {
+		printf("Error: Bad hart setting %s (expected <n>[:lockstep|:free][:<quantum>])\n", harts_spec);
+		exit(1);
+	}
+	if (trace != NULL && !trace_start(trace, packed)) {
+		exit(1);
+	}
+	BOOT_SNAPSHOT = snapshot_take(NULL);
+	if (PROFILING) {
+		profile_clear();
+	}
+	if (gdb != NULL) {
+		if (!gdb_serve(gdb)) {
+			exit(1);
+		}
+		finish();
+	}
+	if (BATCH) {
+		if (run_count >= 0) {
+			run(run_count);
+		} else if (run_all) {
+			runAll();
+		}
+		if (script == NULL) {
+			finish();
+		}
+	} else {
+		help();
+	}
+	while (1){
+		handle_command();
+	}
+	return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef RISCV_SIM_H
+#define RISCV_SIM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/******************************************************************************/
+/* Embeddable MU-RISCV simulator (libmu-riscv.a).                                               */
+/* Each riscv_sim_t is a complete guest machine with its own registers and memory, so   */
+/* one process can hold any number of them. A simulator may be used from any thread,    */
+/* but only from one thread at a time.                                                   */
+/******************************************************************************/
+typedef struct riscv_sim riscv_sim_t;
+
+/* a machine with empty memory; NULL if out of memory */
+riscv_sim_t *riscv_sim_create(void);
+void riscv_sim_destroy(riscv_sim_t *sim);
+
+/* load an ELF32, flat .bin or hex-text program; bytes loaded, or -1 after printing why not */
+int riscv_sim_load(riscv_sim_t *sim, const char *path);
+
+/* interp, threaded, block or jit; FALSE (0) if the name is unknown or unavailable */
+int riscv_sim_set_engine(riscv_sim_t *sim, const char *name);
+
+/* where the print syscalls write (stdout by default) */
+void riscv_sim_set_output(riscv_sim_t *sim, FILE *out);
+
+/* where the read syscalls read (stdin by default) */
+void riscv_sim_set_input(riscv_sim_t *sim, FILE *in);
+
+/* run count harts over the one memory, each starting at the program entry with a0 =   */
+/* its hart id and its own stack. Lock-step harts take turns an instruction at a time */
+/* on the calling thread; free-running ones each get a host thread. FALSE if count is  */
+/* not 1..64.                                                                            */
+int riscv_sim_set_harts(riscv_sim_t *sim, uint32_t count, int free_running);
+
+/* record every retired instruction and its load or store to a binary trace at path,  */
+/* packed if asked (mu-trace prints it); a NULL path stops the trace. While tracing, */
+/* the interpreter runs and harts take turns. FALSE if the file can't be created.     */
+int riscv_sim_trace(riscv_sim_t *sim, const char *path, int packed);
+
+/* wait for GDB on where, a TCP port on localhost or a unix socket path, and let it */
+/* drive the first hart until it detaches or disconnects. FALSE if no session could */
+/* be served (more than one hart, or the socket failed).                             */
+int riscv_sim_gdb(riscv_sim_t *sim, const char *where);
+
+/* retire up to n instructions (on each hart); returns how many were retired */
+uint32_t riscv_sim_step(riscv_sim_t *sim, uint32_t n);
+
+/* run until the program exits or runs off its text; returns the guest exit code */
+int32_t riscv_sim_run(riscv_sim_t *sim);
+
+/* back to the state right after riscv_sim_load() */
+void riscv_sim_reset(riscv_sim_t *sim);
+
+int riscv_sim_running(riscv_sim_t *sim);
+int32_t riscv_sim_exit_code(riscv_sim_t *sim);
+uint32_t riscv_sim_instructions(riscv_sim_t *sim);
+
+uint32_t riscv_sim_read_pc(riscv_sim_t *sim);
+void riscv_sim_write_pc(riscv_sim_t *sim, uint32_t pc);
+uint32_t riscv_sim_read_reg(riscv_sim_t *sim, uint32_t reg);
+void riscv_sim_write_reg(riscv_sim_t *sim, uint32_t reg, uint32_t value);
+
+/* one instruction word at pc as a line of text ("addi x8 x0 1\n") in buf, which must */
+/* hold RISCV_SIM_DISASM_MAX bytes; returns its length without the NUL               */
+#define RISCV_SIM_DISASM_MAX 48
+uint32_t riscv_sim_disasm(uint32_t pc, uint32_t instruction, char *buf);
+
+/* byte copies to and from guest memory; addresses outside every region read as zero */
+void riscv_sim_read_mem(riscv_sim_t *sim, uint32_t address, void *buf, uint32_t len);
+void riscv_sim_write_mem(riscv_sim_t *sim, uint32_t address, const void *buf, uint32_t len);
+
+#endif